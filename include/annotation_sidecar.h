@@ -0,0 +1,22 @@
+#ifndef ANNOTATION_SIDECAR_H
+#define ANNOTATION_SIDECAR_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include "editor_tools.h"
+
+// Sidecars live next to the image as hidden ".<image name>.lsann" files
+#define ANNOTATION_SIDECAR_SUFFIX ".lsann"
+#define ANNOTATION_SIDECAR_VERSION 1
+
+// Get the sidecar path for an image (caller frees)
+char* annotation_sidecar_path(const char* image_path);
+
+// Write the annotation list for an image. An empty list removes the sidecar.
+bool annotation_sidecar_save(const char* image_path, GList* annotations, GError** error);
+
+// Map the sidecar of an image and decode its annotations.
+// Returns NULL when the image has no (valid) sidecar.
+GList* annotation_sidecar_load(const char* image_path);
+
+#endif // ANNOTATION_SIDECAR_H
@@ -0,0 +1,41 @@
+#ifndef CAPTURE_SERVER_H
+#define CAPTURE_SERVER_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+// Name of the socket under $XDG_RUNTIME_DIR
+#define CAPTURE_SERVER_SOCKET "linshot.sock"
+
+// Commands from scripts and later launches, answered by the running
+// instance over a Unix-domain socket. Each connection carries one command
+// line and gets one reply line back: "ok" or "error", a space and a
+// message. The socket lives in the per-user runtime directory, which only
+// its owner can enter.
+typedef struct CaptureServer CaptureServer;
+
+// A command waiting for its reply
+typedef struct CaptureRequest CaptureRequest;
+
+// Called on the main thread for every command, without the line break.
+// Every request must be answered with capture_server_reply(), now or
+// once the work it asked for has finished.
+typedef void (*CaptureServerFunc)(CaptureRequest* request, const char* command, gpointer user_data);
+
+// Listen for commands. Fails with G_IO_ERROR_EXISTS if another instance
+// is listening already; a socket left behind by one that died is replaced.
+CaptureServer* capture_server_new(CaptureServerFunc handler, gpointer user_data, GError** error);
+
+// Stop listening and remove the socket; requests already handed out stay
+// valid and must still be answered
+void capture_server_free(CaptureServer* server);
+
+// Answer request and free it
+void capture_server_reply(CaptureRequest* request, bool ok, const char* message);
+
+// Send command to the running instance and wait for its reply. Returns
+// false with an error if nobody is listening or the connection fails;
+// otherwise *ok and *message (free with g_free()) hold the reply.
+bool capture_server_send(const char* command, bool* ok, char** message, GError** error);
+
+#endif // CAPTURE_SERVER_H
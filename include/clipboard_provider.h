@@ -0,0 +1,13 @@
+#ifndef CLIPBOARD_PROVIDER_H
+#define CLIPBOARD_PROVIDER_H
+
+#include <gtk/gtk.h>
+#include <stdbool.h>
+
+// Offer an already flattened image on the clipboard. The surface is
+// referenced, not copied, and nothing is encoded until a client pastes;
+// the encoded data is cached, so offering the same surface again while
+// we still own the clipboard costs nothing.
+bool clipboard_provider_set(cairo_surface_t* surface);
+
+#endif // CLIPBOARD_PROVIDER_H
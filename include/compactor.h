@@ -0,0 +1,39 @@
+#ifndef COMPACTOR_H
+#define COMPACTOR_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+typedef enum {
+    COMPACT_REPLACED,  // Rewritten smaller, same pixels and modification time
+    COMPACT_KEPT,      // Left alone: not eligible, or no smaller when rewritten
+    COMPACT_FAILED     // Could not be read or written, or changed meanwhile; worth retrying
+} CompactResult;
+
+// Called on the main thread for every file submitted. content_hash is the
+// hash64() of the new contents when result is COMPACT_REPLACED.
+typedef void (*CompactorDoneFunc)(const char* filepath, CompactResult result, gint64 saved_bytes,
+                                  guint64 content_hash, gpointer user_data);
+
+// Rewrites PNG screenshots with the strongest compression on a single
+// background thread at idle CPU and I/O priority, sleeping between files
+// so it only takes a fraction of the machine. Only opaque 8-bit PNGs
+// made of nothing but image data are touched, so no metadata is lost;
+// the result is decoded and compared pixel for pixel before it atomically
+// replaces the file, with its permissions and times. Files with several
+// hard links are left alone, as replacing one link would unshare them.
+typedef struct Compactor Compactor;
+
+// Start the background thread
+Compactor* compactor_new(CompactorDoneFunc done, gpointer user_data);
+
+// Queue a file
+void compactor_submit(Compactor* compactor, const char* filepath);
+
+// Number of files queued or being compacted
+guint compactor_get_pending(Compactor* compactor);
+
+// Drop queued files, stop the file in progress and wait for the thread
+void compactor_free(Compactor* compactor);
+
+#endif // COMPACTOR_H
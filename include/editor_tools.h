@@ -60,4 +60,10 @@ void annotation_draw(Annotation* annotation, cairo_t* cr);
 // Free an annotation
 void annotation_free(Annotation* annotation);
 
+// Deep copy an annotation, e.g. to hand it to another thread
+Annotation* annotation_copy(const Annotation* annotation);
+
+// Render the surface with all annotations drawn on top into a new ARGB32 surface
+cairo_surface_t* annotations_flatten(cairo_surface_t* surface, GList* annotations);
+
 #endif // EDITOR_TOOLS_H 
\ No newline at end of file
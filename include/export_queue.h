@@ -0,0 +1,58 @@
+#ifndef EXPORT_QUEUE_H
+#define EXPORT_QUEUE_H
+
+#include <glib.h>
+#include <cairo/cairo.h>
+#include <stdbool.h>
+
+typedef struct {
+    const char* name;           // gdk-pixbuf writer name, NULL if unsupported
+    const char* const* options; // NULL-terminated key/value pairs for the writer
+    const char* description;    // Used in error messages
+} ExportFormat;
+
+// Called on the main thread while a job advances (fraction in 0..1)
+typedef void (*ExportProgressFunc)(const char* filename, double fraction, gpointer user_data);
+
+// Called on the main thread once a job has finished, failed or been
+// cancelled. content_hash is hash64() of the file written, 0 on failure.
+typedef void (*ExportDoneFunc)(const char* filename, const GError* error, guint64 content_hash,
+                               gpointer user_data);
+
+// Called on the export worker with the hash of an encoded image: a newly
+// allocated path of a file that may hold the same bytes, or NULL
+typedef char* (*ExportLookupFunc)(guint64 content_hash, gpointer user_data);
+
+// Look up the output format from a filename's extension
+const ExportFormat* export_format_for_filename(const char* filename, GError** error);
+
+// Encode surface and write it to filename on the calling thread, without
+// the queue; the file is replaced atomically
+bool export_save_surface(cairo_surface_t* surface, const char* filename, const ExportFormat* format,
+                         GError** error);
+
+// Start the background export worker
+void export_queue_init(void);
+
+// Queue a flatten + encode + write job. The surface is referenced and the
+// annotations are deep-copied, so the caller may keep editing right away.
+bool export_queue_submit(cairo_surface_t* surface, GList* annotations, const char* filename,
+                         const ExportFormat* format,
+                         ExportProgressFunc progress, ExportDoneFunc done, gpointer user_data);
+
+// Write images that a file found through lookup already holds byte for
+// byte as a hard link to that file instead of a copy; NULL to always
+// write. A link shares the times of the file it links to. Falls back to
+// writing, e.g. across file systems.
+void export_queue_set_lookup(ExportLookupFunc lookup, gpointer user_data);
+
+// Number of jobs queued or running
+guint export_queue_get_pending(void);
+
+// Cancel every queued and running job; their done callbacks report G_IO_ERROR_CANCELLED
+void export_queue_cancel_all(void);
+
+// Wait for outstanding jobs and stop the worker
+void export_queue_shutdown(void);
+
+#endif // EXPORT_QUEUE_H
@@ -0,0 +1,21 @@
+#ifndef GLOBAL_HOTKEY_H
+#define GLOBAL_HOTKEY_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+// Called on the main thread, from an idle source, with the monotonic time
+// the key press reached us. Presses while it runs are ignored.
+typedef void (*GlobalHotkeyFunc)(gint64 pressed_at, gpointer user_data);
+
+// Grab keysym with exactly the X modifier masks modifiers (ShiftMask,
+// ControlMask, Mod1Mask...) on the whole display, whichever window has
+// the focus and whether Num Lock or Caps Lock are on. Replaces any
+// earlier grab. Fails if the key is unknown or another client holds it.
+bool global_hotkey_grab(unsigned long keysym, unsigned int modifiers,
+                        GlobalHotkeyFunc callback, gpointer user_data, GError** error);
+
+// Release the grab, if any
+void global_hotkey_ungrab(void);
+
+#endif // GLOBAL_HOTKEY_H
@@ -0,0 +1,14 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <glib.h>
+
+// 64-bit non-cryptographic hash (MurmurHash64A) of a byte range. Fast
+// enough for whole files and stable across runs and machines, so results
+// can be stored on disk.
+guint64 hash64(const void* data, gsize len, guint64 seed);
+
+// Hash a file's contents; false if it cannot be read
+gboolean hash64_file(const char* filepath, guint64* hash);
+
+#endif // HASH_H
@@ -0,0 +1,23 @@
+#ifndef HEADLESS_CAPTURE_H
+#define HEADLESS_CAPTURE_H
+
+#include <stdbool.h>
+#include "screen_capture.h"
+
+// One capture from the command line, taken without GTK: only the X
+// connection and the encoder are set up, and nothing is added to the
+// history
+typedef struct {
+    CaptureMode mode;
+    CaptureArea area;     // CAPTURE_AREA only
+    const char* out;      // File to write, NULL for a LinShot_<time> name in the current directory
+    const char* format;   // "png" or "webp", matching the extension of out if it has one;
+                          // NULL to go by that extension
+    bool verbose;         // Print the time taken by every stage to stderr
+} HeadlessCapture;
+
+// Take the capture and write it. Returns the process exit status; errors
+// are printed to stderr.
+int headless_capture_run(const HeadlessCapture* capture);
+
+#endif // HEADLESS_CAPTURE_H
@@ -0,0 +1,19 @@
+#ifndef HISTORY_GRID_H
+#define HISTORY_GRID_H
+
+#include <gtk/gtk.h>
+#include "screenshot_history.h"
+
+// Called when an entry of the grid is clicked
+typedef void (*HistoryGridActivateFunc)(ScreenshotEntry* entry, gpointer user_data);
+
+// Create a scrollable grid of history thumbnails. Cells are painted
+// straight from the history entries and only the rows in view are drawn,
+// so the cost of scrolling does not depend on the size of the library.
+// Thumbnails are requested as their rows scroll into view, and a status
+// line shows the thumbnail memory in use. The grid observes history until
+// it is destroyed. Right-clicking a cell offers to show only the
+// screenshots that look like it.
+GtkWidget* history_grid_new(ScreenshotHistory* history, HistoryGridActivateFunc activate, gpointer user_data);
+
+#endif // HISTORY_GRID_H
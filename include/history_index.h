@@ -0,0 +1,52 @@
+#ifndef HISTORY_INDEX_H
+#define HISTORY_INDEX_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+// Version of the on-disk layout; bump on any incompatible change
+#define HISTORY_INDEX_VERSION 3
+
+// Persistent listing of a screenshot directory, kept under
+// $XDG_CACHE_HOME/linshot and read through a memory mapping
+typedef struct HistoryIndex HistoryIndex;
+
+// One listed file. Unknown values are 0, or -1 for thumbnail_offset.
+typedef struct {
+    const char* name;        // File name inside the directory
+    gint64 mtime;
+    gint64 timestamp;        // When the screenshot was taken, which can be later than mtime
+    gint64 size;
+    guint32 width;           // Image dimensions
+    guint32 height;
+    guint64 content_hash;    // hash64() of the file contents
+    gint64 thumbnail_offset; // Record offset in the thumbnail cache
+    guint64 perceptual_hash; // thumbnail_perceptual_hash(), if has_perceptual_hash
+    bool has_perceptual_hash;
+    bool compacted;          // Already rewritten, or found not worth it
+} HistoryIndexRecord;
+
+// Map the index of directory. Returns NULL when there is none, it is
+// invalid, or the directory has been modified since it was written, in
+// which case the directory has to be listed again. Files modified in
+// place do not change the directory, so their records may be outdated.
+HistoryIndex* history_index_open(const char* directory);
+
+// Release the mapping; names of records read from it become invalid
+void history_index_close(HistoryIndex* index);
+
+// Number of records, which are ordered newest first
+guint history_index_get_count(HistoryIndex* index);
+
+// Read the record at position; the name points into the mapping
+bool history_index_get_record(HistoryIndex* index, guint position, HistoryIndexRecord* record);
+
+// Modification time of a directory in nanoseconds, as the index checks it
+bool history_index_get_directory_mtime(const char* directory, gint64* mtime_ns);
+
+// Replace the index of directory. records must be ordered newest first
+// and describe the directory as it was at directory_mtime_ns.
+bool history_index_write(const char* directory, gint64 directory_mtime_ns,
+                         const HistoryIndexRecord* records, guint count, GError** error);
+
+#endif // HISTORY_INDEX_H
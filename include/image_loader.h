@@ -0,0 +1,39 @@
+#ifndef IMAGE_LOADER_H
+#define IMAGE_LOADER_H
+
+#include <glib.h>
+#include <cairo/cairo.h>
+
+// Decoded images kept by default: the one shown and two neighbours on
+// either side
+#define IMAGE_LOADER_DEFAULT_CAPACITY 5
+
+// Decodes full-size images on worker threads, in any format gdk-pixbuf
+// reads, and keeps the most recently used ones in memory
+typedef struct ImageLoader ImageLoader;
+
+// Called on the main thread with the decoded ARGB32 image, or NULL and an
+// error. The image belongs to the loader; reference it to keep it.
+typedef void (*ImageLoaderDoneFunc)(const char* filepath, cairo_surface_t* image,
+                                    const GError* error, gpointer user_data);
+
+// Create a loader keeping up to capacity decoded images
+ImageLoader* image_loader_new(guint capacity);
+
+// Drop queued work, wait for running decodes and free every image
+void image_loader_free(ImageLoader* loader);
+
+// New reference to the decoded image of filepath if it is cached and the
+// file has not changed since, otherwise NULL
+cairo_surface_t* image_loader_lookup(ImageLoader* loader, const char* filepath);
+
+// Decode filepath ahead of all prefetches and pass it to done. Only the
+// latest open is reported; opening another file supersedes it.
+void image_loader_open(ImageLoader* loader, const char* filepath,
+                       ImageLoaderDoneFunc done, gpointer user_data);
+
+// Decode filepath into the cache in the background, unless it is there
+// or on its way already
+void image_loader_prefetch(ImageLoader* loader, const char* filepath);
+
+#endif // IMAGE_LOADER_H
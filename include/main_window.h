@@ -5,31 +5,56 @@
 #include <stdbool.h>
 #include "screenshot_history.h"
 #include "editor_tools.h"
+#include "raster_undo.h"
+#include "image_loader.h"
+#include "compactor.h"
+#include "capture_server.h"
 
 typedef struct {
     GtkWidget* window;
     GtkWidget* toolbar;
     GtkWidget* canvas;
     GtkWidget* statusbar;
-    GtkWidget* history_flow_box;  // Flow box for history thumbnails
+    GtkWidget* history_grid;  // Virtualized grid of history thumbnails
     ScreenshotHistory screenshot_history;
 } MainWindow;
 
 typedef struct {
     MainWindow win;
-    cairo_surface_t* current_image;
+    cairo_surface_t* current_image;  // May be shared with export jobs and the clipboard: copy before raster edits
+                                     // when cairo_surface_get_reference_count() is above one
+    char* current_path;       // File the current image was captured to or opened from, NULL until
+                              // a capture has been written
+    struct ExportContext* capture_export;  // Save of the current capture while it is written
     ToolSettings current_tool;
     GList* annotations;       // Current annotations
+    GList* baked;             // Annotations flattened into current_image by a save over current_path
+                              // that has not succeeded yet; the sidecar keeps them until it has
     GList* undo_stack;       // Stack of removed annotations for undo
+    GList* raster_undo_stack; // RasterEdit tile snapshots, most recent last; no tool records any yet
     bool drawing;
     PointPair start_point;
     Annotation* selected_text;  // Currently selected text annotation
     double drag_start_x;       // Starting point for text dragging
     double drag_start_y;
+    guint64 generation;        // Bumped on every image or annotation change
+    cairo_surface_t* composite;  // Image with annotations flattened, shared by display, copy and save
+    guint64 composite_generation;  // Generation the composite was rendered at
+    GList* exports;               // ExportContext of every save in flight
+    ImageLoader* image_loader;    // Decodes history images off the main thread
+    char* loading_path;           // History image being decoded for display, NULL if none
+    Compactor* compactor;         // Rewrites old screenshots smaller in the background
+    guint compact_source;         // Periodically hands old screenshots to the compactor
+    gint64 startup_time;          // Monotonic time the process started
+    gint64 first_frame_time;      // Monotonic time the window was first drawn, 0 until then
+    bool startup_stats;           // Print startup timings (--startup-stats)
+    gint64 shortcut_time;         // Monotonic time of the shortcut press being handled, 0 if none
+    CaptureServer* capture_server;  // Takes commands from scripts and later launches
 } MainWindowData;
 
-// Initialize and show the main window
-bool main_window_init(MainWindow* win, int argc, char* argv[]);
+// Initialize and show the main window; startup_time is the monotonic time
+// the process started, which startup timings count from
+bool main_window_init(MainWindow* win, int argc, char* argv[], gint64 startup_time);
 
 // Clean up resources
 void main_window_cleanup(MainWindow* win);
@@ -0,0 +1,23 @@
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <cairo/cairo.h>
+#include <stdbool.h>
+
+// Called on the encoding thread as stripes complete (fraction in 0..1)
+typedef void (*PngWriterProgressFunc)(double fraction, gpointer user_data);
+
+// Encode premultiplied ARGB32 pixels (cairo's layout) as a PNG file image.
+// Row stripes are filtered and deflated on all cores and joined into a
+// single zlib stream. Fully opaque images are written as RGB.
+GBytes* png_writer_encode_data(const unsigned char* data, int width, int height, int stride, int level,
+                               GCancellable* cancellable, PngWriterProgressFunc progress,
+                               gpointer user_data, GError** error);
+
+// Encode an ARGB32 image surface
+GBytes* png_writer_encode_surface(cairo_surface_t* surface, int level, GCancellable* cancellable,
+                                  PngWriterProgressFunc progress, gpointer user_data, GError** error);
+
+#endif // PNG_WRITER_H
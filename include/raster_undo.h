@@ -0,0 +1,46 @@
+#ifndef RASTER_UNDO_H
+#define RASTER_UNDO_H
+
+#include <glib.h>
+#include <cairo/cairo.h>
+#include <stdbool.h>
+
+// Tile snapshots for undoing edits to the pixels of an image. No tool
+// edits pixels yet, so nothing records edits: the editor only keeps the
+// stack (MainWindowData.raster_undo_stack) and undoes from it.
+
+// Edge length of the square tiles raster edits are snapshotted in
+#define RASTER_TILE_SIZE 64
+
+typedef struct {
+    int tile_x, tile_y;     // Tile position in the grid
+    int width, height;      // Tile size in pixels (edge tiles may be smaller)
+    unsigned char* pixels;  // Pixels before the edit, rows packed tightly
+} RasterTile;
+
+typedef struct {
+    int image_width, image_height;  // Size of the surface the edit belongs to
+    int tiles_x, tiles_y;           // Tile grid dimensions
+    guint8* saved;                  // Per-tile flag, set once a tile has been snapshotted
+    GPtrArray* tiles;               // RasterTile snapshots, only for touched tiles
+    guint annotation_count;         // Number of annotations when the edit was made
+} RasterEdit;
+
+// Start a raster edit on an ARGB32 image surface, made while the document
+// had annotation_count annotations. Nothing is copied yet.
+RasterEdit* raster_edit_begin(cairo_surface_t* surface, guint annotation_count);
+
+// Snapshot the tiles covering the given rectangle before it gets modified.
+// Tiles already saved by this edit are skipped (copy-on-write).
+void raster_edit_touch(RasterEdit* edit, cairo_surface_t* surface, int x, int y, int width, int height);
+
+// Write the saved tiles back into the surface
+bool raster_edit_undo(RasterEdit* edit, cairo_surface_t* surface);
+
+// Bytes of pixel data held by the edit's snapshots
+gsize raster_edit_get_size(const RasterEdit* edit);
+
+// Free an edit and its snapshots
+void raster_edit_free(RasterEdit* edit);
+
+#endif // RASTER_UNDO_H
@@ -16,12 +16,22 @@ typedef enum {
     CAPTURE_WINDOW
 } CaptureMode;
 
-// Initialize screen capture
+// Open the display connection; calling it again while open is cheap, so
+// long-running callers may keep it between captures
 bool capture_init(void);
 
-// Capture screen based on mode and area
+// Capture screen based on mode and area. Areas are clipped to the screen.
+// CAPTURE_WINDOW ignores area and takes the active window with its frame,
+// or the window under the pointer when no window manager says which.
 cairo_surface_t* capture_screen(CaptureMode mode, CaptureArea* area);
 
+// Capture into a pooled surface with an extra margin on every side, so a
+// border can be drawn in place. The margin pixels are left undefined.
+cairo_surface_t* capture_screen_with_margin(CaptureMode mode, CaptureArea* area, int margin);
+
+// Parse "x,y,width,height" with a positive size
+bool capture_parse_area(const char* text, CaptureArea* area);
+
 // Clean up resources
 void capture_cleanup(void);
 
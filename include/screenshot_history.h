@@ -5,31 +5,180 @@
 #include <stdbool.h>
 #include <time.h>
 
+// Thumbnail memory kept unless screenshot_history_set_thumbnail_budget()
+// says otherwise
+#define SCREENSHOT_HISTORY_DEFAULT_THUMBNAIL_BUDGET (128 * 1024 * 1024)
+
+// Perceptual hashes at most this many bits apart count as similar
+#define SCREENSHOT_HISTORY_SIMILAR_DISTANCE 10
+
 typedef struct {
     char* filepath;
-    time_t timestamp;
-    GdkPixbuf* thumbnail;
+    time_t timestamp;   // When taken, which orders the history: the file's mtime, or the
+                        // capture time of a capture stored as a link to an older file
+    time_t mtime;       // Modification time of the file
+    gint64 size;
+    GdkPixbuf* thumbnail;  // NULL until requested and decoded, or once evicted
+    bool thumbnail_pending;  // A thumbnail job is queued or running
+    GList lru_link;     // Node in thumbnail_lru while thumbnail is set
+    gint64 last_used;   // Monotonic time the thumbnail was last requested
+    guint32 width;      // Image dimensions, 0 until known
+    guint32 height;
+    guint64 content_hash;     // hash64() of the file, 0 until known
+    gint64 thumbnail_offset;  // Record in the thumbnail cache, -1 if unknown
+    guint64 perceptual_hash;  // thumbnail_perceptual_hash() of the thumbnail
+    bool has_perceptual_hash;  // perceptual_hash is known
+    bool compacted;           // Rewritten by the compactor, or found not worth it
+    bool compacting;          // With the compactor, whose swap keeps the timestamp
+    time_t compact_retry;     // Compaction failed; not worth trying again before this
 } ScreenshotEntry;
 
+// Selects a page of the history
 typedef struct {
-    GList* entries;  // List of ScreenshotEntry
+    time_t before;  // Only entries taken before this, 0 for no bound
+    time_t after;   // Only entries taken after this, 0 for no bound
+    guint offset;   // Matching entries to skip
+    guint limit;    // Most entries to return, 0 for no limit
+} ScreenshotHistoryQuery;
+
+// Change notifications for views, all delivered on the main thread.
+// Positions are indexes into entries; any callback may be NULL.
+typedef struct {
+    // entry has been inserted at position
+    void (*inserted)(ScreenshotEntry* entry, guint position, gpointer user_data);
+    // entry at position is about to be removed and freed
+    void (*removed)(ScreenshotEntry* entry, guint position, gpointer user_data);
+    // entry has moved from old_position to new_position
+    void (*moved)(ScreenshotEntry* entry, guint old_position, guint new_position, gpointer user_data);
+    // entry at position has a new thumbnail
+    void (*thumbnail_changed)(ScreenshotEntry* entry, guint position, gpointer user_data);
+    // every entry has been replaced, e.g. by loading another directory
+    void (*reset)(gpointer user_data);
+} ScreenshotHistoryObserver;
+
+typedef struct {
+    GPtrArray* entries;  // ScreenshotEntry, most recent first
     char* screenshot_path;  // Path where screenshots are stored
+    GHashTable* index;  // Filepath -> ScreenshotEntry in entries
+    GThreadPool* thumbnail_pool;  // Decodes requested thumbnails, latest request first
+    GAsyncQueue* thumbnail_results;  // Finished jobs waiting for the main loop
+    gint load_generation;  // Bumped by every load so stale jobs are dropped
+    gint flush_pending;    // A batch delivery is scheduled
+    guint request_sequence;  // Orders thumbnail requests
+    guint backfill_position;  // Entries before this have been offered for perceptual hashing
+    guint backfill_jobs;      // Background hashing jobs queued or running
+    GHashTable* pending_jobs;  // Filepath -> thumbnail job queued or running, main thread only
+    GMutex jobs_lock;          // Guards when pending jobs were last requested
+    GQueue thumbnail_lru;    // Entries holding a thumbnail, most recently used first
+    gsize thumbnail_bytes;   // Pixel memory of the thumbnails held
+    gsize thumbnail_peak_bytes;
+    gsize thumbnail_budget;  // Least recently used thumbnails beyond this are dropped
+    GFileMonitor* monitor;   // Watches the loaded directory
+    GHashTable* pending_changes;  // Paths reported by the monitor, not yet applied
+    guint changes_source;    // Applies pending_changes once a burst settles
+    char* loaded_path;       // Directory the entries were listed from
+    bool listing_dirty;      // Entries differ from the stored history index
+    GHashTable* contents;    // content_hash -> path of an entry with it, under contents_lock
+    GMutex contents_lock;    // Lets export workers look up contents
+    const ScreenshotHistoryObserver* observer;
+    gpointer observer_data;
 } ScreenshotHistory;
 
 // Initialize screenshot history
 void screenshot_history_init(ScreenshotHistory* history);
 
-// Add a new screenshot to history
+// Add a new screenshot to history. A file that is already listed is
+// updated in place (and moved if its timestamp changed) instead.
 void screenshot_history_add(ScreenshotHistory* history, const char* filepath);
 
-// Load existing screenshots from disk
+// Add a screenshot that was just written from surface, building its
+// thumbnail from the pixels in memory instead of decoding the file.
+// content_hash is hash64() of the bytes written, 0 to have it read later
+// along with the thumbnail. taken is when it was captured; a file that is
+// older, being a link to an identical earlier screenshot, is listed at
+// that time instead of its own.
+void screenshot_history_add_with_surface(ScreenshotHistory* history, const char* filepath, cairo_surface_t* surface,
+                                         guint64 content_hash, time_t taken);
+
+// Path of a listed file whose content_hash is content_hash, newly
+// allocated, or NULL. Only a candidate: other bytes may share the hash.
+// Safe to call from any thread.
+char* screenshot_history_find_content(ScreenshotHistory* history, guint64 content_hash);
+
+// Load existing screenshots from disk. Entries are listed right away with
+// no thumbnail; see screenshot_history_request_thumbnail(). An up-to-date
+// history index is used instead of listing the directory. The directory
+// is then watched, and files created, changed, renamed or deleted by
+// any program are applied to the history as they happen.
 void screenshot_history_load(ScreenshotHistory* history);
 
+// Mark the thumbnail of entry as in use, queueing it if it has none and
+// none is on the way. It is loaded on a worker thread, from the thumbnail
+// cache or by decoding the file, and delivered in a batch through the
+// observer. The latest requests are served first, so a view can simply
+// ask for whatever is on screen each time it draws. Requests not repeated
+// within a second are dropped undecoded when their turn comes, and the
+// entry is reported through thumbnail_changed so a view still showing it
+// asks again.
+void screenshot_history_request_thumbnail(ScreenshotHistory* history, ScreenshotEntry* entry);
+
+// Set how much thumbnail memory to keep. Least recently used thumbnails
+// beyond it are dropped and loaded again when next requested; thumbnails
+// used within the last second are never dropped.
+void screenshot_history_set_thumbnail_budget(ScreenshotHistory* history, gsize bytes);
+
+// Thumbnail memory held now, and the most held at any time
+void screenshot_history_get_thumbnail_memory(ScreenshotHistory* history, gsize* current, gsize* peak);
+
+// Entries that look like entry: those whose perceptual hash is at most
+// max_distance bits away from entry's, nearest first, entry included.
+// Hashes are taken when a thumbnail is first loaded, and for every other
+// entry by background jobs queued behind the view's requests after a
+// load; they are kept in the history index. Entries not reached yet are
+// not considered. Returns NULL if entry has no hash yet; free the result
+// with g_ptr_array_unref().
+GPtrArray* screenshot_history_find_similar(ScreenshotHistory* history, ScreenshotEntry* entry,
+                                           guint max_distance);
+
+// Record that entry has been handed to the compactor. Until it reports
+// back, a change to the file that keeps its timestamp is taken for the
+// compactor's swap and left to screenshot_history_compacted().
+void screenshot_history_compacting(ScreenshotHistory* history, ScreenshotEntry* entry);
+
+// Record that the compactor could not process filepath, and that it is
+// not worth trying again before retry_after (or until the file changes)
+void screenshot_history_compact_failed(ScreenshotHistory* history, const char* filepath, time_t retry_after);
+
+// Record that the compactor is done with filepath. When replaced, the
+// file now holds the same pixels in fewer bytes with the same times: the
+// entry keeps its thumbnail, dimensions and perceptual hash, takes the new
+// size and content_hash, and its cached thumbnail is stored again under
+// the new size. Either way the entry is not offered for compaction again
+// until the file changes.
+void screenshot_history_compacted(ScreenshotHistory* history, const char* filepath, bool replaced,
+                                  guint64 content_hash);
+
+// Set the view notified of changes; observer must outlive the history
+void screenshot_history_set_observer(ScreenshotHistory* history,
+                                     const ScreenshotHistoryObserver* observer, gpointer user_data);
+
 // Clean up screenshot history
 void screenshot_history_cleanup(ScreenshotHistory* history);
 
-// Get sorted list of screenshots (most recent first)
-GList* screenshot_history_get_sorted(ScreenshotHistory* history);
+// Number of entries
+guint screenshot_history_get_count(ScreenshotHistory* history);
+
+// Position of entry in the sorted history, found by binary search, or the
+// count if it is not listed
+guint screenshot_history_get_position(ScreenshotHistory* history, ScreenshotEntry* entry);
+
+// Get a page of screenshots (most recent first), or all of them for a
+// NULL query. The result points into the history and holds *count
+// entries; it is valid until the history next changes. Timestamp bounds
+// are found by binary search, so a page costs O(log n) whatever its
+// offset.
+ScreenshotEntry* const* screenshot_history_get_sorted(ScreenshotHistory* history,
+                                                      const ScreenshotHistoryQuery* query, guint* count);
 
 // Set the screenshot path
 void screenshot_history_set_path(ScreenshotHistory* history, const char* path);
@@ -0,0 +1,19 @@
+#ifndef SURFACE_POOL_H
+#define SURFACE_POOL_H
+
+#include <cairo/cairo.h>
+#include <stddef.h>
+
+// Get an ARGB32 image surface backed by a recycled buffer. The contents are
+// undefined, so the caller must write every pixel it uses. The buffer goes
+// back to the pool when the last reference to the surface is dropped, from
+// any thread.
+cairo_surface_t* surface_pool_acquire(int width, int height);
+
+// Bytes currently parked in the pool
+size_t surface_pool_get_cached_bytes(void);
+
+// Free every parked buffer
+void surface_pool_trim(void);
+
+#endif // SURFACE_POOL_H
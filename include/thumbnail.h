@@ -0,0 +1,24 @@
+#ifndef THUMBNAIL_H
+#define THUMBNAIL_H
+
+#include <gtk/gtk.h>
+
+// Thumbnails are 8-bit RGBA and fit in a THUMBNAIL_SIZE square; smaller
+// images keep their size
+#define THUMBNAIL_SIZE 200
+
+// Downscale an in-memory ARGB32 image to a history thumbnail with a box
+// filter, without touching the file it was saved to
+GdkPixbuf* thumbnail_from_surface(cairo_surface_t* surface);
+
+// Decode an image file and downscale it to a history thumbnail. PNG and
+// JPEG are decoded row by row (JPEG at a reduced DCT scale) straight into
+// the box filter, so the full-size image is never held in memory.
+GdkPixbuf* thumbnail_from_file(const char* filepath);
+
+// 64-bit difference hash (dHash) of a thumbnail: the image is averaged
+// down to 9x8 grey cells and each bit tells whether a cell is brighter
+// than its right neighbour. Similar images differ in few bits.
+guint64 thumbnail_perceptual_hash(GdkPixbuf* thumbnail);
+
+#endif // THUMBNAIL_H
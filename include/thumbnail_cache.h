@@ -0,0 +1,26 @@
+#ifndef THUMBNAIL_CACHE_H
+#define THUMBNAIL_CACHE_H
+
+#include <gtk/gtk.h>
+#include <stdbool.h>
+
+// Name of the pack file under $XDG_CACHE_HOME/linshot
+#define THUMBNAIL_CACHE_FILE "thumbnails.pack"
+
+// Cached thumbnail for a file, or NULL if there is none for this exact
+// modification time and size. Safe to call from any thread. The record at
+// *offset, as returned by an earlier lookup or store, is tried first; only
+// when that misses (or offset is NULL) is the whole cache indexed.
+// *offset is set to where the thumbnail was found, or -1. Offsets stay
+// valid until the cache is compacted.
+GdkPixbuf* thumbnail_cache_lookup_at(const char* filepath, gint64 mtime, gint64 size, gint64* offset);
+
+// Remember the thumbnail of a file as of the given modification time and
+// size. Returns the offset of its record, or -1 if it was not written.
+gint64 thumbnail_cache_store(const char* filepath, gint64 mtime, gint64 size, GdkPixbuf* thumbnail);
+
+// Flush the cache, dropping superseded entries and entries for files
+// deleted or changed since, once they take up most of the pack file
+void thumbnail_cache_close(void);
+
+#endif // THUMBNAIL_CACHE_H
@@ -0,0 +1,296 @@
+#include "../include/annotation_sidecar.h"
+#include <glib/gstdio.h>
+#include <string.h>
+
+/*
+ * On-disk layout (all integers little-endian):
+ *
+ *   SidecarHeader
+ *   SidecarRecord[record_count]    fixed size, indexable straight from the mapping
+ *   data blob                      text, font families and freehand points
+ *
+ * Records reference the blob by offset/length, so a reader never has to
+ * parse the file sequentially.
+ */
+
+static const char SIDECAR_MAGIC[4] = { 'L', 'S', 'A', 'N' };
+
+enum {
+    RECORD_FLAG_FILL   = 1 << 0,
+    RECORD_FLAG_BOLD   = 1 << 1,
+    RECORD_FLAG_ITALIC = 1 << 2
+};
+
+typedef struct {
+    char magic[4];
+    guint16 version;
+    guint16 header_size;
+    guint32 record_count;
+    guint32 record_size;
+    guint32 data_offset;
+    guint32 data_size;
+} SidecarHeader;
+
+typedef struct {
+    guint8 type;
+    guint8 flags;
+    guint16 reserved;
+    guint32 color;          // RGBA, 8 bits per channel
+    guint32 line_width;     // IEEE float bits
+    guint32 font_size;      // IEEE float bits
+    gint32 x1, y1, x2, y2;
+    guint32 text_offset, text_len;
+    guint32 family_offset, family_len;
+    guint32 points_offset, point_count;  // point_count pairs of gint32 x, y
+} SidecarRecord;
+
+G_STATIC_ASSERT(sizeof(SidecarHeader) == 24);
+G_STATIC_ASSERT(sizeof(SidecarRecord) == 56);
+
+static guint32 float_to_le(float value) {
+    guint32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return GUINT32_TO_LE(bits);
+}
+
+static float float_from_le(guint32 value) {
+    guint32 bits = GUINT32_FROM_LE(value);
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+static guint32 pack_color(const GdkRGBA* color) {
+    guint32 r = (guint32)(CLAMP(color->red, 0.0, 1.0) * 255.0 + 0.5);
+    guint32 g = (guint32)(CLAMP(color->green, 0.0, 1.0) * 255.0 + 0.5);
+    guint32 b = (guint32)(CLAMP(color->blue, 0.0, 1.0) * 255.0 + 0.5);
+    guint32 a = (guint32)(CLAMP(color->alpha, 0.0, 1.0) * 255.0 + 0.5);
+    return (r << 24) | (g << 16) | (b << 8) | a;
+}
+
+static void unpack_color(guint32 packed, GdkRGBA* color) {
+    color->red = ((packed >> 24) & 0xFF) / 255.0;
+    color->green = ((packed >> 16) & 0xFF) / 255.0;
+    color->blue = ((packed >> 8) & 0xFF) / 255.0;
+    color->alpha = (packed & 0xFF) / 255.0;
+}
+
+// Append bytes to the data blob and return their offset
+static guint32 append_blob(GByteArray* blob, const void* data, gsize len) {
+    guint32 offset = blob->len;
+    if (len > 0) {
+        g_byte_array_append(blob, data, len);
+    }
+    return offset;
+}
+
+char* annotation_sidecar_path(const char* image_path) {
+    if (!image_path) return NULL;
+    
+    char* dir = g_path_get_dirname(image_path);
+    char* base = g_path_get_basename(image_path);
+    char* name = g_strdup_printf(".%s%s", base, ANNOTATION_SIDECAR_SUFFIX);
+    char* path = g_build_filename(dir, name, NULL);
+    
+    g_free(name);
+    g_free(base);
+    g_free(dir);
+    return path;
+}
+
+bool annotation_sidecar_save(const char* image_path, GList* annotations, GError** error) {
+    if (!image_path) return false;
+    
+    char* path = annotation_sidecar_path(image_path);
+    
+    // Nothing to keep: drop a stale sidecar instead of writing an empty one
+    if (!annotations) {
+        g_unlink(path);
+        g_free(path);
+        return true;
+    }
+    
+    guint count = g_list_length(annotations);
+    GByteArray* records = g_byte_array_sized_new(count * sizeof(SidecarRecord));
+    GByteArray* blob = g_byte_array_new();
+    
+    for (GList* iter = annotations; iter != NULL; iter = iter->next) {
+        Annotation* annotation = (Annotation*)iter->data;
+        SidecarRecord record = {0};
+        
+        record.type = (guint8)annotation->type;
+        record.flags = (annotation->settings.fill ? RECORD_FLAG_FILL : 0) |
+                       (annotation->settings.font.is_bold ? RECORD_FLAG_BOLD : 0) |
+                       (annotation->settings.font.is_italic ? RECORD_FLAG_ITALIC : 0);
+        record.color = GUINT32_TO_LE(pack_color(&annotation->settings.color));
+        record.line_width = float_to_le((float)annotation->settings.line_width);
+        record.font_size = float_to_le((float)annotation->settings.font.size);
+        record.x1 = GUINT32_TO_LE(annotation->bounds.x1);
+        record.y1 = GUINT32_TO_LE(annotation->bounds.y1);
+        record.x2 = GUINT32_TO_LE(annotation->bounds.x2);
+        record.y2 = GUINT32_TO_LE(annotation->bounds.y2);
+        
+        if (annotation->text) {
+            gsize len = strlen(annotation->text);
+            record.text_offset = GUINT32_TO_LE(append_blob(blob, annotation->text, len));
+            record.text_len = GUINT32_TO_LE(len);
+        }
+        
+        if (annotation->settings.font.family) {
+            gsize len = strlen(annotation->settings.font.family);
+            record.family_offset = GUINT32_TO_LE(append_blob(blob, annotation->settings.font.family, len));
+            record.family_len = GUINT32_TO_LE(len);
+        }
+        
+        if (annotation->path.point_count > 0) {
+            // Keep point arrays 4-byte aligned inside the blob
+            static const guint8 padding[4] = {0};
+            append_blob(blob, padding, (4 - blob->len % 4) % 4);
+            
+            record.points_offset = GUINT32_TO_LE(blob->len);
+            record.point_count = GUINT32_TO_LE(annotation->path.point_count);
+            for (int i = 0; i < annotation->path.point_count; i++) {
+                gint32 point[2] = {
+                    GUINT32_TO_LE(annotation->path.points[i].x1),
+                    GUINT32_TO_LE(annotation->path.points[i].y1)
+                };
+                append_blob(blob, point, sizeof(point));
+            }
+        }
+        
+        g_byte_array_append(records, (const guint8*)&record, sizeof(record));
+    }
+    
+    SidecarHeader header = {0};
+    memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+    header.version = GUINT16_TO_LE(ANNOTATION_SIDECAR_VERSION);
+    header.header_size = GUINT16_TO_LE(sizeof(SidecarHeader));
+    header.record_count = GUINT32_TO_LE(count);
+    header.record_size = GUINT32_TO_LE(sizeof(SidecarRecord));
+    header.data_offset = GUINT32_TO_LE(sizeof(SidecarHeader) + records->len);
+    header.data_size = GUINT32_TO_LE(blob->len);
+    
+    GByteArray* file = g_byte_array_sized_new(sizeof(header) + records->len + blob->len);
+    g_byte_array_append(file, (const guint8*)&header, sizeof(header));
+    g_byte_array_append(file, records->data, records->len);
+    g_byte_array_append(file, blob->data, blob->len);
+    
+    // g_file_set_contents() replaces the sidecar atomically
+    bool ok = g_file_set_contents(path, (const char*)file->data, file->len, error);
+    
+    g_byte_array_free(file, TRUE);
+    g_byte_array_free(blob, TRUE);
+    g_byte_array_free(records, TRUE);
+    g_free(path);
+    return ok;
+}
+
+static bool blob_range_valid(guint32 offset, guint32 len, guint32 data_size) {
+    return offset <= data_size && len <= data_size - offset;
+}
+
+static Annotation* decode_record(const SidecarRecord* record, const char* data, guint32 data_size) {
+    ToolType type = record->type;
+    if (type <= TOOL_NONE || type > TOOL_FREEHAND) return NULL;
+    
+    guint32 text_offset = GUINT32_FROM_LE(record->text_offset);
+    guint32 text_len = GUINT32_FROM_LE(record->text_len);
+    guint32 family_offset = GUINT32_FROM_LE(record->family_offset);
+    guint32 family_len = GUINT32_FROM_LE(record->family_len);
+    guint32 points_offset = GUINT32_FROM_LE(record->points_offset);
+    guint32 point_count = GUINT32_FROM_LE(record->point_count);
+    
+    if (!blob_range_valid(text_offset, text_len, data_size) ||
+        !blob_range_valid(family_offset, family_len, data_size) ||
+        point_count > G_N_ELEMENTS(((FreehandPath*)NULL)->points) ||
+        !blob_range_valid(points_offset, point_count * 2 * sizeof(gint32), data_size)) {
+        return NULL;
+    }
+    
+    ToolSettings settings;
+    tool_settings_init(&settings);
+    settings.type = type;
+    unpack_color(GUINT32_FROM_LE(record->color), &settings.color);
+    settings.line_width = float_from_le(record->line_width);
+    settings.fill = (record->flags & RECORD_FLAG_FILL) != 0;
+    settings.font.size = float_from_le(record->font_size);
+    settings.font.is_bold = (record->flags & RECORD_FLAG_BOLD) != 0;
+    settings.font.is_italic = (record->flags & RECORD_FLAG_ITALIC) != 0;
+    if (family_len > 0) {
+        g_free(settings.font.family);
+        settings.font.family = g_strndup(data + family_offset, family_len);
+    }
+    
+    Annotation* annotation = annotation_create(type, &settings);
+    g_free(settings.font.family);
+    if (!annotation) return NULL;
+    
+    annotation->bounds.x1 = (gint32)GUINT32_FROM_LE(record->x1);
+    annotation->bounds.y1 = (gint32)GUINT32_FROM_LE(record->y1);
+    annotation->bounds.x2 = (gint32)GUINT32_FROM_LE(record->x2);
+    annotation->bounds.y2 = (gint32)GUINT32_FROM_LE(record->y2);
+    
+    if (text_len > 0) {
+        annotation->text = g_strndup(data + text_offset, text_len);
+    }
+    
+    for (guint32 i = 0; i < point_count; i++) {
+        gint32 point[2];
+        memcpy(point, data + points_offset + i * sizeof(point), sizeof(point));
+        annotation->path.points[i].x1 = (gint32)GUINT32_FROM_LE(point[0]);
+        annotation->path.points[i].y1 = (gint32)GUINT32_FROM_LE(point[1]);
+    }
+    annotation->path.point_count = point_count;
+    
+    return annotation;
+}
+
+GList* annotation_sidecar_load(const char* image_path) {
+    if (!image_path) return NULL;
+    
+    char* path = annotation_sidecar_path(image_path);
+    GMappedFile* mapped = g_mapped_file_new(path, FALSE, NULL);
+    g_free(path);
+    if (!mapped) return NULL;
+    
+    const char* contents = g_mapped_file_get_contents(mapped);
+    gsize length = g_mapped_file_get_length(mapped);
+    GList* annotations = NULL;
+    
+    SidecarHeader header;
+    if (length < sizeof(header)) goto out;
+    memcpy(&header, contents, sizeof(header));
+    
+    guint32 header_size = GUINT16_FROM_LE(header.header_size);
+    guint32 record_count = GUINT32_FROM_LE(header.record_count);
+    guint32 record_size = GUINT32_FROM_LE(header.record_size);
+    guint32 data_offset = GUINT32_FROM_LE(header.data_offset);
+    guint32 data_size = GUINT32_FROM_LE(header.data_size);
+    
+    // Newer versions may grow the header or the records, but never shrink them
+    if (memcmp(header.magic, SIDECAR_MAGIC, sizeof(header.magic)) != 0 ||
+        GUINT16_FROM_LE(header.version) != ANNOTATION_SIDECAR_VERSION ||
+        header_size < sizeof(SidecarHeader) ||
+        record_size < sizeof(SidecarRecord) ||
+        (guint64)header_size + (guint64)record_count * record_size > data_offset ||
+        (guint64)data_offset + data_size > length) {
+        g_warning("Ignoring invalid annotation sidecar for %s", image_path);
+        goto out;
+    }
+    
+    const char* data = contents + data_offset;
+    for (guint32 i = 0; i < record_count; i++) {
+        SidecarRecord record;
+        memcpy(&record, contents + header_size + (gsize)i * record_size, sizeof(record));
+        
+        Annotation* annotation = decode_record(&record, data, data_size);
+        if (annotation) {
+            annotations = g_list_prepend(annotations, annotation);
+        }
+    }
+    annotations = g_list_reverse(annotations);
+    
+out:
+    g_mapped_file_unref(mapped);
+    return annotations;
+}
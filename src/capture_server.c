@@ -0,0 +1,171 @@
+#include "../include/capture_server.h"
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+struct CaptureServer {
+    GSocketService* service;
+    char* socket_path;
+    GList* reading;  // CaptureRequest whose command is still being read
+    CaptureServerFunc handler;
+    gpointer user_data;
+};
+
+struct CaptureRequest {
+    GSocketConnection* connection;
+    GDataInputStream* input;
+    CaptureServer* server;  // NULL once the server is freed
+};
+
+static char* get_socket_path(void) {
+    return g_build_filename(g_get_user_runtime_dir(), CAPTURE_SERVER_SOCKET, NULL);
+}
+
+static GSocketConnection* connect_socket(const char* socket_path, GError** error) {
+    GSocketClient* client = g_socket_client_new();
+    GSocketAddress* address = g_unix_socket_address_new(socket_path);
+    GSocketConnection* connection = g_socket_client_connect(client, G_SOCKET_CONNECTABLE(address), NULL, error);
+    g_object_unref(address);
+    g_object_unref(client);
+    return connection;
+}
+
+static void capture_request_free(CaptureRequest* request) {
+    g_io_stream_close(G_IO_STREAM(request->connection), NULL, NULL);
+    g_object_unref(request->input);
+    g_object_unref(request->connection);
+    g_free(request);
+}
+
+static void on_command_read(GObject* source, GAsyncResult* result, gpointer data) {
+    CaptureRequest* request = data;
+    if (request->server) {
+        request->server->reading = g_list_remove(request->server->reading, request);
+    }
+    
+    char* line = g_data_input_stream_read_line_finish(G_DATA_INPUT_STREAM(source), result, NULL, NULL);
+    if (!line || !request->server) {
+        // The client hung up, or nobody is left to answer
+        g_free(line);
+        capture_request_free(request);
+        return;
+    }
+    
+    g_strstrip(line);
+    request->server->handler(request, line, request->server->user_data);
+    g_free(line);
+}
+
+static gboolean on_incoming(GSocketService* service, GSocketConnection* connection, GObject* source, gpointer data) {
+    (void)service;
+    (void)source;
+    CaptureServer* server = data;
+    
+    CaptureRequest* request = g_new0(CaptureRequest, 1);
+    request->connection = g_object_ref(connection);
+    request->input = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+    request->server = server;
+    server->reading = g_list_prepend(server->reading, request);
+    
+    // Read without blocking the main loop on a slow client
+    g_data_input_stream_read_line_async(request->input, G_PRIORITY_DEFAULT, NULL, on_command_read, request);
+    return TRUE;
+}
+
+CaptureServer* capture_server_new(CaptureServerFunc handler, gpointer user_data, GError** error) {
+    char* socket_path = get_socket_path();
+    
+    // A socket that accepts belongs to a live instance; one that does not
+    // was left behind and is replaced
+    GSocketConnection* existing = connect_socket(socket_path, NULL);
+    if (existing) {
+        g_object_unref(existing);
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_EXISTS, "Another instance is listening on %s", socket_path);
+        g_free(socket_path);
+        return NULL;
+    }
+    g_unlink(socket_path);
+    
+    GSocketService* service = g_socket_service_new();
+    GSocketAddress* address = g_unix_socket_address_new(socket_path);
+    bool listening = g_socket_listener_add_address(G_SOCKET_LISTENER(service), address, G_SOCKET_TYPE_STREAM,
+                                                   G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, error);
+    g_object_unref(address);
+    if (!listening) {
+        g_object_unref(service);
+        g_free(socket_path);
+        return NULL;
+    }
+    
+    CaptureServer* server = g_new0(CaptureServer, 1);
+    server->service = service;
+    server->socket_path = socket_path;
+    server->handler = handler;
+    server->user_data = user_data;
+    g_signal_connect(service, "incoming", G_CALLBACK(on_incoming), server);
+    g_socket_service_start(service);
+    return server;
+}
+
+void capture_server_free(CaptureServer* server) {
+    if (!server) return;
+    
+    // Requests still being read are dropped once their read completes
+    for (GList* link = server->reading; link; link = link->next) {
+        CaptureRequest* request = link->data;
+        request->server = NULL;
+    }
+    g_list_free(server->reading);
+    
+    g_socket_service_stop(server->service);
+    g_socket_listener_close(G_SOCKET_LISTENER(server->service));
+    g_signal_handlers_disconnect_by_data(server->service, server);
+    g_object_unref(server->service);
+    g_unlink(server->socket_path);
+    g_free(server->socket_path);
+    g_free(server);
+}
+
+void capture_server_reply(CaptureRequest* request, bool ok, const char* message) {
+    if (!request) return;
+    
+    // A reply is one short line, which fits in the socket buffer, so this
+    // does not wait on the client
+    char* reply = g_strdup_printf("%s %s\n", ok ? "ok" : "error", message ? message : "");
+    GOutputStream* output = g_io_stream_get_output_stream(G_IO_STREAM(request->connection));
+    g_output_stream_write_all(output, reply, strlen(reply), NULL, NULL, NULL);
+    g_free(reply);
+    capture_request_free(request);
+}
+
+bool capture_server_send(const char* command, bool* ok, char** message, GError** error) {
+    char* socket_path = get_socket_path();
+    GSocketConnection* connection = connect_socket(socket_path, error);
+    g_free(socket_path);
+    if (!connection) return false;
+    
+    char* line = g_strconcat(command, "\n", NULL);
+    GOutputStream* output = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+    bool sent = g_output_stream_write_all(output, line, strlen(line), NULL, NULL, error);
+    g_free(line);
+    
+    char* reply = NULL;
+    if (sent) {
+        GDataInputStream* input = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+        reply = g_data_input_stream_read_line(input, NULL, NULL, error);
+        if (!reply && error && !*error) {
+            g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED, "No reply from the running instance");
+        }
+        g_object_unref(input);
+    }
+    g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+    g_object_unref(connection);
+    if (!reply) return false;
+    
+    const char* separator = strchr(reply, ' ');
+    *ok = g_str_has_prefix(reply, "ok");
+    *message = g_strdup(separator ? separator + 1 : "");
+    g_free(reply);
+    return true;
+}
@@ -0,0 +1,102 @@
+#include "../include/clipboard_provider.h"
+#include "../include/png_writer.h"
+
+// Pastes are interactive, so favour speed over size
+#define CLIPBOARD_PNG_LEVEL 1
+
+enum {
+    TARGET_PNG,
+    TARGET_PIXBUF
+};
+
+typedef struct {
+    cairo_surface_t* surface;    // Composite shared with the editor
+    GBytes* png;                 // Cached image/png data
+    GdkPixbuf* pixbuf;           // Cached pixbuf for the other image targets
+} ClipboardImage;
+
+// Image we currently serve, NULL once another client took the clipboard
+static ClipboardImage* current_image = NULL;
+
+static void clipboard_get(GtkClipboard* clipboard, GtkSelectionData* selection_data, guint info, gpointer data) {
+    (void)clipboard;
+    ClipboardImage* image = data;
+    
+    cairo_surface_t* surface = image->surface;
+    
+    if (info == TARGET_PNG) {
+        if (!image->png) {
+            GError* error = NULL;
+            image->png = png_writer_encode_surface(surface, CLIPBOARD_PNG_LEVEL, NULL, NULL, NULL, &error);
+            if (!image->png) {
+                g_warning("Failed to encode clipboard image: %s", error->message);
+                g_error_free(error);
+                return;
+            }
+        }
+        
+        gsize size;
+        const guchar* png_data = g_bytes_get_data(image->png, &size);
+        gtk_selection_data_set(selection_data, gtk_selection_data_get_target(selection_data), 8, png_data, size);
+        return;
+    }
+    
+    // Other formats are produced by gdk-pixbuf's writers
+    if (!image->pixbuf) {
+        image->pixbuf = gdk_pixbuf_get_from_surface(surface, 0, 0,
+                                                    cairo_image_surface_get_width(surface),
+                                                    cairo_image_surface_get_height(surface));
+        if (!image->pixbuf) return;
+    }
+    gtk_selection_data_set_pixbuf(selection_data, image->pixbuf);
+}
+
+static void clipboard_clear(GtkClipboard* clipboard, gpointer data) {
+    (void)clipboard;
+    ClipboardImage* image = data;
+    
+    if (current_image == image) {
+        current_image = NULL;
+    }
+    cairo_surface_destroy(image->surface);
+    if (image->png) g_bytes_unref(image->png);
+    if (image->pixbuf) g_object_unref(image->pixbuf);
+    g_free(image);
+}
+
+bool clipboard_provider_set(cairo_surface_t* surface) {
+    if (!surface) return false;
+    
+    // Our reference keeps the surface alive, so the same pointer means the
+    // same unchanged composite and its encoded data can be kept
+    if (current_image && current_image->surface == surface) {
+        return true;
+    }
+    
+    ClipboardImage* image = g_new0(ClipboardImage, 1);
+    image->surface = cairo_surface_reference(surface);
+    
+    // image/png first, served by the parallel writer; then every other
+    // image type gdk-pixbuf can write
+    GtkTargetList* list = gtk_target_list_new(NULL, 0);
+    gtk_target_list_add(list, gdk_atom_intern_static_string("image/png"), 0, TARGET_PNG);
+    gtk_target_list_add_image_targets(list, TARGET_PIXBUF, TRUE);
+    
+    int n_targets;
+    GtkTargetEntry* targets = gtk_target_table_new_from_list(list, &n_targets);
+    
+    GtkClipboard* clipboard = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
+    gboolean owned = gtk_clipboard_set_with_data(clipboard, targets, n_targets,
+                                                 clipboard_get, clipboard_clear, image);
+    if (owned) {
+        current_image = image;
+        // Let a clipboard manager keep the PNG around after we exit
+        gtk_clipboard_set_can_store(clipboard, targets, 1);
+    } else {
+        clipboard_clear(clipboard, image);
+    }
+    
+    gtk_target_table_free(targets, n_targets);
+    gtk_target_list_unref(list);
+    return owned;
+}
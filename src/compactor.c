@@ -0,0 +1,360 @@
+#include "../include/compactor.h"
+#include "../include/png_writer.h"
+#include "../include/hash.h"
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// For every second spent compacting, sleep this many; the thread then
+// takes at most a fifth of the time it runs for
+#define COMPACTION_SLEEP_RATIO 4
+
+// Rewrites saving less than this are not worth replacing the file for
+#define COMPACTION_MIN_SAVING 1024
+
+#define COMPACTION_PNG_LEVEL 9
+
+// ioprio_set(2) values, which glibc does not define
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+typedef struct {
+    char* filepath;
+    CompactResult result;
+    gint64 saved_bytes;
+    guint64 content_hash;
+} CompactJob;
+
+struct Compactor {
+    GThreadPool* pool;         // One exclusive thread, so its priority stays its own
+    GAsyncQueue* results;      // Finished jobs waiting for the main loop
+    gint flush_pending;        // A delivery is scheduled
+    guint pending;             // Jobs queued or running, main thread only
+    GCancellable* cancellable; // Stops the file in progress and the pauses between files
+    bool lowered;              // Worker priority lowered, worker thread only
+    CompactorDoneFunc done;
+    gpointer user_data;
+};
+
+static void compact_job_free(CompactJob* job) {
+    g_free(job->filepath);
+    g_free(job);
+}
+
+// Worker thread: drop to idle CPU and I/O priority. New threads inherit
+// both, so the encoder's helper threads run at idle priority too.
+static void lower_priority(void) {
+#ifdef __linux__
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, (id_t)tid, 19);
+#ifdef SYS_ioprio_set
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+#endif
+}
+
+static guint32 read_u32_be(const guint8* in) {
+    return (guint32)in[0] << 24 | (guint32)in[1] << 16 | (guint32)in[2] << 8 | in[3];
+}
+
+// Whether a PNG can be rewritten without losing anything: 8-bit or less,
+// no alpha, and only critical chunks (so no text, colour profile or
+// physical size to carry over)
+static bool png_is_eligible(const guint8* data, gsize len) {
+    static const guint8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    if (len < sizeof(signature) || memcmp(data, signature, sizeof(signature)) != 0) return false;
+    
+    gsize offset = sizeof(signature);
+    bool seen_header = false;
+    while (offset + 12 <= len) {
+        guint32 chunk_len = read_u32_be(data + offset);
+        const guint8* type = data + offset + 4;
+        if (chunk_len > len - offset - 12) return false;
+        
+        if (memcmp(type, "IHDR", 4) == 0) {
+            if (chunk_len < 13) return false;
+            guint8 bit_depth = data[offset + 16];
+            guint8 colour_type = data[offset + 17];
+            // Grey+alpha and RGBA would go through cairo's premultiplied pixels
+            if (bit_depth > 8 || colour_type == 4 || colour_type == 6) return false;
+            seen_header = true;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            return seen_header;
+        } else if (memcmp(type, "PLTE", 4) != 0 && memcmp(type, "IDAT", 4) != 0) {
+            return false;
+        }
+        offset += 12 + chunk_len;
+    }
+    return false;
+}
+
+static GdkPixbuf* decode_png(const guint8* data, gsize len, GError** error) {
+    GdkPixbufLoader* loader = gdk_pixbuf_loader_new_with_type("png", error);
+    if (!loader) return NULL;
+    
+    GdkPixbuf* pixbuf = NULL;
+    if (gdk_pixbuf_loader_write(loader, data, len, error) && gdk_pixbuf_loader_close(loader, error)) {
+        pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+        if (pixbuf) g_object_ref(pixbuf);
+    } else {
+        gdk_pixbuf_loader_close(loader, NULL);
+    }
+    g_object_unref(loader);
+    return pixbuf;
+}
+
+// Opaque ARGB32 pixels of an opaque 8-bit pixbuf, for the PNG writer
+static guint32* pixbuf_to_argb(GdkPixbuf* pixbuf) {
+    int width = gdk_pixbuf_get_width(pixbuf);
+    int height = gdk_pixbuf_get_height(pixbuf);
+    int channels = gdk_pixbuf_get_n_channels(pixbuf);
+    int stride = gdk_pixbuf_get_rowstride(pixbuf);
+    const guint8* pixels = gdk_pixbuf_read_pixels(pixbuf);
+    bool has_alpha = gdk_pixbuf_get_has_alpha(pixbuf);
+    if (gdk_pixbuf_get_bits_per_sample(pixbuf) != 8 || channels < 3) return NULL;
+    
+    guint32* argb = g_new(guint32, (gsize)width * height);
+    for (int y = 0; y < height; y++) {
+        const guint8* row = pixels + (gsize)y * stride;
+        guint32* out = argb + (gsize)y * width;
+        for (int x = 0; x < width; x++) {
+            const guint8* pixel = row + x * channels;
+            // A tRNS-less palette or grey image can still decode with alpha
+            if (has_alpha && pixel[3] != 0xFF) {
+                g_free(argb);
+                return NULL;
+            }
+            out[x] = 0xFF000000u | (guint32)pixel[0] << 16 | (guint32)pixel[1] << 8 | pixel[2];
+        }
+    }
+    return argb;
+}
+
+// Whether two decoded opaque images have the same colour at every pixel
+static bool same_pixels(GdkPixbuf* a, GdkPixbuf* b) {
+    int width = gdk_pixbuf_get_width(a);
+    int height = gdk_pixbuf_get_height(a);
+    if (width != gdk_pixbuf_get_width(b) || height != gdk_pixbuf_get_height(b)) return false;
+    
+    int channels_a = gdk_pixbuf_get_n_channels(a);
+    int channels_b = gdk_pixbuf_get_n_channels(b);
+    int stride_a = gdk_pixbuf_get_rowstride(a);
+    int stride_b = gdk_pixbuf_get_rowstride(b);
+    const guint8* pixels_a = gdk_pixbuf_read_pixels(a);
+    const guint8* pixels_b = gdk_pixbuf_read_pixels(b);
+    
+    for (int y = 0; y < height; y++) {
+        const guint8* row_a = pixels_a + (gsize)y * stride_a;
+        const guint8* row_b = pixels_b + (gsize)y * stride_b;
+        for (int x = 0; x < width; x++) {
+            if (memcmp(row_a + x * channels_a, row_b + x * channels_b, 3) != 0) return false;
+        }
+    }
+    return true;
+}
+
+// Write contents next to filepath with the mode and times of st, then
+// rename it over filepath unless filepath changed since st was taken
+static CompactResult replace_file(const char* filepath, const struct stat* st, const guint8* contents, gsize len) {
+    char* temp_path = g_strconcat(filepath, ".part", NULL);
+    CompactResult result = COMPACT_FAILED;
+    
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st->st_mode & 07777);
+    if (fd < 0) goto out;
+    
+    gsize written = 0;
+    while (written < len) {
+        ssize_t count = write(fd, contents + written, len - written);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) break;
+        written += count;
+    }
+    
+    // The history orders screenshots by modification time
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    bool ok = written == len && fchmod(fd, st->st_mode & 07777) == 0 &&
+              futimens(fd, times) == 0 && fsync(fd) == 0;
+    ok &= close(fd) == 0;
+    
+    struct stat now;
+    if (ok && stat(filepath, &now) == 0 && now.st_ino == st->st_ino && now.st_size == st->st_size &&
+        now.st_mtim.tv_sec == st->st_mtim.tv_sec && now.st_mtim.tv_nsec == st->st_mtim.tv_nsec &&
+        rename(temp_path, filepath) == 0) {
+        result = COMPACT_REPLACED;
+    }
+    
+out:
+    if (result != COMPACT_REPLACED) unlink(temp_path);
+    g_free(temp_path);
+    return result;
+}
+
+static void compact_file(CompactJob* job, GCancellable* cancellable) {
+    job->result = COMPACT_FAILED;
+    
+    struct stat st;
+    if (stat(job->filepath, &st) != 0 || !S_ISREG(st.st_mode)) return;
+    if (st.st_nlink > 1) {
+        job->result = COMPACT_KEPT;
+        return;
+    }
+    
+    gchar* original;
+    gsize original_len;
+    if (!g_file_get_contents(job->filepath, &original, &original_len, NULL)) return;
+    if ((gint64)original_len != st.st_size) goto free_original;
+    if (!png_is_eligible((const guint8*)original, original_len)) {
+        job->result = COMPACT_KEPT;
+        goto free_original;
+    }
+    
+    GdkPixbuf* pixels = decode_png((const guint8*)original, original_len, NULL);
+    if (!pixels) goto free_original;
+    
+    guint32* argb = pixbuf_to_argb(pixels);
+    if (!argb) {
+        job->result = COMPACT_KEPT;
+        goto free_pixels;
+    }
+    
+    int width = gdk_pixbuf_get_width(pixels);
+    int height = gdk_pixbuf_get_height(pixels);
+    GBytes* encoded = png_writer_encode_data((const unsigned char*)argb, width, height, width * 4,
+                                             COMPACTION_PNG_LEVEL, cancellable, NULL, NULL, NULL);
+    g_free(argb);
+    if (!encoded) goto free_pixels;
+    
+    gsize encoded_len;
+    const guint8* encoded_data = g_bytes_get_data(encoded, &encoded_len);
+    if (encoded_len + COMPACTION_MIN_SAVING > original_len) {
+        job->result = COMPACT_KEPT;
+        goto free_encoded;
+    }
+    
+    // Decode what is about to be written and hold it against the original
+    GdkPixbuf* check = decode_png(encoded_data, encoded_len, NULL);
+    bool verified = check && same_pixels(pixels, check);
+    if (check) g_object_unref(check);
+    if (!verified) {
+        g_warning("Compacting %s did not reproduce its pixels; keeping the original", job->filepath);
+        job->result = COMPACT_KEPT;
+        goto free_encoded;
+    }
+    
+    job->result = replace_file(job->filepath, &st, encoded_data, encoded_len);
+    if (job->result == COMPACT_REPLACED) {
+        job->saved_bytes = (gint64)(original_len - encoded_len);
+        job->content_hash = hash64(encoded_data, encoded_len, 0);
+    }
+    
+free_encoded:
+    g_bytes_unref(encoded);
+free_pixels:
+    g_object_unref(pixels);
+free_original:
+    g_free(original);
+}
+
+// Main thread: report finished files
+static gboolean deliver_results(gpointer data) {
+    Compactor* compactor = data;
+    
+    // Clear the flag first so jobs finishing meanwhile schedule a new delivery
+    g_atomic_int_set(&compactor->flush_pending, 0);
+    
+    CompactJob* job;
+    while ((job = g_async_queue_try_pop(compactor->results)) != NULL) {
+        compactor->pending--;
+        if (compactor->done) {
+            compactor->done(job->filepath, job->result, job->saved_bytes, job->content_hash, compactor->user_data);
+        }
+        compact_job_free(job);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Sleep for duration microseconds, waking up now and then to notice
+// cancellation
+static void pause_unless_cancelled(GCancellable* cancellable, gint64 duration) {
+    gint64 deadline = g_get_monotonic_time() + duration;
+    while (!g_cancellable_is_cancelled(cancellable)) {
+        gint64 remaining = deadline - g_get_monotonic_time();
+        if (remaining <= 0) break;
+        g_usleep(MIN(remaining, 100 * G_TIME_SPAN_MILLISECOND));
+    }
+}
+
+// Worker thread: compact one file, report it right after the swap, then
+// rest in proportion
+static void run_compact_job(gpointer data, gpointer user_data) {
+    CompactJob* job = data;
+    Compactor* compactor = user_data;
+    
+    if (!compactor->lowered) {
+        lower_priority();
+        compactor->lowered = true;
+    }
+    
+    job->result = COMPACT_FAILED;
+    gint64 start = g_get_monotonic_time();
+    if (!g_cancellable_is_cancelled(compactor->cancellable)) {
+        compact_file(job, compactor->cancellable);
+    }
+    gint64 duration = g_get_monotonic_time() - start;
+    
+    g_async_queue_push(compactor->results, job);
+    if (g_atomic_int_compare_and_exchange(&compactor->flush_pending, 0, 1)) {
+        g_idle_add(deliver_results, compactor);
+    }
+    pause_unless_cancelled(compactor->cancellable, duration * COMPACTION_SLEEP_RATIO);
+}
+
+Compactor* compactor_new(CompactorDoneFunc done, gpointer user_data) {
+    Compactor* compactor = g_new0(Compactor, 1);
+    compactor->results = g_async_queue_new();
+    compactor->cancellable = g_cancellable_new();
+    compactor->done = done;
+    compactor->user_data = user_data;
+    compactor->pool = g_thread_pool_new(run_compact_job, compactor, 1, TRUE, NULL);
+    return compactor;
+}
+
+void compactor_submit(Compactor* compactor, const char* filepath) {
+    if (!compactor || !compactor->pool || !filepath) return;
+    
+    CompactJob* job = g_new0(CompactJob, 1);
+    job->filepath = g_strdup(filepath);
+    compactor->pending++;
+    g_thread_pool_push(compactor->pool, job, NULL);
+}
+
+guint compactor_get_pending(Compactor* compactor) {
+    return compactor ? compactor->pending : 0;
+}
+
+void compactor_free(Compactor* compactor) {
+    if (!compactor) return;
+    
+    // Cut the running file short; once cancelled, queued jobs pass through
+    // the worker without touching their files and land in results, so
+    // they are freed below along with the finished ones
+    g_cancellable_cancel(compactor->cancellable);
+    g_thread_pool_free(compactor->pool, FALSE, TRUE);
+    if (g_atomic_int_get(&compactor->flush_pending)) {
+        g_source_remove_by_user_data(compactor);
+    }
+    
+    CompactJob* job;
+    while ((job = g_async_queue_try_pop(compactor->results)) != NULL) {
+        compact_job_free(job);
+    }
+    g_async_queue_unref(compactor->results);
+    g_object_unref(compactor->cancellable);
+    g_free(compactor);
+}
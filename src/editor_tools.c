@@ -1,4 +1,5 @@
 #include "../include/editor_tools.h"
+#include "../include/surface_pool.h"
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
@@ -218,4 +219,47 @@ void annotation_free(Annotation* annotation) {
     }
     
     free(annotation);
-} 
\ No newline at end of file
+} 
+
+Annotation* annotation_copy(const Annotation* annotation) {
+    if (!annotation) return NULL;
+    
+    Annotation* copy = (Annotation*)malloc(sizeof(Annotation));
+    if (!copy) return NULL;
+    
+    memcpy(copy, annotation, sizeof(Annotation));
+    copy->text = g_strdup(annotation->text);
+    copy->settings.font.family = g_strdup(annotation->settings.font.family);
+    
+    return copy;
+}
+
+cairo_surface_t* annotations_flatten(cairo_surface_t* surface, GList* annotations) {
+    if (!surface) return NULL;
+    
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    cairo_surface_t* combined_surface = surface_pool_acquire(width, height);
+    if (!combined_surface) {
+        return NULL;
+    }
+    
+    cairo_t* cr = cairo_create(combined_surface);
+    
+    // Draw the original image, replacing whatever the recycled buffer held
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cr, surface, 0, 0);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    
+    // Draw all annotations
+    for (GList* iter = annotations; iter != NULL; iter = iter->next) {
+        annotation_draw((Annotation*)iter->data, cr);
+    }
+    
+    cairo_destroy(cr);
+    
+    // Ensure all drawing operations are complete
+    cairo_surface_flush(combined_surface);
+    return combined_surface;
+}
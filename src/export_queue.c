@@ -0,0 +1,398 @@
+#include "../include/export_queue.h"
+#include "../include/editor_tools.h"
+#include "../include/png_writer.h"
+#include "../include/hash.h"
+#include <gdk/gdk.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    cairo_surface_t* surface;   // Base image, shared with the editor
+    GList* annotations;         // Private copy of the annotations
+    char* filename;
+    const ExportFormat* format;
+    GCancellable* cancellable;
+    ExportProgressFunc progress;
+    ExportDoneFunc done;
+    gpointer user_data;
+    GError* error;
+    guint64 content_hash;       // Of the file written
+} ExportJob;
+
+typedef struct {
+    char* filename;
+    double fraction;
+    ExportProgressFunc progress;
+    gpointer user_data;
+} ExportProgress;
+
+typedef struct {
+    GByteArray* buffer;
+    GCancellable* cancellable;
+} ExportWriter;
+
+static const char* const JPEG_OPTIONS[] = { "quality", "100", NULL };
+static const char* const PNG_OPTIONS[] = { "compression", "9", NULL };
+static const char* const WEBP_OPTIONS[] = { "quality", "100", NULL };
+
+static const struct {
+    const char* extension;
+    ExportFormat format;
+} FORMATS[] = {
+    { "jpg",  { "jpeg", JPEG_OPTIONS, "JPEG" } },
+    { "jpeg", { "jpeg", JPEG_OPTIONS, "JPEG" } },
+    { "png",  { "png",  PNG_OPTIONS,  "PNG" } },
+    { "gif",  { "gif",  NULL,         "GIF" } },
+    { "tif",  { "tiff", NULL,         "TIFF" } },
+    { "tiff", { "tiff", NULL,         "TIFF" } },
+    { "webp", { "webp", WEBP_OPTIONS, "WebP" } },
+    { "bmp",  { "bmp",  NULL,         "BMP" } },
+    { "ico",  { "ico",  NULL,         "ICO" } },
+    // Offered by the save dialog but not writable
+    { "svg",  { NULL, NULL, "SVG" } },
+    { "heic", { NULL, NULL, "HEIC/HEIF" } },
+    { "heif", { NULL, NULL, "HEIC/HEIF" } },
+    { "raw",  { NULL, NULL, "RAW" } },
+    { "psd",  { NULL, NULL, "PSD" } },
+    { "eps",  { NULL, NULL, "EPS" } },
+    { "ai",   { NULL, NULL, "AI" } },
+    { "avif", { NULL, NULL, "AVIF" } },
+    { "cr2",  { NULL, NULL, "CR2/CR3" } },
+    { "cr3",  { NULL, NULL, "CR2/CR3" } },
+};
+
+static GThreadPool* pool = NULL;
+static GMutex jobs_lock;
+static GList* active_jobs = NULL;  // Jobs queued or running, guarded by jobs_lock
+static ExportLookupFunc lookup_func = NULL;  // Guarded by jobs_lock
+static gpointer lookup_data = NULL;
+
+const ExportFormat* export_format_for_filename(const char* filename, GError** error) {
+    const char* ext = filename ? strrchr(filename, '.') : NULL;
+    if (!ext) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_FILENAME, "File name has no extension");
+        return NULL;
+    }
+    ext++; // Skip the dot
+    
+    for (gsize i = 0; i < G_N_ELEMENTS(FORMATS); i++) {
+        if (g_ascii_strcasecmp(ext, FORMATS[i].extension) != 0) continue;
+        
+        if (!FORMATS[i].format.name) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        "%s format not supported", FORMATS[i].format.description);
+            return NULL;
+        }
+        return &FORMATS[i].format;
+    }
+    
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Unknown file format: %s", ext);
+    return NULL;
+}
+
+static const char* format_option(const ExportFormat* format, const char* key) {
+    for (const char* const* option = format->options; option && option[0] && option[1]; option += 2) {
+        if (strcmp(option[0], key) == 0) return option[1];
+    }
+    return NULL;
+}
+
+static gboolean progress_idle(gpointer data) {
+    ExportProgress* update = data;
+    update->progress(update->filename, update->fraction, update->user_data);
+    g_free(update->filename);
+    g_free(update);
+    return G_SOURCE_REMOVE;
+}
+
+static void report_progress(ExportJob* job, double fraction) {
+    if (!job->progress) return;
+    
+    ExportProgress* update = g_new0(ExportProgress, 1);
+    update->filename = g_strdup(job->filename);
+    update->fraction = fraction;
+    update->progress = job->progress;
+    update->user_data = job->user_data;
+    g_idle_add(progress_idle, update);
+}
+
+// Encoding covers the 25%..95% range of a job's progress
+static void on_png_progress(double fraction, gpointer data) {
+    report_progress((ExportJob*)data, 0.25 + fraction * 0.7);
+}
+
+static void export_job_free(ExportJob* job) {
+    cairo_surface_destroy(job->surface);
+    g_list_free_full(job->annotations, (GDestroyNotify)annotation_free);
+    g_free(job->filename);
+    g_object_unref(job->cancellable);
+    if (job->error) g_error_free(job->error);
+    g_free(job);
+}
+
+static gboolean done_idle(gpointer data) {
+    ExportJob* job = data;
+    
+    g_mutex_lock(&jobs_lock);
+    active_jobs = g_list_remove(active_jobs, job);
+    g_mutex_unlock(&jobs_lock);
+    
+    if (job->done) {
+        job->done(job->filename, job->error, job->content_hash, job->user_data);
+    }
+    
+    export_job_free(job);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean write_chunk(const gchar* buf, gsize count, GError** error, gpointer data) {
+    ExportWriter* writer = data;
+    
+    if (g_cancellable_set_error_if_cancelled(writer->cancellable, error)) {
+        return FALSE;
+    }
+    
+    g_byte_array_append(writer->buffer, (const guint8*)buf, (guint)count);
+    return TRUE;
+}
+
+// Encode surface as format in memory. progress, if any, gets the fraction
+// of the encoding done.
+static GBytes* encode_surface(cairo_surface_t* surface, const ExportFormat* format, GCancellable* cancellable,
+                              PngWriterProgressFunc progress, gpointer user_data, GError** error) {
+    // PNG goes through the built-in writer, which deflates on all cores and
+    // reads the flattened surface directly instead of converting to a pixbuf
+    if (strcmp(format->name, "png") == 0) {
+        const char* compression = format_option(format, "compression");
+        int level = compression ? atoi(compression) : 6;
+        return png_writer_encode_surface(surface, level, cancellable, progress, user_data, error);
+    }
+    
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    GdkPixbuf* pixbuf = gdk_pixbuf_get_from_surface(surface, 0, 0, width, height);
+    if (!pixbuf) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to convert image");
+        return NULL;
+    }
+    if (progress) progress(0.35, user_data);
+    
+    // Options come as key/value pairs; split them for the vector API
+    GPtrArray* keys = g_ptr_array_new();
+    GPtrArray* values = g_ptr_array_new();
+    for (const char* const* option = format->options; option && option[0] && option[1]; option += 2) {
+        g_ptr_array_add(keys, (gpointer)option[0]);
+        g_ptr_array_add(values, (gpointer)option[1]);
+    }
+    g_ptr_array_add(keys, NULL);
+    g_ptr_array_add(values, NULL);
+    
+    ExportWriter writer = { g_byte_array_new(), cancellable };
+    gboolean saved = gdk_pixbuf_save_to_callbackv(pixbuf, write_chunk, &writer, format->name,
+                                                  (char**)keys->pdata, (char**)values->pdata, error);
+    g_ptr_array_free(keys, TRUE);
+    g_ptr_array_free(values, TRUE);
+    g_object_unref(pixbuf);
+    
+    if (!saved) {
+        g_byte_array_unref(writer.buffer);
+        return NULL;
+    }
+    return g_byte_array_free_to_bytes(writer.buffer);
+}
+
+// Write contents to filename through a temporary file next to it, so that
+// a failed write never leaves a truncated image behind
+static bool write_contents(GBytes* contents, const char* filename, GError** error) {
+    char* temp_path = g_strdup_printf("%s.part", filename);
+    FILE* file = fopen(temp_path, "wb");
+    if (!file) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Cannot write %s", temp_path);
+        g_free(temp_path);
+        return false;
+    }
+    
+    gsize size;
+    const char* data = g_bytes_get_data(contents, &size);
+    bool saved = fwrite(data, 1, size, file) == size;
+    if (fclose(file) != 0) saved = false;
+    if (!saved) {
+        g_set_error_literal(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Write failed");
+    }
+    
+    if (saved && g_rename(temp_path, filename) != 0) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Cannot replace %s", filename);
+        saved = false;
+    }
+    
+    if (!saved) {
+        g_unlink(temp_path);
+    }
+    g_free(temp_path);
+    return saved;
+}
+
+// Make filename a hard link to original if original holds contents. The
+// link is made under a temporary name and renamed over filename.
+static bool link_identical(const char* original, GBytes* contents, const char* filename) {
+    if (strcmp(original, filename) == 0) return false;
+    
+    GMappedFile* mapped = g_mapped_file_new(original, FALSE, NULL);
+    if (!mapped) return false;
+    gsize size;
+    const char* data = g_bytes_get_data(contents, &size);
+    bool identical = g_mapped_file_get_length(mapped) == size &&
+                     (size == 0 || memcmp(g_mapped_file_get_contents(mapped), data, size) == 0);
+    g_mapped_file_unref(mapped);
+    if (!identical) return false;
+    
+    char* temp_path = g_strdup_printf("%s.part", filename);
+    g_unlink(temp_path);
+    bool linked = link(original, temp_path) == 0;
+    if (linked && g_rename(temp_path, filename) != 0) {
+        g_unlink(temp_path);
+        linked = false;
+    }
+    g_free(temp_path);
+    return linked;
+}
+
+// A file that may already hold contents, from the lookup if one is set
+static char* lookup_identical(guint64 content_hash) {
+    g_mutex_lock(&jobs_lock);
+    ExportLookupFunc lookup = lookup_func;
+    gpointer data = lookup_data;
+    g_mutex_unlock(&jobs_lock);
+    return lookup ? lookup(content_hash, data) : NULL;
+}
+
+static void run_export_job(gpointer data, gpointer user_data) {
+    (void)user_data;
+    ExportJob* job = data;
+    cairo_surface_t* combined_surface = NULL;
+    
+    if (g_cancellable_set_error_if_cancelled(job->cancellable, &job->error)) goto out;
+    report_progress(job, 0.0);
+    
+    // Flatten annotations into a private surface; an already flattened
+    // composite is written as is
+    if (job->annotations) {
+        combined_surface = annotations_flatten(job->surface, job->annotations);
+    } else {
+        combined_surface = cairo_surface_reference(job->surface);
+    }
+    if (!combined_surface) {
+        g_set_error_literal(&job->error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to render image");
+        goto out;
+    }
+    report_progress(job, 0.25);
+    
+    if (g_cancellable_set_error_if_cancelled(job->cancellable, &job->error)) goto out;
+    
+    GBytes* contents = encode_surface(combined_surface, job->format, job->cancellable,
+                                      on_png_progress, job, &job->error);
+    if (!contents) goto out;
+    
+    // Hash the bytes while they are at hand; a file that already holds
+    // them (a repeated capture) is linked instead of written again
+    guint64 content_hash = hash64(g_bytes_get_data(contents, NULL), g_bytes_get_size(contents), 0);
+    char* original = lookup_identical(content_hash);
+    if (!g_cancellable_set_error_if_cancelled(job->cancellable, &job->error) &&
+        ((original && link_identical(original, contents, job->filename)) ||
+         write_contents(contents, job->filename, &job->error))) {
+        job->content_hash = content_hash;
+        report_progress(job, 1.0);
+    }
+    g_free(original);
+    g_bytes_unref(contents);
+    
+out:
+    if (combined_surface) cairo_surface_destroy(combined_surface);
+    
+    // Drop the base image reference here so the editor regains sole ownership
+    cairo_surface_destroy(job->surface);
+    job->surface = NULL;
+    
+    g_idle_add(done_idle, job);
+}
+
+bool export_save_surface(cairo_surface_t* surface, const char* filename, const ExportFormat* format,
+                         GError** error) {
+    if (!surface || !filename || !format) return false;
+    
+    GBytes* contents = encode_surface(surface, format, NULL, NULL, NULL, error);
+    if (!contents) return false;
+    bool saved = write_contents(contents, filename, error);
+    g_bytes_unref(contents);
+    return saved;
+}
+
+void export_queue_init(void) {
+    if (pool) return;
+    
+    // A single worker keeps files written in submission order and bounds the
+    // number of full-size buffers alive at once
+    pool = g_thread_pool_new(run_export_job, NULL, 1, FALSE, NULL);
+}
+
+bool export_queue_submit(cairo_surface_t* surface, GList* annotations, const char* filename,
+                         const ExportFormat* format,
+                         ExportProgressFunc progress, ExportDoneFunc done, gpointer user_data) {
+    if (!pool || !surface || !filename || !format) return false;
+    
+    ExportJob* job = g_new0(ExportJob, 1);
+    job->surface = cairo_surface_reference(surface);
+    for (GList* iter = annotations; iter != NULL; iter = iter->next) {
+        job->annotations = g_list_prepend(job->annotations, annotation_copy(iter->data));
+    }
+    job->annotations = g_list_reverse(job->annotations);
+    job->filename = g_strdup(filename);
+    job->format = format;
+    job->cancellable = g_cancellable_new();
+    job->progress = progress;
+    job->done = done;
+    job->user_data = user_data;
+    
+    g_mutex_lock(&jobs_lock);
+    active_jobs = g_list_append(active_jobs, job);
+    g_mutex_unlock(&jobs_lock);
+    
+    g_thread_pool_push(pool, job, NULL);
+    return true;
+}
+
+void export_queue_set_lookup(ExportLookupFunc lookup, gpointer user_data) {
+    g_mutex_lock(&jobs_lock);
+    lookup_func = lookup;
+    lookup_data = user_data;
+    g_mutex_unlock(&jobs_lock);
+}
+
+guint export_queue_get_pending(void) {
+    g_mutex_lock(&jobs_lock);
+    guint pending = g_list_length(active_jobs);
+    g_mutex_unlock(&jobs_lock);
+    return pending;
+}
+
+void export_queue_cancel_all(void) {
+    g_mutex_lock(&jobs_lock);
+    for (GList* iter = active_jobs; iter != NULL; iter = iter->next) {
+        ExportJob* job = iter->data;
+        g_cancellable_cancel(job->cancellable);
+    }
+    g_mutex_unlock(&jobs_lock);
+}
+
+void export_queue_shutdown(void) {
+    if (!pool) return;
+    
+    // Let queued jobs finish writing; their done callbacks need the main loop
+    // and are dropped once it has stopped
+    g_thread_pool_free(pool, FALSE, TRUE);
+    pool = NULL;
+}
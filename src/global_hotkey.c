@@ -0,0 +1,144 @@
+#include "../include/global_hotkey.h"
+#include <gdk/gdk.h>
+#include <gdk/gdkx.h>
+#include <X11/Xlib.h>
+#include <X11/keysym.h>
+
+static KeyCode grabbed_keycode = 0;
+static unsigned int grabbed_modifiers = 0;
+static unsigned int ignored_modifiers = 0;  // Lock masks, pressed or not
+static GlobalHotkeyFunc hotkey_callback = NULL;
+static gpointer hotkey_data = NULL;
+static bool filter_added = false;
+static guint dispatch_source = 0;
+static gint64 pressed_at = 0;
+static bool dispatching = false;
+
+// Modifier mask Num Lock is mapped to, 0 if none
+static unsigned int find_num_lock_mask(Display* display) {
+    KeyCode num_lock = XKeysymToKeycode(display, XK_Num_Lock);
+    XModifierKeymap* map = XGetModifierMapping(display);
+    unsigned int mask = 0;
+    if (!map) return 0;
+    
+    for (int modifier = 0; modifier < 8 && num_lock; modifier++) {
+        for (int i = 0; i < map->max_keypermod; i++) {
+            if (map->modifiermap[modifier * map->max_keypermod + i] == num_lock) {
+                mask = 1u << modifier;
+            }
+        }
+    }
+    XFreeModifiermap(map);
+    return mask;
+}
+
+// Grab or release keycode with modifiers under every combination of the
+// lock masks
+static void grab_variants(Display* display, Window root, KeyCode keycode, unsigned int modifiers, bool grab) {
+    unsigned int num_lock = ignored_modifiers & ~LockMask;
+    unsigned int variants[] = { 0, LockMask, num_lock, LockMask | num_lock };
+    
+    for (gsize i = 0; i < G_N_ELEMENTS(variants); i++) {
+        // Without a Num Lock mask the last two repeat the first two
+        if (i >= 2 && !num_lock) break;
+        if (grab) {
+            XGrabKey(display, keycode, modifiers | variants[i], root, False, GrabModeAsync, GrabModeAsync);
+        } else {
+            XUngrabKey(display, keycode, modifiers | variants[i], root);
+        }
+    }
+}
+
+static gboolean dispatch_press(gpointer data) {
+    (void)data;
+    dispatch_source = 0;
+    if (!hotkey_callback) return G_SOURCE_REMOVE;
+    
+    // The callback may run a nested main loop (the capture overlay)
+    dispatching = true;
+    hotkey_callback(pressed_at, hotkey_data);
+    dispatching = false;
+    return G_SOURCE_REMOVE;
+}
+
+// Runs for every event on the root window: only note the press and return,
+// so the X event queue keeps moving
+static GdkFilterReturn hotkey_filter(GdkXEvent* xevent, GdkEvent* event, gpointer data) {
+    (void)event;
+    (void)data;
+    XEvent* xe = (XEvent*)xevent;
+    if (xe->type != KeyPress || !grabbed_keycode) return GDK_FILTER_CONTINUE;
+    
+    XKeyEvent* key_event = &xe->xkey;
+    if (key_event->keycode != grabbed_keycode ||
+        (key_event->state & ~ignored_modifiers) != grabbed_modifiers) {
+        return GDK_FILTER_CONTINUE;
+    }
+    
+    // Auto-repeat and presses during a capture are dropped
+    if (!dispatch_source && !dispatching) {
+        pressed_at = g_get_monotonic_time();
+        dispatch_source = g_idle_add_full(G_PRIORITY_HIGH, dispatch_press, NULL, NULL);
+    }
+    return GDK_FILTER_REMOVE;
+}
+
+bool global_hotkey_grab(unsigned long keysym, unsigned int modifiers,
+                        GlobalHotkeyFunc callback, gpointer user_data, GError** error) {
+    global_hotkey_ungrab();
+    
+    GdkDisplay* gdk_display = gdk_display_get_default();
+    if (!GDK_IS_X11_DISPLAY(gdk_display)) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Global shortcuts need an X11 display");
+        return false;
+    }
+    Display* display = GDK_DISPLAY_XDISPLAY(gdk_display);
+    Window root = DefaultRootWindow(display);
+    
+    KeyCode keycode = XKeysymToKeycode(display, (KeySym)keysym);
+    if (!keycode) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No key produces %s", XKeysymToString((KeySym)keysym));
+        return false;
+    }
+    ignored_modifiers = LockMask | find_num_lock_mask(display);
+    
+    // Another client holding the key makes XGrabKey() fail with BadAccess
+    gdk_x11_display_error_trap_push(gdk_display);
+    grab_variants(display, root, keycode, modifiers, true);
+    if (gdk_x11_display_error_trap_pop(gdk_display) != 0) {
+        gdk_x11_display_error_trap_push(gdk_display);
+        grab_variants(display, root, keycode, modifiers, false);
+        gdk_x11_display_error_trap_pop_ignored(gdk_display);
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_BUSY, "The shortcut is taken by another application");
+        return false;
+    }
+    
+    grabbed_keycode = keycode;
+    grabbed_modifiers = modifiers;
+    hotkey_callback = callback;
+    hotkey_data = user_data;
+    if (!filter_added) {
+        gdk_window_add_filter(gdk_get_default_root_window(), hotkey_filter, NULL);
+        filter_added = true;
+    }
+    return true;
+}
+
+void global_hotkey_ungrab(void) {
+    if (dispatch_source) {
+        g_source_remove(dispatch_source);
+        dispatch_source = 0;
+    }
+    if (!grabbed_keycode) return;
+    
+    GdkDisplay* gdk_display = gdk_display_get_default();
+    Display* display = GDK_DISPLAY_XDISPLAY(gdk_display);
+    gdk_x11_display_error_trap_push(gdk_display);
+    grab_variants(display, DefaultRootWindow(display), grabbed_keycode, grabbed_modifiers, false);
+    gdk_x11_display_error_trap_pop_ignored(gdk_display);
+    
+    grabbed_keycode = 0;
+    grabbed_modifiers = 0;
+    hotkey_callback = NULL;
+    hotkey_data = NULL;
+}
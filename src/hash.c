@@ -0,0 +1,51 @@
+#include "../include/hash.h"
+#include <string.h>
+
+#define HASH_MULTIPLIER G_GUINT64_CONSTANT(0xc6a4a7935bd1e995)
+#define HASH_SHIFT 47
+
+guint64 hash64(const void* data, gsize len, guint64 seed) {
+    const guint8* bytes = data;
+    guint64 hash = seed ^ (len * HASH_MULTIPLIER);
+    
+    // Whole little-endian words first, so the result does not depend on
+    // the host byte order
+    gsize words = len / 8;
+    for (gsize i = 0; i < words; i++) {
+        guint64 word;
+        memcpy(&word, bytes + i * 8, sizeof(word));
+        word = GUINT64_FROM_LE(word);
+        
+        word *= HASH_MULTIPLIER;
+        word ^= word >> HASH_SHIFT;
+        word *= HASH_MULTIPLIER;
+        hash ^= word;
+        hash *= HASH_MULTIPLIER;
+    }
+    
+    // Up to seven trailing bytes
+    const guint8* tail = bytes + words * 8;
+    gsize remaining = len & 7;
+    if (remaining > 0) {
+        guint64 word = 0;
+        for (gsize i = 0; i < remaining; i++) {
+            word |= (guint64)tail[i] << (8 * i);
+        }
+        hash ^= word;
+        hash *= HASH_MULTIPLIER;
+    }
+    
+    hash ^= hash >> HASH_SHIFT;
+    hash *= HASH_MULTIPLIER;
+    hash ^= hash >> HASH_SHIFT;
+    return hash;
+}
+
+gboolean hash64_file(const char* filepath, guint64* hash) {
+    GMappedFile* mapped = g_mapped_file_new(filepath, FALSE, NULL);
+    if (!mapped) return FALSE;
+    
+    *hash = hash64(g_mapped_file_get_contents(mapped), g_mapped_file_get_length(mapped), 0);
+    g_mapped_file_unref(mapped);
+    return TRUE;
+}
@@ -0,0 +1,101 @@
+#include "../include/headless_capture.h"
+#include "../include/export_queue.h"
+#include "../include/surface_pool.h"
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static double elapsed_ms(gint64 from, gint64 to) {
+    return (to - from) / 1000.0;
+}
+
+// Output format from --format, or from the extension of filename. A
+// filename with an extension must agree with --format, so a .png file
+// never ends up holding WebP.
+static const ExportFormat* resolve_format(const char* format, const char* filename, GError** error) {
+    if (!format) return export_format_for_filename(filename, error);
+    
+    if (g_ascii_strcasecmp(format, "png") != 0 && g_ascii_strcasecmp(format, "webp") != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Unknown format %s; use png or webp", format);
+        return NULL;
+    }
+    char* probe = g_strconcat("capture.", format, NULL);
+    const ExportFormat* resolved = export_format_for_filename(probe, error);
+    g_free(probe);
+    if (!resolved) return NULL;
+    
+    char* basename = g_path_get_basename(filename);
+    const ExportFormat* named = strchr(basename, '.') ? export_format_for_filename(basename, NULL) : resolved;
+    g_free(basename);
+    if (!named || strcmp(named->name, resolved->name) != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                    "--format %s does not match the extension of %s", format, filename);
+        return NULL;
+    }
+    return resolved;
+}
+
+int headless_capture_run(const HeadlessCapture* capture) {
+    gint64 start = g_get_monotonic_time();
+    
+    char* filename;
+    if (capture->out) {
+        filename = g_strdup(capture->out);
+    } else {
+        char timestamp[20];
+        time_t now = time(NULL);
+        strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", localtime(&now));
+        filename = g_strdup_printf("LinShot_%s.%s", timestamp, capture->format ? capture->format : "png");
+    }
+    
+    GError* error = NULL;
+    const ExportFormat* format = resolve_format(capture->format, filename, &error);
+    if (!format) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        g_free(filename);
+        return 1;
+    }
+    
+    if (!capture_init()) {
+        g_free(filename);
+        return 1;
+    }
+    gint64 connected = g_get_monotonic_time();
+    
+    CaptureArea area = capture->area;
+    cairo_surface_t* surface = capture_screen(capture->mode, capture->mode == CAPTURE_AREA ? &area : NULL);
+    gint64 grabbed = g_get_monotonic_time();
+    capture_cleanup();
+    if (!surface) {
+        fprintf(stderr, "Failed to capture screen%s\n",
+                capture->mode == CAPTURE_WINDOW ? ": no active window" : "");
+        g_free(filename);
+        return 1;
+    }
+    
+    bool saved = export_save_surface(surface, filename, format, &error);
+    gint64 written = g_get_monotonic_time();
+    
+    if (capture->verbose) {
+        fprintf(stderr, "connect %.1f ms, grab %.1f ms (%dx%d), encode and write %.1f ms, total %.1f ms\n",
+                elapsed_ms(start, connected), elapsed_ms(connected, grabbed),
+                cairo_image_surface_get_width(surface), cairo_image_surface_get_height(surface),
+                elapsed_ms(grabbed, written), elapsed_ms(start, written));
+    }
+    cairo_surface_destroy(surface);
+    surface_pool_trim();
+    
+    if (!saved) {
+        fprintf(stderr, "Failed to save %s: %s\n", filename, error->message);
+        g_error_free(error);
+        g_free(filename);
+        return 1;
+    }
+    
+    // Say where a generated name ended up
+    if (!capture->out) printf("%s\n", filename);
+    g_free(filename);
+    return 0;
+}
@@ -0,0 +1,428 @@
+#include "../include/history_grid.h"
+#include "../include/thumbnail.h"
+#include "../include/surface_pool.h"
+
+// Cells are square and as large as the biggest thumbnail
+#define GRID_CELL_SIZE THUMBNAIL_SIZE
+#define GRID_SPACING 5
+#define GRID_PITCH (GRID_CELL_SIZE + GRID_SPACING)
+#define GRID_PLACEHOLDER_ICON_SIZE 48
+#define GRID_STATUS_INTERVAL_S 1
+
+typedef struct {
+    ScreenshotHistory* history;
+    GtkWidget* area;
+    GtkWidget* status;  // Entry count, thumbnail memory and pooled image buffers
+    GtkAdjustment* adjustment;
+    GdkPixbuf* placeholder;  // Shown until an entry's thumbnail arrives
+    guint count;     // Number of cells: history entries, or filter entries
+    GPtrArray* filter;  // Entries shown instead of the whole history, NULL for all
+    GtkWidget* menu;    // Context menu of a cell
+    GtkWidget* similar_item;
+    GtkWidget* show_all_item;
+    char* menu_path;    // File of the cell the menu was opened on
+    guint columns;
+    int offset_x;    // Left edge of the first column
+    int hover;       // Index of the cell under the pointer, -1 if none
+    guint status_source;
+    HistoryGridActivateFunc activate;
+    gpointer user_data;
+} HistoryGrid;
+
+// Range [first, last) of entry indexes whose rows intersect the viewport
+static void visible_range(HistoryGrid* grid, guint* first, guint* last) {
+    double top = gtk_adjustment_get_value(grid->adjustment);
+    double bottom = top + gtk_adjustment_get_page_size(grid->adjustment);
+    guint first_row = top > GRID_SPACING ? (guint)((top - GRID_SPACING) / GRID_PITCH) : 0;
+    guint last_row = bottom > GRID_SPACING ? (guint)((bottom - GRID_SPACING) / GRID_PITCH) : 0;
+    
+    *first = MIN(first_row * grid->columns, grid->count);
+    *last = MIN((last_row + 1) * grid->columns, grid->count);
+}
+
+// Entry index at a point of the widget, -1 for spacing and empty space
+static int hit_test(HistoryGrid* grid, double x, double y) {
+    int content_x = (int)(x - grid->offset_x);
+    int content_y = (int)(y + gtk_adjustment_get_value(grid->adjustment)) - GRID_SPACING;
+    if (x < grid->offset_x || content_y < 0) return -1;
+    if (content_x % GRID_PITCH >= GRID_CELL_SIZE || content_y % GRID_PITCH >= GRID_CELL_SIZE) return -1;
+    
+    guint column = content_x / GRID_PITCH;
+    guint index = (guint)(content_y / GRID_PITCH) * grid->columns + column;
+    if (column >= grid->columns || index >= grid->count) return -1;
+    return (int)index;
+}
+
+// Fit the columns to the width and the scroll range to the number of rows
+static void update_layout(HistoryGrid* grid) {
+    int width = gtk_widget_get_allocated_width(grid->area);
+    int height = gtk_widget_get_allocated_height(grid->area);
+    
+    grid->columns = MAX(1, (width - GRID_SPACING) / GRID_PITCH);
+    grid->offset_x = MAX(GRID_SPACING, (width - (int)grid->columns * GRID_PITCH + GRID_SPACING) / 2);
+    
+    guint rows = (grid->count + grid->columns - 1) / grid->columns;
+    double upper = MAX((double)rows * GRID_PITCH + GRID_SPACING, (double)height);
+    double value = CLAMP(gtk_adjustment_get_value(grid->adjustment), 0.0, upper - height);
+    gtk_adjustment_configure(grid->adjustment, value, 0.0, upper,
+                             GRID_PITCH / 4.0, height * 0.9, height);
+    gtk_widget_queue_draw(grid->area);
+}
+
+// Entries of cells [first, last), which must be a valid range
+static ScreenshotEntry* const* get_page(HistoryGrid* grid, guint first, guint last, guint* count) {
+    if (grid->filter) {
+        *count = last - first;
+        return (ScreenshotEntry* const*)grid->filter->pdata + first;
+    }
+    
+    // Ask the history for the page only
+    ScreenshotHistoryQuery query = { .offset = first, .limit = last - first };
+    return screenshot_history_get_sorted(grid->history, &query, count);
+}
+
+static void draw_cell(HistoryGrid* grid, cairo_t* cr, const ScreenshotEntry* entry,
+                      int x, int y, const GdkRGBA* fg, bool hover) {
+    GdkPixbuf* pixbuf = entry->thumbnail;
+    if (!pixbuf) {
+        cairo_rectangle(cr, x, y, GRID_CELL_SIZE, GRID_CELL_SIZE);
+        cairo_set_source_rgba(cr, fg->red, fg->green, fg->blue, fg->alpha * 0.08);
+        cairo_fill(cr);
+        pixbuf = grid->placeholder;
+    }
+    
+    if (pixbuf) {
+        int width = gdk_pixbuf_get_width(pixbuf);
+        int height = gdk_pixbuf_get_height(pixbuf);
+        gdk_cairo_set_source_pixbuf(cr, pixbuf, x + (GRID_CELL_SIZE - width) / 2,
+                                    y + (GRID_CELL_SIZE - height) / 2);
+        cairo_paint(cr);
+    }
+    
+    if (hover) {
+        cairo_rectangle(cr, x + 1, y + 1, GRID_CELL_SIZE - 2, GRID_CELL_SIZE - 2);
+        cairo_set_source_rgba(cr, fg->red, fg->green, fg->blue, fg->alpha * 0.5);
+        cairo_set_line_width(cr, 2.0);
+        cairo_stroke(cr);
+    }
+}
+
+static gboolean on_grid_draw(GtkWidget* widget, cairo_t* cr, gpointer data) {
+    HistoryGrid* grid = data;
+    GtkStyleContext* context = gtk_widget_get_style_context(widget);
+    int width = gtk_widget_get_allocated_width(widget);
+    int height = gtk_widget_get_allocated_height(widget);
+    gtk_render_background(context, cr, 0, 0, width, height);
+    
+    GdkRGBA fg;
+    gtk_style_context_get_color(context, gtk_style_context_get_state(context), &fg);
+    
+    guint first, last;
+    visible_range(grid, &first, &last);
+    int top = (int)gtk_adjustment_get_value(grid->adjustment);
+    
+    if (first >= last) return FALSE;
+    
+    // Fetch the entries of the visible rows only
+    guint count;
+    ScreenshotEntry* const* page = get_page(grid, first, last, &count);
+    for (guint index = first; index < first + count; index++) {
+        ScreenshotEntry* entry = page[index - first];
+        guint row = index / grid->columns;
+        guint column = index % grid->columns;
+        int x = grid->offset_x + (int)column * GRID_PITCH;
+        int y = GRID_SPACING + (int)row * GRID_PITCH - top;
+        
+        // Keeps drawn thumbnails from being evicted, and fetches missing ones
+        screenshot_history_request_thumbnail(grid->history, entry);
+        draw_cell(grid, cr, entry, x, y, &fg, (int)index == grid->hover);
+    }
+    
+    return FALSE;
+}
+
+static gboolean update_status(gpointer data) {
+    HistoryGrid* grid = data;
+    gsize current, peak;
+    screenshot_history_get_thumbnail_memory(grid->history, &current, &peak);
+    
+    char* current_text = g_format_size(current);
+    char* peak_text = g_format_size(peak);
+    char* budget_text = g_format_size(grid->history->thumbnail_budget);
+    char* pool_text = g_format_size(surface_pool_get_cached_bytes());
+    char* text = g_strdup_printf("%u %s, thumbnails use %s of %s (peak %s), %s of image buffers kept",
+                                 grid->count, grid->filter ? "similar screenshots" : "screenshots",
+                                 current_text, budget_text, peak_text, pool_text);
+    if (g_strcmp0(gtk_label_get_text(GTK_LABEL(grid->status)), text) != 0) {
+        gtk_label_set_text(GTK_LABEL(grid->status), text);
+    }
+    
+    g_free(text);
+    g_free(pool_text);
+    g_free(budget_text);
+    g_free(peak_text);
+    g_free(current_text);
+    return G_SOURCE_CONTINUE;
+}
+
+static void set_hover(HistoryGrid* grid, int hover) {
+    if (grid->hover == hover) return;
+    grid->hover = hover;
+    gtk_widget_queue_draw(grid->area);
+}
+
+static void on_grid_size_allocate(GtkWidget* widget, GdkRectangle* allocation, gpointer data) {
+    (void)widget;
+    (void)allocation;
+    update_layout((HistoryGrid*)data);
+}
+
+static gboolean on_grid_scroll(GtkWidget* widget, GdkEventScroll* event, gpointer data) {
+    (void)widget;
+    HistoryGrid* grid = data;
+    double delta;
+    
+    switch (event->direction) {
+        case GDK_SCROLL_UP:
+            delta = -1.0;
+            break;
+        case GDK_SCROLL_DOWN:
+            delta = 1.0;
+            break;
+        case GDK_SCROLL_SMOOTH:
+            delta = event->delta_y;
+            break;
+        default:
+            return FALSE;
+    }
+    
+    // The adjustment clamps the value to the scroll range
+    double value = gtk_adjustment_get_value(grid->adjustment);
+    gtk_adjustment_set_value(grid->adjustment, value + delta * GRID_PITCH / 2.0);
+    set_hover(grid, hit_test(grid, event->x, event->y));
+    return TRUE;
+}
+
+static gboolean on_grid_motion(GtkWidget* widget, GdkEventMotion* event, gpointer data) {
+    (void)widget;
+    HistoryGrid* grid = data;
+    set_hover(grid, hit_test(grid, event->x, event->y));
+    return FALSE;
+}
+
+static gboolean on_grid_leave(GtkWidget* widget, GdkEventCrossing* event, gpointer data) {
+    (void)widget;
+    (void)event;
+    set_hover((HistoryGrid*)data, -1);
+    return FALSE;
+}
+
+// Show filter instead of the whole history, or everything again for NULL
+static void set_filter(HistoryGrid* grid, GPtrArray* filter) {
+    if (grid->filter) g_ptr_array_unref(grid->filter);
+    grid->filter = filter;
+    grid->count = filter ? filter->len : screenshot_history_get_count(grid->history);
+    grid->hover = -1;
+    gtk_adjustment_set_value(grid->adjustment, 0.0);
+    update_layout(grid);
+    update_status(grid);
+}
+
+static void on_find_similar(GtkMenuItem* item, gpointer data) {
+    (void)item;
+    HistoryGrid* grid = data;
+    
+    // The entry may have gone away while the menu was open
+    ScreenshotEntry* entry = grid->menu_path ? g_hash_table_lookup(grid->history->index, grid->menu_path) : NULL;
+    GPtrArray* similar = screenshot_history_find_similar(grid->history, entry, SCREENSHOT_HISTORY_SIMILAR_DISTANCE);
+    if (similar) set_filter(grid, similar);
+}
+
+static void on_show_all(GtkMenuItem* item, gpointer data) {
+    (void)item;
+    set_filter((HistoryGrid*)data, NULL);
+}
+
+static void popup_menu(HistoryGrid* grid, ScreenshotEntry* entry, GdkEventButton* event) {
+    g_free(grid->menu_path);
+    grid->menu_path = entry ? g_strdup(entry->filepath) : NULL;
+    
+    gtk_widget_set_sensitive(grid->similar_item, entry && entry->has_perceptual_hash);
+    gtk_widget_set_sensitive(grid->show_all_item, grid->filter != NULL);
+    gtk_menu_popup_at_pointer(GTK_MENU(grid->menu), (GdkEvent*)event);
+}
+
+static gboolean on_grid_button_press(GtkWidget* widget, GdkEventButton* event, gpointer data) {
+    (void)widget;
+    HistoryGrid* grid = data;
+    if (event->type != GDK_BUTTON_PRESS) return FALSE;
+    if (event->button != GDK_BUTTON_PRIMARY && event->button != GDK_BUTTON_SECONDARY) return FALSE;
+    
+    int index = hit_test(grid, event->x, event->y);
+    ScreenshotEntry* entry = NULL;
+    if (index >= 0) {
+        guint count;
+        ScreenshotEntry* const* page = get_page(grid, (guint)index, (guint)index + 1, &count);
+        if (count == 1) entry = page[0];
+    }
+    
+    if (event->button == GDK_BUTTON_SECONDARY) {
+        popup_menu(grid, entry, event);
+        return TRUE;
+    }
+    
+    if (!entry) return FALSE;
+    if (grid->activate) {
+        grid->activate(entry, grid->user_data);
+    }
+    return TRUE;
+}
+
+static void on_adjustment_changed(GtkAdjustment* adjustment, gpointer data) {
+    (void)adjustment;
+    gtk_widget_queue_draw(((HistoryGrid*)data)->area);
+}
+
+// History notifications: nothing is laid out per entry, so every change
+// only updates the row count and repaints
+
+static void on_entry_inserted(ScreenshotEntry* entry, guint position, gpointer data) {
+    (void)entry;
+    (void)position;
+    HistoryGrid* grid = data;
+    
+    // A filtered view keeps showing what it was asked for
+    if (grid->filter) return;
+    grid->count++;
+    grid->hover = -1;
+    update_layout(grid);
+}
+
+static void on_entry_removed(ScreenshotEntry* entry, guint position, gpointer data) {
+    (void)position;
+    HistoryGrid* grid = data;
+    if (grid->filter) {
+        if (!g_ptr_array_remove(grid->filter, entry)) return;
+        grid->count = grid->filter->len;
+    } else if (grid->count > 0) {
+        grid->count--;
+    }
+    grid->hover = -1;
+    update_layout(grid);
+}
+
+static void on_entry_moved(ScreenshotEntry* entry, guint old_position, guint new_position, gpointer data) {
+    (void)entry;
+    (void)old_position;
+    (void)new_position;
+    gtk_widget_queue_draw(((HistoryGrid*)data)->area);
+}
+
+static void on_thumbnail_changed(ScreenshotEntry* entry, guint position, gpointer data) {
+    (void)entry;
+    HistoryGrid* grid = data;
+    guint first, last;
+    visible_range(grid, &first, &last);
+    if (grid->filter || (position >= first && position < last)) {
+        gtk_widget_queue_draw(grid->area);
+    }
+}
+
+static void on_history_reset(gpointer data) {
+    HistoryGrid* grid = data;
+    if (grid->filter) {
+        g_ptr_array_unref(grid->filter);
+        grid->filter = NULL;
+    }
+    grid->count = screenshot_history_get_count(grid->history);
+    grid->hover = -1;
+    gtk_adjustment_set_value(grid->adjustment, 0.0);
+    update_layout(grid);
+}
+
+static const ScreenshotHistoryObserver grid_observer = {
+    .inserted = on_entry_inserted,
+    .removed = on_entry_removed,
+    .moved = on_entry_moved,
+    .thumbnail_changed = on_thumbnail_changed,
+    .reset = on_history_reset,
+};
+
+static void on_grid_destroy(GtkWidget* widget, gpointer data) {
+    (void)widget;
+    HistoryGrid* grid = data;
+    
+    screenshot_history_set_observer(grid->history, NULL, NULL);
+    g_source_remove(grid->status_source);
+    g_signal_handlers_disconnect_by_data(grid->adjustment, grid);
+    g_object_unref(grid->adjustment);
+    if (grid->placeholder) g_object_unref(grid->placeholder);
+    if (grid->filter) g_ptr_array_unref(grid->filter);
+    g_free(grid->menu_path);
+    g_free(grid);
+}
+
+GtkWidget* history_grid_new(ScreenshotHistory* history, HistoryGridActivateFunc activate, gpointer user_data) {
+    if (!history) return NULL;
+    
+    HistoryGrid* grid = g_new0(HistoryGrid, 1);
+    grid->history = history;
+    grid->count = screenshot_history_get_count(history);
+    grid->columns = 1;
+    grid->hover = -1;
+    grid->activate = activate;
+    grid->user_data = user_data;
+    grid->placeholder = gtk_icon_theme_load_icon(gtk_icon_theme_get_default(), "image-loading",
+                                                 GRID_PLACEHOLDER_ICON_SIZE, 0, NULL);
+    
+    grid->adjustment = g_object_ref_sink(gtk_adjustment_new(0.0, 0.0, 0.0, 0.0, 0.0, 0.0));
+    g_signal_connect(grid->adjustment, "value-changed", G_CALLBACK(on_adjustment_changed), grid);
+    
+    // The drawing area stands in for the whole virtual height; the scrollbar
+    // drives which slice of it is painted
+    grid->area = gtk_drawing_area_new();
+    gtk_widget_set_hexpand(grid->area, TRUE);
+    gtk_widget_set_vexpand(grid->area, TRUE);
+    gtk_widget_add_events(grid->area, GDK_BUTTON_PRESS_MASK | GDK_POINTER_MOTION_MASK |
+                                      GDK_LEAVE_NOTIFY_MASK | GDK_SCROLL_MASK | GDK_SMOOTH_SCROLL_MASK);
+    g_signal_connect(grid->area, "draw", G_CALLBACK(on_grid_draw), grid);
+    g_signal_connect(grid->area, "size-allocate", G_CALLBACK(on_grid_size_allocate), grid);
+    g_signal_connect(grid->area, "scroll-event", G_CALLBACK(on_grid_scroll), grid);
+    g_signal_connect(grid->area, "motion-notify-event", G_CALLBACK(on_grid_motion), grid);
+    g_signal_connect(grid->area, "leave-notify-event", G_CALLBACK(on_grid_leave), grid);
+    g_signal_connect(grid->area, "button-press-event", G_CALLBACK(on_grid_button_press), grid);
+    
+    // Context menu; attached to the area so it is destroyed along with it
+    grid->menu = gtk_menu_new();
+    grid->similar_item = gtk_menu_item_new_with_label("Find similar");
+    grid->show_all_item = gtk_menu_item_new_with_label("Show all");
+    g_signal_connect(grid->similar_item, "activate", G_CALLBACK(on_find_similar), grid);
+    g_signal_connect(grid->show_all_item, "activate", G_CALLBACK(on_show_all), grid);
+    gtk_menu_shell_append(GTK_MENU_SHELL(grid->menu), grid->similar_item);
+    gtk_menu_shell_append(GTK_MENU_SHELL(grid->menu), grid->show_all_item);
+    gtk_widget_show_all(grid->menu);
+    gtk_menu_attach_to_widget(GTK_MENU(grid->menu), grid->area, NULL);
+    
+    GtkWidget* scrollbar = gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, grid->adjustment);
+    
+    GtkWidget* view = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    gtk_box_pack_start(GTK_BOX(view), grid->area, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(view), scrollbar, FALSE, FALSE, 0);
+    
+    // Evictions happen without notifications, so the memory figures are polled
+    grid->status = gtk_label_new(NULL);
+    gtk_widget_set_halign(grid->status, GTK_ALIGN_START);
+    gtk_widget_set_margin_start(grid->status, GRID_SPACING);
+    gtk_widget_set_margin_top(grid->status, GRID_SPACING);
+    gtk_widget_set_margin_bottom(grid->status, GRID_SPACING);
+    grid->status_source = g_timeout_add_seconds(GRID_STATUS_INTERVAL_S, update_status, grid);
+    update_status(grid);
+    
+    GtkWidget* box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    gtk_box_pack_start(GTK_BOX(box), view, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(box), grid->status, FALSE, FALSE, 0);
+    g_signal_connect(box, "destroy", G_CALLBACK(on_grid_destroy), grid);
+    
+    screenshot_history_set_observer(history, &grid_observer, grid);
+    return box;
+}
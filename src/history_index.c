@@ -0,0 +1,245 @@
+#include "../include/history_index.h"
+#include "../include/hash.h"
+#include <glib/gstdio.h>
+#include <sys/stat.h>
+#include <string.h>
+
+/*
+ * On-disk layout (all integers little-endian):
+ *
+ *   IndexHeader
+ *   IndexRecord[record_count]    fixed size, newest first
+ *   names                        directory, then one name per record,
+ *                                each NUL-terminated
+ *
+ * The file lives in the cache directory, named after a hash of the
+ * screenshot directory, so read-only or shared screenshot directories
+ * work too.
+ */
+
+static const char INDEX_MAGIC[4] = { 'L', 'S', 'H', 'I' };
+
+// IndexRecord flags
+#define RECORD_HAS_PERCEPTUAL_HASH (1u << 0)
+#define RECORD_COMPACTED (1u << 1)
+
+typedef struct {
+    char magic[4];
+    guint16 version;
+    guint16 header_size;
+    guint32 record_count;
+    guint32 record_size;
+    gint64 directory_mtime;  // Nanoseconds
+    guint32 directory_offset, directory_len;  // Inside names
+    guint32 names_offset, names_size;
+} IndexHeader;
+
+typedef struct {
+    gint64 mtime;
+    gint64 size;
+    guint64 content_hash;
+    gint64 thumbnail_offset;
+    guint32 width, height;
+    guint32 name_offset, name_len;  // Inside names
+    guint64 perceptual_hash;
+    guint32 flags;
+    guint32 reserved;
+    gint64 timestamp;
+} IndexRecord;
+
+G_STATIC_ASSERT(sizeof(IndexHeader) == 40);
+G_STATIC_ASSERT(sizeof(IndexRecord) == 72);
+
+struct HistoryIndex {
+    GMappedFile* mapped;
+    const char* contents;
+    guint count;
+    guint32 header_size;
+    guint32 record_size;
+    const char* names;
+    guint32 names_size;
+};
+
+static char* get_index_path(const char* directory) {
+    char* name = g_strdup_printf("history-%016" G_GINT64_MODIFIER "x.idx",
+                                 hash64(directory, strlen(directory), 0));
+    char* path = g_build_filename(g_get_user_cache_dir(), "linshot", name, NULL);
+    g_free(name);
+    return path;
+}
+
+// Name of length len at offset, if it lies inside names and is terminated
+static const char* get_name(const char* names, guint32 names_size, guint32 offset, guint32 len) {
+    if (offset >= names_size || len >= names_size - offset || names[offset + len] != '\0') {
+        return NULL;
+    }
+    return names + offset;
+}
+
+static void read_record(HistoryIndex* index, guint position, IndexRecord* record) {
+    memcpy(record, index->contents + index->header_size + (gsize)position * index->record_size, sizeof(*record));
+}
+
+bool history_index_get_directory_mtime(const char* directory, gint64* mtime_ns) {
+    struct stat st;
+    if (!directory || stat(directory, &st) != 0) return false;
+    *mtime_ns = (gint64)st.st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000) + st.st_mtim.tv_nsec;
+    return true;
+}
+
+HistoryIndex* history_index_open(const char* directory) {
+    gint64 directory_mtime;
+    if (!history_index_get_directory_mtime(directory, &directory_mtime)) return NULL;
+    
+    char* path = get_index_path(directory);
+    GMappedFile* mapped = g_mapped_file_new(path, FALSE, NULL);
+    g_free(path);
+    if (!mapped) return NULL;
+    
+    const char* contents = g_mapped_file_get_contents(mapped);
+    gsize length = g_mapped_file_get_length(mapped);
+    
+    IndexHeader header;
+    if (length < sizeof(header)) goto invalid;
+    memcpy(&header, contents, sizeof(header));
+    
+    guint32 header_size = GUINT16_FROM_LE(header.header_size);
+    guint32 record_count = GUINT32_FROM_LE(header.record_count);
+    guint32 record_size = GUINT32_FROM_LE(header.record_size);
+    guint32 names_offset = GUINT32_FROM_LE(header.names_offset);
+    guint32 names_size = GUINT32_FROM_LE(header.names_size);
+    
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+        GUINT16_FROM_LE(header.version) != HISTORY_INDEX_VERSION ||
+        header_size < sizeof(IndexHeader) ||
+        record_size < sizeof(IndexRecord) ||
+        (guint64)header_size + (guint64)record_count * record_size > names_offset ||
+        (guint64)names_offset + names_size > length) {
+        goto invalid;
+    }
+    
+    // The listing is only current if the directory has not changed since
+    const char* names = contents + names_offset;
+    const char* indexed = get_name(names, names_size, GUINT32_FROM_LE(header.directory_offset),
+                                   GUINT32_FROM_LE(header.directory_len));
+    if (!indexed || strcmp(indexed, directory) != 0 ||
+        GINT64_FROM_LE(header.directory_mtime) != directory_mtime) {
+        goto invalid;
+    }
+    
+    HistoryIndex* index = g_new0(HistoryIndex, 1);
+    index->mapped = mapped;
+    index->contents = contents;
+    index->count = record_count;
+    index->header_size = header_size;
+    index->record_size = record_size;
+    index->names = names;
+    index->names_size = names_size;
+    return index;
+    
+invalid:
+    g_mapped_file_unref(mapped);
+    return NULL;
+}
+
+void history_index_close(HistoryIndex* index) {
+    if (!index) return;
+    g_mapped_file_unref(index->mapped);
+    g_free(index);
+}
+
+guint history_index_get_count(HistoryIndex* index) {
+    return index ? index->count : 0;
+}
+
+bool history_index_get_record(HistoryIndex* index, guint position, HistoryIndexRecord* record) {
+    if (!index || position >= index->count) return false;
+    
+    IndexRecord stored;
+    read_record(index, position, &stored);
+    
+    const char* name = get_name(index->names, index->names_size, GUINT32_FROM_LE(stored.name_offset),
+                                GUINT32_FROM_LE(stored.name_len));
+    if (!name || name[0] == '\0') return false;
+    
+    record->name = name;
+    record->mtime = GINT64_FROM_LE(stored.mtime);
+    record->timestamp = GINT64_FROM_LE(stored.timestamp);
+    record->size = GINT64_FROM_LE(stored.size);
+    record->width = GUINT32_FROM_LE(stored.width);
+    record->height = GUINT32_FROM_LE(stored.height);
+    record->content_hash = GUINT64_FROM_LE(stored.content_hash);
+    record->thumbnail_offset = GINT64_FROM_LE(stored.thumbnail_offset);
+    record->perceptual_hash = GUINT64_FROM_LE(stored.perceptual_hash);
+    guint32 flags = GUINT32_FROM_LE(stored.flags);
+    record->has_perceptual_hash = (flags & RECORD_HAS_PERCEPTUAL_HASH) != 0;
+    record->compacted = (flags & RECORD_COMPACTED) != 0;
+    return true;
+}
+
+// Append a NUL-terminated string to the names blob and return its offset
+static guint32 append_name(GByteArray* names, const char* name, guint32* len) {
+    guint32 offset = names->len;
+    *len = (guint32)strlen(name);
+    g_byte_array_append(names, (const guint8*)name, *len + 1);
+    return offset;
+}
+
+bool history_index_write(const char* directory, gint64 directory_mtime_ns,
+                         const HistoryIndexRecord* records, guint count, GError** error) {
+    if (!directory) return false;
+    
+    GByteArray* names = g_byte_array_new();
+    GByteArray* file = g_byte_array_sized_new(sizeof(IndexHeader) + (gsize)count * sizeof(IndexRecord));
+    
+    IndexHeader header = {0};
+    guint32 directory_len;
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = GUINT16_TO_LE(HISTORY_INDEX_VERSION);
+    header.header_size = GUINT16_TO_LE(sizeof(IndexHeader));
+    header.record_count = GUINT32_TO_LE(count);
+    header.record_size = GUINT32_TO_LE(sizeof(IndexRecord));
+    header.directory_mtime = GINT64_TO_LE(directory_mtime_ns);
+    header.directory_offset = GUINT32_TO_LE(append_name(names, directory, &directory_len));
+    header.directory_len = GUINT32_TO_LE(directory_len);
+    header.names_offset = GUINT32_TO_LE(sizeof(IndexHeader) + count * sizeof(IndexRecord));
+    g_byte_array_append(file, (const guint8*)&header, sizeof(header));
+    
+    for (guint i = 0; i < count; i++) {
+        const HistoryIndexRecord* source = &records[i];
+        IndexRecord record = {0};
+        guint32 name_len;
+        
+        record.mtime = GINT64_TO_LE(source->mtime);
+        record.timestamp = GINT64_TO_LE(source->timestamp);
+        record.size = GINT64_TO_LE(source->size);
+        record.content_hash = GUINT64_TO_LE(source->content_hash);
+        record.thumbnail_offset = GINT64_TO_LE(source->thumbnail_offset);
+        record.width = GUINT32_TO_LE(source->width);
+        record.height = GUINT32_TO_LE(source->height);
+        record.name_offset = GUINT32_TO_LE(append_name(names, source->name, &name_len));
+        record.name_len = GUINT32_TO_LE(name_len);
+        record.perceptual_hash = GUINT64_TO_LE(source->perceptual_hash);
+        record.flags = GUINT32_TO_LE((source->has_perceptual_hash ? RECORD_HAS_PERCEPTUAL_HASH : 0) |
+                                     (source->compacted ? RECORD_COMPACTED : 0));
+        g_byte_array_append(file, (const guint8*)&record, sizeof(record));
+    }
+    
+    // Patch in the size of the names blob now that it is known
+    guint32 names_size = GUINT32_TO_LE(names->len);
+    memcpy(file->data + G_STRUCT_OFFSET(IndexHeader, names_size), &names_size, sizeof(names_size));
+    g_byte_array_append(file, names->data, names->len);
+    
+    char* path = get_index_path(directory);
+    char* dir = g_path_get_dirname(path);
+    g_mkdir_with_parents(dir, 0700);
+    
+    // g_file_set_contents() replaces the index atomically
+    bool ok = g_file_set_contents(path, (const char*)file->data, file->len, error);
+    
+    g_free(dir);
+    g_free(path);
+    g_byte_array_free(file, TRUE);
+    g_byte_array_free(names, TRUE);
+    return ok;
+}
@@ -0,0 +1,307 @@
+#include "../include/image_loader.h"
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <string.h>
+
+// Decoders running at once; one serves the open while another prefetches
+#define IMAGE_LOADER_THREADS 2
+
+// Kinds of job queued or running for a path, in in_flight
+#define JOB_PREFETCH (1u << 0)
+#define JOB_OPEN (1u << 1)
+
+typedef struct {
+    char* filepath;
+    gint64 mtime;  // Nanoseconds, to tell whether the file changed since
+    gint64 size;
+    cairo_surface_t* image;
+    GList link;    // Node in the cache queue
+} CachedImage;
+
+typedef struct {
+    ImageLoader* loader;
+    char* filepath;
+    bool open;       // Requested by image_loader_open() rather than a prefetch
+    guint sequence;
+    gint64 mtime;
+    gint64 size;
+    cairo_surface_t* image;
+    GError* error;
+} LoadJob;
+
+struct ImageLoader {
+    guint capacity;
+    GQueue cache;              // CachedImage, most recently used first
+    GHashTable* cached;        // Filepath -> CachedImage in cache
+    GHashTable* in_flight;     // Filepath -> JOB_* flags of its queued or running jobs
+    GThreadPool* pool;         // Opens first, then the latest requests
+    GAsyncQueue* results;      // Finished jobs waiting for the main loop
+    gint flush_pending;        // A delivery is scheduled
+    gint closing;              // Being freed; queued jobs are passed through undecoded
+    guint sequence;            // Orders requests
+    gint open_sequence;        // Sequence of the latest open; older opens are skipped
+    char* open_path;           // File of the latest open, until it is reported
+    ImageLoaderDoneFunc done;
+    gpointer user_data;
+};
+
+static bool stat_file(const char* filepath, gint64* mtime, gint64* size) {
+    struct stat st;
+    if (stat(filepath, &st) != 0) return false;
+    *mtime = (gint64)st.st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000) + st.st_mtim.tv_nsec;
+    *size = st.st_size;
+    return true;
+}
+
+static void cached_image_free(CachedImage* cached) {
+    g_free(cached->filepath);
+    cairo_surface_destroy(cached->image);
+    g_free(cached);
+}
+
+static void load_job_free(LoadJob* job) {
+    g_free(job->filepath);
+    if (job->image) cairo_surface_destroy(job->image);
+    if (job->error) g_error_free(job->error);
+    g_free(job);
+}
+
+// Thread pool order: opens first, then the most recent request
+static int compare_jobs(gconstpointer a, gconstpointer b, gpointer user_data) {
+    (void)user_data;
+    const LoadJob* job_a = a;
+    const LoadJob* job_b = b;
+    if (job_a->open != job_b->open) return job_a->open ? -1 : 1;
+    if (job_a->sequence == job_b->sequence) return 0;
+    return job_a->sequence > job_b->sequence ? -1 : 1;
+}
+
+// Copy an 8-bit RGB(A) pixbuf into a premultiplied ARGB32 surface
+static cairo_surface_t* surface_from_pixbuf(GdkPixbuf* pixbuf) {
+    int width = gdk_pixbuf_get_width(pixbuf);
+    int height = gdk_pixbuf_get_height(pixbuf);
+    int channels = gdk_pixbuf_get_n_channels(pixbuf);
+    int src_stride = gdk_pixbuf_get_rowstride(pixbuf);
+    bool has_alpha = gdk_pixbuf_get_has_alpha(pixbuf);
+    const guint8* src = gdk_pixbuf_read_pixels(pixbuf);
+    if (gdk_pixbuf_get_bits_per_sample(pixbuf) != 8 || channels < (has_alpha ? 4 : 3)) return NULL;
+    
+    cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        return NULL;
+    }
+    
+    cairo_surface_flush(surface);
+    guint8* dst = cairo_image_surface_get_data(surface);
+    int dst_stride = cairo_image_surface_get_stride(surface);
+    for (int y = 0; y < height; y++) {
+        const guint8* src_row = src + (gsize)y * src_stride;
+        guint32* dst_row = (guint32*)(dst + (gsize)y * dst_stride);
+        for (int x = 0; x < width; x++) {
+            const guint8* pixel = src_row + x * channels;
+            guint32 alpha = has_alpha ? pixel[3] : 255;
+            guint32 red = pixel[0], green = pixel[1], blue = pixel[2];
+            if (alpha != 255) {
+                red = (red * alpha + 127) / 255;
+                green = (green * alpha + 127) / 255;
+                blue = (blue * alpha + 127) / 255;
+            }
+            dst_row[x] = alpha << 24 | red << 16 | green << 8 | blue;
+        }
+    }
+    cairo_surface_mark_dirty(surface);
+    return surface;
+}
+
+// Remember a decoded image as the most recently used, dropping the least
+// recently used beyond capacity
+static void cache_insert(ImageLoader* loader, LoadJob* job) {
+    CachedImage* cached = g_hash_table_lookup(loader->cached, job->filepath);
+    if (cached) {
+        g_queue_unlink(&loader->cache, &cached->link);
+        g_hash_table_remove(loader->cached, job->filepath);
+        cached_image_free(cached);
+    }
+    
+    cached = g_new0(CachedImage, 1);
+    cached->filepath = g_strdup(job->filepath);
+    cached->mtime = job->mtime;
+    cached->size = job->size;
+    cached->image = cairo_surface_reference(job->image);
+    cached->link.data = cached;
+    g_queue_push_head_link(&loader->cache, &cached->link);
+    g_hash_table_replace(loader->cached, cached->filepath, cached);
+    
+    while (loader->cache.length > loader->capacity) {
+        // The links are embedded in the entries, so only unlink them
+        CachedImage* oldest = g_queue_pop_tail_link(&loader->cache)->data;
+        g_hash_table_remove(loader->cached, oldest->filepath);
+        cached_image_free(oldest);
+    }
+}
+
+// Main thread: cache every finished image and report the latest open
+static gboolean deliver_results(gpointer data) {
+    ImageLoader* loader = data;
+    
+    // Clear the flag first so jobs finishing meanwhile schedule a new delivery
+    g_atomic_int_set(&loader->flush_pending, 0);
+    
+    LoadJob* job;
+    while ((job = g_async_queue_try_pop(loader->results)) != NULL) {
+        guint flags = GPOINTER_TO_UINT(g_hash_table_lookup(loader->in_flight, job->filepath));
+        flags &= ~(job->open ? JOB_OPEN : JOB_PREFETCH);
+        if (flags) {
+            g_hash_table_insert(loader->in_flight, g_strdup(job->filepath), GUINT_TO_POINTER(flags));
+        } else {
+            g_hash_table_remove(loader->in_flight, job->filepath);
+        }
+        
+        if (job->image) {
+            cache_insert(loader, job);
+        }
+        
+        // A prefetch that finishes first serves the open as well
+        if (loader->open_path && strcmp(loader->open_path, job->filepath) == 0 &&
+            (job->image || (job->open && job->error))) {
+            char* filepath = loader->open_path;
+            loader->open_path = NULL;
+            if (loader->done) {
+                loader->done(filepath, job->image, job->error, loader->user_data);
+            }
+            g_free(filepath);
+        }
+        load_job_free(job);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Worker thread: decode one file
+static void run_load_job(gpointer data, gpointer user_data) {
+    (void)user_data;
+    LoadJob* job = data;
+    ImageLoader* loader = job->loader;
+    
+    // Opens superseded while queued are dropped; when flipping quickly
+    // through the history only the file landed on is decoded
+    bool superseded = job->open && (gint)job->sequence != g_atomic_int_get(&loader->open_sequence);
+    
+    if (!superseded && !g_atomic_int_get(&loader->closing)) {
+        if (!stat_file(job->filepath, &job->mtime, &job->size)) {
+            int saved_errno = errno;
+            g_set_error_literal(&job->error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                                g_strerror(saved_errno));
+        } else {
+            GdkPixbuf* pixbuf = gdk_pixbuf_new_from_file(job->filepath, &job->error);
+            if (pixbuf) {
+                job->image = surface_from_pixbuf(pixbuf);
+                if (!job->image) {
+                    g_set_error(&job->error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Cannot convert image");
+                }
+                g_object_unref(pixbuf);
+            }
+        }
+    }
+    
+    g_async_queue_push(loader->results, job);
+    if (g_atomic_int_compare_and_exchange(&loader->flush_pending, 0, 1)) {
+        g_idle_add(deliver_results, loader);
+    }
+}
+
+static void push_job(ImageLoader* loader, const char* filepath, bool open) {
+    guint flags = GPOINTER_TO_UINT(g_hash_table_lookup(loader->in_flight, filepath));
+    g_hash_table_insert(loader->in_flight, g_strdup(filepath),
+                        GUINT_TO_POINTER(flags | (open ? JOB_OPEN : JOB_PREFETCH)));
+    
+    LoadJob* job = g_new0(LoadJob, 1);
+    job->loader = loader;
+    job->filepath = g_strdup(filepath);
+    job->open = open;
+    job->sequence = ++loader->sequence;
+    if (open) {
+        g_atomic_int_set(&loader->open_sequence, (gint)job->sequence);
+    }
+    g_thread_pool_push(loader->pool, job, NULL);
+}
+
+ImageLoader* image_loader_new(guint capacity) {
+    ImageLoader* loader = g_new0(ImageLoader, 1);
+    loader->capacity = MAX(1, capacity);
+    g_queue_init(&loader->cache);
+    loader->cached = g_hash_table_new(g_str_hash, g_str_equal);
+    loader->in_flight = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    loader->results = g_async_queue_new();
+    loader->pool = g_thread_pool_new(run_load_job, NULL, IMAGE_LOADER_THREADS, FALSE, NULL);
+    g_thread_pool_set_sort_function(loader->pool, compare_jobs, NULL);
+    return loader;
+}
+
+void image_loader_free(ImageLoader* loader) {
+    if (!loader) return;
+    
+    // Queued jobs run through the pool without decoding and are handed
+    // back to be freed with the finished ones
+    g_atomic_int_set(&loader->closing, 1);
+    g_thread_pool_free(loader->pool, FALSE, TRUE);
+    if (g_atomic_int_get(&loader->flush_pending)) {
+        g_source_remove_by_user_data(loader);
+    }
+    LoadJob* job;
+    while ((job = g_async_queue_try_pop(loader->results)) != NULL) {
+        load_job_free(job);
+    }
+    g_async_queue_unref(loader->results);
+    
+    GList* link;
+    while ((link = g_queue_pop_head_link(&loader->cache)) != NULL) {
+        cached_image_free(link->data);
+    }
+    g_hash_table_destroy(loader->cached);
+    g_hash_table_destroy(loader->in_flight);
+    g_free(loader->open_path);
+    g_free(loader);
+}
+
+cairo_surface_t* image_loader_lookup(ImageLoader* loader, const char* filepath) {
+    if (!loader || !filepath) return NULL;
+    
+    CachedImage* cached = g_hash_table_lookup(loader->cached, filepath);
+    if (!cached) return NULL;
+    
+    gint64 mtime, size;
+    if (!stat_file(filepath, &mtime, &size) || mtime != cached->mtime || size != cached->size) {
+        g_queue_unlink(&loader->cache, &cached->link);
+        g_hash_table_remove(loader->cached, filepath);
+        cached_image_free(cached);
+        return NULL;
+    }
+    
+    g_queue_unlink(&loader->cache, &cached->link);
+    g_queue_push_head_link(&loader->cache, &cached->link);
+    return cairo_surface_reference(cached->image);
+}
+
+void image_loader_open(ImageLoader* loader, const char* filepath,
+                       ImageLoaderDoneFunc done, gpointer user_data) {
+    if (!loader || !filepath) return;
+    
+    g_free(loader->open_path);
+    loader->open_path = g_strdup(filepath);
+    loader->done = done;
+    loader->user_data = user_data;
+    
+    // Always queue a new job: one already queued for filepath may have been
+    // superseded in between and would be skipped
+    push_job(loader, filepath, true);
+}
+
+void image_loader_prefetch(ImageLoader* loader, const char* filepath) {
+    if (!loader || !filepath) return;
+    if (g_hash_table_contains(loader->cached, filepath)) return;
+    if (g_hash_table_contains(loader->in_flight, filepath)) return;
+    push_job(loader, filepath, false);
+}
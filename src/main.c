@@ -1,10 +1,115 @@
 #include "../include/main_window.h"
+#include "../include/capture_server.h"
+#include "../include/headless_capture.h"
 #include <stdio.h>
+#include <string.h>
+
+// Hand command to the running instance. Returns the exit status, or -1
+// if no instance is running.
+static int send_command(const char* command, bool quiet) {
+    bool ok = false;
+    char* message = NULL;
+    GError* error = NULL;
+    if (!capture_server_send(command, &ok, &message, &error)) {
+        if (!quiet) fprintf(stderr, "No running LinShot instance: %s\n", error->message);
+        g_error_free(error);
+        return -1;
+    }
+    
+    if (*message) fprintf(ok ? stdout : stderr, "%s\n", message);
+    g_free(message);
+    return ok ? 0 : 1;
+}
+
+// Fill in a headless capture from the command line
+static bool parse_headless(const char* mode, const char* geometry, HeadlessCapture* capture) {
+    if (strcmp(mode, "fullscreen") == 0) {
+        capture->mode = CAPTURE_FULLSCREEN;
+    } else if (strcmp(mode, "area") == 0) {
+        capture->mode = CAPTURE_AREA;
+    } else if (strcmp(mode, "window") == 0) {
+        capture->mode = CAPTURE_WINDOW;
+    } else {
+        fprintf(stderr, "Unknown capture mode %s; use fullscreen, area or window\n", mode);
+        return false;
+    }
+    
+    if (capture->mode == CAPTURE_AREA && !capture_parse_area(geometry, &capture->area)) {
+        fprintf(stderr, "--capture area needs --geometry x,y,width,height\n");
+        return false;
+    }
+    if (capture->mode != CAPTURE_AREA && geometry) {
+        fprintf(stderr, "--geometry only applies to --capture area\n");
+        return false;
+    }
+    return true;
+}
 
 int main(int argc, char* argv[]) {
+    // Startup timings count from here, option parsing and the probe for a
+    // running instance included
+    gint64 startup_time = g_get_monotonic_time();
+    char* command = NULL;
+    char* capture_mode = NULL;
+    char* geometry = NULL;
+    char* out = NULL;
+    char* format = NULL;
+    gboolean verbose = FALSE;
+    GOptionEntry entries[] = {
+        { "send", 0, 0, G_OPTION_ARG_STRING, &command,
+          "Send a command to the running instance", "COMMAND" },
+        { "capture", 0, 0, G_OPTION_ARG_STRING, &capture_mode,
+          "Capture without a window and exit", "fullscreen|area|window" },
+        { "geometry", 0, 0, G_OPTION_ARG_STRING, &geometry,
+          "Area to capture", "X,Y,WIDTH,HEIGHT" },
+        { "out", 0, 0, G_OPTION_ARG_FILENAME, &out,
+          "File to write the capture to", "FILE" },
+        { "format", 0, 0, G_OPTION_ARG_STRING, &format,
+          "Format of the capture, by default from the file name", "png|webp" },
+        { "verbose", 0, 0, G_OPTION_ARG_NONE, &verbose,
+          "Print how long every stage of the capture took", NULL },
+        { NULL, 0, 0, 0, NULL, NULL, NULL }
+    };
+    
+    // GTK options and --startup-stats are left for main_window_init()
+    GOptionContext* context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_option_context_set_ignore_unknown_options(context, TRUE);
+    GError* error = NULL;
+    bool parsed = g_option_context_parse(context, &argc, &argv, &error);
+    g_option_context_free(context);
+    if (!parsed) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+    
+    int status = -1;
+    if (command) {
+        // Scripts send commands with --send "capture fullscreen" and the like
+        status = send_command(command, false);
+        if (status < 0) status = 1;
+    } else if (capture_mode) {
+        // Headless: no window, no history, no running instance needed
+        HeadlessCapture capture = { .out = out, .format = format, .verbose = verbose };
+        status = parse_headless(capture_mode, geometry, &capture) ? headless_capture_run(&capture) : 1;
+    } else if (out || format || geometry || verbose) {
+        fprintf(stderr, "--geometry, --out, --format and --verbose go with --capture\n");
+        status = 1;
+    } else {
+        // Launching again brings the running instance to the front instead
+        status = send_command("present", true) >= 0 ? 0 : -1;
+    }
+    g_free(command);
+    g_free(capture_mode);
+    g_free(geometry);
+    g_free(out);
+    g_free(format);
+    if (status >= 0) return status;
+    
     MainWindow win = {0};
     
-    if (!main_window_init(&win, argc, argv)) {
+    if (!main_window_init(&win, argc, argv, startup_time)) {
         fprintf(stderr, "Failed to initialize main window\n");
         return 1;
     }
@@ -13,4 +118,4 @@ int main(int argc, char* argv[]) {
     
     main_window_cleanup(&win);
     return 0;
-} 
\ No newline at end of file
+}
@@ -3,8 +3,16 @@
 #include "../include/capture_overlay.h"
 #include "../include/editor_tools.h"
 #include "../include/utils.h"
+#include "../include/annotation_sidecar.h"
+#include "../include/export_queue.h"
+#include "../include/clipboard_provider.h"
+#include "../include/surface_pool.h"
+#include "../include/history_grid.h"
+#include "../include/global_hotkey.h"
 #include <glib.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -13,6 +21,28 @@
 #include <gdk/gdkx.h>
 #include <X11/keysym.h>
 
+// Width of the black border added around captures
+#define CAPTURE_BORDER_WIDTH 3
+
+// Pause in typing after which a new screenshot path is loaded
+#define PATH_RELOAD_DELAY_MS 500
+
+// History entries on either side of the one opened that are decoded ahead
+#define HISTORY_PREFETCH_RADIUS 2
+
+// Range offered for the history thumbnail memory budget, in MiB
+#define THUMBNAIL_MEMORY_MIN_MB 16
+#define THUMBNAIL_MEMORY_MAX_MB 4096
+
+// Screenshots older than the configured age are looked for this often and
+// handed to the compactor this many at a time
+#define COMPACT_CHECK_INTERVAL_S 300
+#define COMPACT_BATCH 50
+#define COMPACT_MAX_DAYS 3650
+
+// Screenshots the compactor failed on are left alone this long, unless they change
+#define COMPACT_RETRY_INTERVAL_S (24 * 60 * 60)
+
 typedef enum {
     FILENAME_LINSHOT_NUMBER = 0,
     FILENAME_SCREENSHOT_NUMBER,
@@ -29,24 +59,65 @@ typedef enum {
     SHORTCUT_CTRL_ALT_S
 } ShortcutKey;
 
+// Keys grabbed for each ShortcutKey, in the order the settings offer them
+static const struct {
+    ShortcutKey key;
+    const char* label;
+    KeySym keysym;
+    unsigned int modifiers;
+} SHORTCUTS[] = {
+    { SHORTCUT_NONE,              "None",                 NoSymbol, 0 },
+    { SHORTCUT_PRINTSCREEN,       "Print Screen",         XK_Print, 0 },
+    { SHORTCUT_CTRL_PRINTSCREEN,  "Ctrl + Print Screen",  XK_Print, ControlMask },
+    { SHORTCUT_SHIFT_PRINTSCREEN, "Shift + Print Screen", XK_Print, ShiftMask },
+    { SHORTCUT_CTRL_SHIFT_S,      "Ctrl + Shift + S",     XK_s,     ControlMask | ShiftMask },
+    { SHORTCUT_CTRL_ALT_S,        "Ctrl + Alt + S",       XK_s,     ControlMask | Mod1Mask },
+};
+
+// One save in flight, given to the export queue as its user data
+typedef struct ExportContext {
+    MainWindow* win;
+    char* filename;
+    cairo_surface_t* surface;  // Pixels being written, for the history thumbnail; NULL when
+                               // the worker flattens annotations onto them
+    GList* requests;           // CaptureRequests answered once the file is written
+    guint baked;               // Oldest baked annotations of the file this save writes into it
+    time_t started;            // When the save was asked for, which dates the screenshot
+} ExportContext;
+
 typedef struct {
     char* screenshot_path;
     FilenameFormat filename_format;
     int auto_number;  // For auto-numbering format
     bool start_with_os;  // New: Start with OS option
     ShortcutKey shortcut_key;  // New: Shortcut key option
+    int thumbnail_memory_mb;  // Memory budget for history thumbnails
+    bool deduplicate;  // Hard link identical screenshots instead of storing copies
+    int compact_after_days;  // Recompress screenshots older than this, 0 to never
 } Settings;
 
 // Forward declarations
 static void toggle_autostart(bool enable);
-static GtkWidget* create_history_item_widget(ScreenshotEntry* entry, MainWindow* win);
-static void on_history_item_clicked(GtkWidget* widget, GdkEventButton* event, gpointer data);
+static void on_history_entry_activated(ScreenshotEntry* entry, gpointer data);
+static void step_history(MainWindow* win, MainWindowData* win_data, int delta);
 static void on_browse_clicked(GtkWidget* widget, gpointer data);
-static void create_settings_page(MainWindow* win, GtkWidget* notebook);
+static void create_settings_page(MainWindow* win, GtkWidget* page);
 static void on_settings_changed(GtkWidget* widget, gpointer data);
 static void register_shortcut_key(MainWindow* win, ShortcutKey key);
-static GdkFilterReturn key_filter_func(GdkXEvent* xevent, GdkEvent* event, gpointer data);
-static void save_image_with_annotations(MainWindow* win, cairo_surface_t* surface, GList* annotations, const char* filename);
+static void save_over_current(MainWindow* win, MainWindowData* win_data);
+static ExportContext* save_image_with_annotations(MainWindow* win, cairo_surface_t* surface, GList* annotations, const char* filename);
+static void clear_raster_undo(MainWindowData* win_data);
+static void document_changed(MainWindowData* win_data);
+static void annotations_changed(MainWindowData* win_data);
+static void store_annotations(MainWindowData* win_data);
+static void clear_baked(MainWindowData* win_data);
+static cairo_surface_t* get_composite(MainWindowData* win_data);
+static bool document_loading(MainWindowData* win_data);
+static void on_export_progress(const char* filename, double fraction, gpointer data);
+static void on_export_done(const char* filename, const GError* error, guint64 content_hash, gpointer data);
+static ExportContext* start_export(MainWindow* win, MainWindowData* win_data, cairo_surface_t* surface,
+                                   GList* annotations, const char* filename, const ExportFormat* format);
+static void export_context_free(ExportContext* export);
 
 // Preprocessing function to validate GTK objects
 static gboolean validate_gtk_object(GtkWidget* widget, const char* context) {
@@ -111,6 +182,9 @@ static void load_settings(Settings* settings) {
     settings->auto_number = 1;
     settings->start_with_os = false;
     settings->shortcut_key = SHORTCUT_PRINTSCREEN;
+    settings->thumbnail_memory_mb = SCREENSHOT_HISTORY_DEFAULT_THUMBNAIL_BUDGET / (1024 * 1024);
+    settings->deduplicate = false;
+    settings->compact_after_days = 0;
     
     // Try to load from config file
     char* config_file = get_config_file_path();
@@ -134,7 +208,24 @@ static void load_settings(Settings* settings) {
         settings->start_with_os = g_key_file_get_boolean(key_file, "Settings", "start_with_os", NULL);
         
         // Load shortcut key
-        settings->shortcut_key = g_key_file_get_integer(key_file, "Settings", "shortcut_key", NULL);
+        int shortcut = g_key_file_get_integer(key_file, "Settings", "shortcut_key", NULL);
+        settings->shortcut_key = CLAMP(shortcut, SHORTCUT_NONE, SHORTCUT_CTRL_ALT_S);
+        
+        // Load thumbnail memory budget, keeping the default if absent
+        GError* error = NULL;
+        int memory_mb = g_key_file_get_integer(key_file, "Settings", "thumbnail_memory_mb", &error);
+        if (!error) {
+            settings->thumbnail_memory_mb = CLAMP(memory_mb, THUMBNAIL_MEMORY_MIN_MB, THUMBNAIL_MEMORY_MAX_MB);
+        } else {
+            g_error_free(error);
+        }
+        
+        // Load deduplication
+        settings->deduplicate = g_key_file_get_boolean(key_file, "Settings", "deduplicate", NULL);
+        
+        // Load compaction age
+        int days = g_key_file_get_integer(key_file, "Settings", "compact_after_days", NULL);
+        settings->compact_after_days = CLAMP(days, 0, COMPACT_MAX_DAYS);
     }
     
     g_key_file_free(key_file);
@@ -151,6 +242,9 @@ static void save_settings(Settings* settings) {
     g_key_file_set_integer(key_file, "Settings", "auto_number", settings->auto_number);
     g_key_file_set_boolean(key_file, "Settings", "start_with_os", settings->start_with_os);
     g_key_file_set_integer(key_file, "Settings", "shortcut_key", settings->shortcut_key);
+    g_key_file_set_integer(key_file, "Settings", "thumbnail_memory_mb", settings->thumbnail_memory_mb);
+    g_key_file_set_boolean(key_file, "Settings", "deduplicate", settings->deduplicate);
+    g_key_file_set_integer(key_file, "Settings", "compact_after_days", settings->compact_after_days);
     
     // Save to file
     GError* error = NULL;
@@ -191,267 +285,213 @@ static void on_browse_clicked(GtkWidget* widget, gpointer data) {
     gtk_widget_destroy(dialog);
 }
 
+// Whether filename exists or a save to it is still in flight
+static bool filename_taken(MainWindowData* win_data, const char* filename) {
+    if (g_file_test(filename, G_FILE_TEST_EXISTS)) return true;
+    
+    for (GList* iter = win_data->exports; iter != NULL; iter = iter->next) {
+        ExportContext* export = iter->data;
+        if (strcmp(export->filename, filename) == 0) return true;
+    }
+    return false;
+}
+
 static char* generate_screenshot_filename(MainWindow* win) {
     Settings* settings = safe_get_data(win->window, "settings", "generate_screenshot_filename");
+    MainWindowData* win_data = safe_get_data(win->window, "window-data", "generate_screenshot_filename");
     
     char* filename = NULL;
     char timestamp[20];
     static int number = 1;  // Static counter for auto-numbering
-    
-    switch (settings->filename_format) {
-        case FILENAME_LINSHOT_NUMBER:
-            filename = g_strdup_printf("%s/LinShot_%04d.png", settings->screenshot_path, number++);
-            break;
-        case FILENAME_SCREENSHOT_NUMBER:
-            filename = g_strdup_printf("%s/Screenshot_%04d.png", settings->screenshot_path, number++);
-            break;
-        case FILENAME_LINSHOT_TIMESTAMP: {
-            time_t now = time(NULL);
-            struct tm* tm_info = localtime(&now);
-            strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", tm_info);
-            filename = g_strdup_printf("%s/LinShot_%s.png", settings->screenshot_path, timestamp);
-            break;
+    time_t now = time(NULL);
+    strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", localtime(&now));
+    
+    // Numbers start over with every run and timestamps repeat within a
+    // second, so names already on disk or still being saved are skipped
+    for (int attempt = 1; ; attempt++) {
+        char suffix[16] = "";
+        if (attempt > 1) {
+            snprintf(suffix, sizeof(suffix), "_%d", attempt);
         }
-        case FILENAME_SCREENSHOT_TIMESTAMP: {
-            time_t now = time(NULL);
-            struct tm* tm_info = localtime(&now);
-            strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", tm_info);
-            filename = g_strdup_printf("%s/Screenshot_%s.png", settings->screenshot_path, timestamp);
-            break;
+        
+        switch (settings->filename_format) {
+            case FILENAME_LINSHOT_NUMBER:
+                filename = g_strdup_printf("%s/LinShot_%04d.png", settings->screenshot_path, number++);
+                break;
+            case FILENAME_SCREENSHOT_NUMBER:
+                filename = g_strdup_printf("%s/Screenshot_%04d.png", settings->screenshot_path, number++);
+                break;
+            case FILENAME_LINSHOT_TIMESTAMP:
+                filename = g_strdup_printf("%s/LinShot_%s%s.png", settings->screenshot_path, timestamp, suffix);
+                break;
+            case FILENAME_SCREENSHOT_TIMESTAMP:
+                filename = g_strdup_printf("%s/Screenshot_%s%s.png", settings->screenshot_path, timestamp, suffix);
+                break;
         }
+        
+        if (!filename || !win_data || !filename_taken(win_data, filename)) break;
+        g_free(filename);
+        filename = NULL;
     }
     
     return filename;
 }
 
-static void rgb_data_destroy(guchar* pixels, gpointer data) {
-    (void)data;  // Unused parameter
-    g_free(pixels);
-}
-
-static void copy_to_clipboard(MainWindow* win, cairo_surface_t* surface, GList* annotations) {
+static void copy_to_clipboard(MainWindow* win, cairo_surface_t* surface) {
     if (!surface) return;
     
-    // Create a new surface to hold both the image and annotations
-    int width = cairo_image_surface_get_width(surface);
-    int height = cairo_image_surface_get_height(surface);
-    cairo_surface_t* combined_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-    
-    // Create Cairo context for the new surface
-    cairo_t* cr = cairo_create(combined_surface);
-    
-    // Draw the original image
-    cairo_set_source_surface(cr, surface, 0, 0);
-    cairo_paint(cr);
-    
-    // Draw all annotations
-    GList* iter;
-    for (iter = annotations; iter != NULL; iter = iter->next) {
-        Annotation* annotation = (Annotation*)iter->data;
-        annotation_draw(annotation, cr);
-    }
-    
-    // Ensure all drawing operations are complete
-    cairo_surface_flush(combined_surface);
-    
-    // Get surface data and stride
-    unsigned char* surface_data = cairo_image_surface_get_data(combined_surface);
-    int stride = cairo_image_surface_get_stride(combined_surface);
-    
-    // Create a new buffer for RGB data conversion
-    guchar* rgb_data = g_malloc(width * height * 4);
-    if (!rgb_data) {
-        cairo_destroy(cr);
-        cairo_surface_destroy(combined_surface);
+    // The image is only encoded once something pastes it
+    if (!clipboard_provider_set(surface)) {
+        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Failed to take clipboard ownership");
         return;
     }
     
-    // Convert ARGB to RGBA (Cairo uses ARGB32, GdkPixbuf uses RGBA)
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int src_idx = y * stride + x * 4;
-            int dst_idx = (y * width + x) * 4;
-            
-            // Cairo (ARGB) -> GdkPixbuf (RGBA)
-            guchar alpha = surface_data[src_idx + 3];
-            guchar red = surface_data[src_idx + 2];
-            guchar green = surface_data[src_idx + 1];
-            guchar blue = surface_data[src_idx + 0];
-            
-            rgb_data[dst_idx + 0] = red;
-            rgb_data[dst_idx + 1] = green;
-            rgb_data[dst_idx + 2] = blue;
-            rgb_data[dst_idx + 3] = alpha;
-        }
-    }
-    
-    // Create pixbuf from converted data
-    GdkPixbuf* pixbuf = gdk_pixbuf_new_from_data(
-        rgb_data,
-        GDK_COLORSPACE_RGB,
-        TRUE,  // has alpha
-        8,     // bits per sample
-        width,
-        height,
-        width * 4,  // rowstride for packed RGB data
-        rgb_data_destroy,  // Use our type-safe destroy function
-        NULL
-    );
-    
-    // Get the clipboard and set the image
-    GtkClipboard* clipboard = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
-    
-    // Create a copy of the pixbuf that will persist after we free our local resources
-    GdkPixbuf* clipboard_pixbuf = gdk_pixbuf_copy(pixbuf);
-    gtk_clipboard_set_image(clipboard, clipboard_pixbuf);
-    g_object_unref(clipboard_pixbuf);
-    
-    // Clean up
-    g_object_unref(pixbuf);
-    cairo_destroy(cr);
-    cairo_surface_destroy(combined_surface);
-    
     gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Image with annotations copied to clipboard");
 }
 
-static cairo_surface_t* add_border_to_surface(cairo_surface_t* surface, double border_width, double r, double g, double b) {
-    if (!surface) return NULL;
-    
+// Stroke a border into the margin of a surface captured with
+// capture_screen_with_margin(), covering every margin pixel
+static void draw_border_in_margin(cairo_surface_t* surface, int border_width, double r, double g, double b) {
     int width = cairo_image_surface_get_width(surface);
     int height = cairo_image_surface_get_height(surface);
     
-    // Create a new surface with space for the border
-    cairo_surface_t* bordered_surface = cairo_image_surface_create(
-        CAIRO_FORMAT_ARGB32,
-        width + 2 * border_width,
-        height + 2 * border_width
-    );
-    
-    cairo_t* cr = cairo_create(bordered_surface);
-    
-    // Clear the surface
-    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
-    cairo_paint(cr);
-    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-    
-    // Draw the original image in the center
-    cairo_set_source_surface(cr, surface, border_width, border_width);
-    cairo_paint(cr);
-    
-    // Draw the border
+    cairo_t* cr = cairo_create(surface);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
     cairo_set_source_rgb(cr, r, g, b);
     cairo_set_line_width(cr, border_width);
-    cairo_rectangle(cr, 
-                   border_width/2, border_width/2, 
-                   width + border_width, height + border_width);
+    cairo_rectangle(cr,
+                   border_width / 2.0, border_width / 2.0,
+                   width - border_width, height - border_width);
     cairo_stroke(cr);
-    
     cairo_destroy(cr);
-    return bordered_surface;
 }
 
-static void on_capture_button_clicked(GtkWidget* widget, gpointer data) {
-    (void)widget;
-    MainWindow* win = (MainWindow*)data;
-    MainWindowData* win_data = safe_get_data(win->window, "window-data", "on_capture_button_clicked");
-    gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Capturing screen...");
-    
-    // Show capture overlay
-    CaptureOverlay overlay = {0};
-    if (!capture_overlay_init(&overlay)) {
-        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Failed to initialize capture overlay");
-        return;
-    }
-    
-    // Run the overlay until user makes a selection
-    gtk_main();
-    
-    // Get the selected area
-    CaptureArea area = capture_overlay_get_selection(&overlay);
-    capture_overlay_cleanup(&overlay);
-    
-    if (area.width == 0 || area.height == 0) {
-        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Capture cancelled");
-        return;
-    }
-    
-    // Initialize screen capture
+// Grab the screen (or area) with a border and make it the current image:
+// saved in the background, copied to the clipboard and shown. Returns the
+// save, or NULL with the reason in the status bar.
+static ExportContext* finish_capture(MainWindow* win, MainWindowData* win_data, CaptureMode mode, CaptureArea* area) {
+    // The display connection is kept open between captures
     if (!capture_init()) {
         gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Failed to initialize screen capture");
-        return;
+        return NULL;
     }
     
-    // Capture selected area
-    cairo_surface_t* surface = capture_screen(CAPTURE_AREA, &area);
-    if (!surface) {
+    // Capture straight into a pooled surface that leaves room for the border
+    cairo_surface_t* bordered_surface = capture_screen_with_margin(mode, area, CAPTURE_BORDER_WIDTH);
+    if (!bordered_surface) {
         gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Failed to capture screen");
-        capture_cleanup();
-        return;
+        return NULL;
     }
     
-    // Clean up screen capture
-    capture_cleanup();
-    
-    // Add border to the captured image
-    cairo_surface_t* bordered_surface = add_border_to_surface(surface, 3.0, 0.0, 0.0, 0.0);
-    cairo_surface_destroy(surface);  // Free the original surface
-    
-    if (!bordered_surface) {
-        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Failed to add border to image");
-        return;
-    }
+    draw_border_in_margin(bordered_surface, CAPTURE_BORDER_WIDTH, 0.0, 0.0, 0.0);
     
     // Generate filename and save immediately
     char* filename = generate_screenshot_filename(win);
     
-    // Save the raw screenshot without annotations
-    cairo_status_t status = cairo_surface_write_to_png(bordered_surface, filename);
-    if (status != CAIRO_STATUS_SUCCESS) {
+    // Save the raw screenshot without annotations in the background; the
+    // history picks it up once the file has been written
+    const ExportFormat* format = export_format_for_filename(filename, NULL);
+    ExportContext* export = start_export(win, win_data, bordered_surface, NULL, filename, format);
+    if (!export) {
         gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Failed to save screenshot");
         g_free(filename);
         cairo_surface_destroy(bordered_surface);
-        return;
-    }
-    
-    // Add to history
-    screenshot_history_add(&win->screenshot_history, filename);
-    
-    // Update history view
-    GList* entries = screenshot_history_get_sorted(&win->screenshot_history);
-    
-    // Clear existing history items
-    GList* children = gtk_container_get_children(GTK_CONTAINER(win->history_flow_box));
-    for (GList* iter = children; iter != NULL; iter = iter->next) {
-        gtk_widget_destroy(GTK_WIDGET(iter->data));
-    }
-    g_list_free(children);
-    
-    // Add updated history items
-    for (GList* iter = entries; iter != NULL; iter = iter->next) {
-        ScreenshotEntry* entry = (ScreenshotEntry*)iter->data;
-        GtkWidget* item_widget = create_history_item_widget(entry, win);
-        gtk_flow_box_insert(GTK_FLOW_BOX(win->history_flow_box), item_widget, -1);
+        return NULL;
     }
-    gtk_widget_show_all(win->history_flow_box);
     
     // Update window data
     if (win_data->current_image) {
         cairo_surface_destroy(win_data->current_image);
     }
     win_data->current_image = bordered_surface;
+    clear_raster_undo(win_data);
+    
+    // The file becomes the document's once it has been written; until then
+    // there is nowhere to keep annotations
+    g_free(win_data->current_path);
+    win_data->current_path = NULL;
+    win_data->capture_export = export;
+    
+    // A history image still loading must not replace the capture
+    g_free(win_data->loading_path);
+    win_data->loading_path = NULL;
     
     // Clear existing annotations
     g_list_free_full(win_data->annotations, (GDestroyNotify)annotation_free);
     win_data->annotations = NULL;
+    clear_baked(win_data);
+    document_changed(win_data);
     
     // Copy to clipboard
-    copy_to_clipboard(win, bordered_surface, NULL);
+    copy_to_clipboard(win, get_composite(win_data));
     
     // Redraw canvas
     gtk_widget_queue_draw(win->canvas);
     
+    gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Screenshot copied to clipboard, saving...");
     g_free(filename);
-    gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Screenshot saved and copied to clipboard");
+    return export;
+}
+
+// Report how long the shortcut took to bring up the overlay, from the key
+// press to the overlay's first frame
+static gboolean on_overlay_first_draw(GtkWidget* widget, cairo_t* cr, gpointer data) {
+    (void)cr;
+    MainWindow* win = (MainWindow*)data;
+    MainWindowData* win_data = safe_get_data(win->window, "window-data", "on_overlay_first_draw");
+    g_signal_handlers_disconnect_by_func(widget, G_CALLBACK(on_overlay_first_draw), data);
+    if (!win_data || !win_data->shortcut_time) return FALSE;
+    
+    double latency = (g_get_monotonic_time() - win_data->shortcut_time) / 1000.0;
+    g_debug("Capture overlay shown %.1f ms after the shortcut", latency);
+    if (win_data->startup_stats) {
+        fprintf(stderr, "shortcut: overlay shown %.1f ms after the key press\n", latency);
+    }
+    win_data->shortcut_time = 0;
+    return FALSE;
+}
+
+static void on_capture_button_clicked(GtkWidget* widget, gpointer data) {
+    (void)widget;
+    MainWindow* win = (MainWindow*)data;
+    MainWindowData* win_data = safe_get_data(win->window, "window-data", "on_capture_button_clicked");
+    gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Capturing screen...");
+    
+    // Show capture overlay
+    CaptureOverlay overlay = {0};
+    if (!capture_overlay_init(&overlay)) {
+        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Failed to initialize capture overlay");
+        win_data->shortcut_time = 0;
+        return;
+    }
+    
+    // Measured once the overlay has painted its first frame
+    if (win_data->shortcut_time) {
+        g_signal_connect_after(overlay.drawing_area, "draw", G_CALLBACK(on_overlay_first_draw), win);
+    }
+    
+    // Run the overlay until user makes a selection
+    gtk_main();
+    win_data->shortcut_time = 0;
+    
+    // Get the selected area
+    CaptureArea area = capture_overlay_get_selection(&overlay);
+    capture_overlay_cleanup(&overlay);
+    
+    if (area.width == 0 || area.height == 0) {
+        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Capture cancelled");
+        return;
+    }
+    
+    finish_capture(win, win_data, CAPTURE_AREA, &area);
+}
+
+// The global shortcut was pressed at pressed_at
+static void on_shortcut_pressed(gint64 pressed_at, gpointer data) {
+    MainWindow* win = (MainWindow*)data;
+    MainWindowData* win_data = safe_get_data(win->window, "window-data", "on_shortcut_pressed");
+    win_data->shortcut_time = pressed_at;
+    on_capture_button_clicked(NULL, win);
 }
 
 static void on_copy_button_clicked(GtkWidget* widget, gpointer data) {
@@ -463,8 +503,12 @@ static void on_copy_button_clicked(GtkWidget* widget, gpointer data) {
         gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "No image to copy");
         return;
     }
+    if (document_loading(win_data)) {
+        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "The image is still loading");
+        return;
+    }
     
-    copy_to_clipboard(win, win_data->current_image, win_data->annotations);
+    copy_to_clipboard(win, get_composite(win_data));
 }
 
 static void on_tool_button_clicked(GtkWidget* widget, gpointer data) {
@@ -538,38 +582,22 @@ static gboolean on_draw(GtkWidget* widget, cairo_t* cr, gpointer data) {
             gtk_widget_set_size_request(win->canvas, width, height);
         }
         
-        // Create a new surface for the image
-        cairo_surface_t* image_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-        cairo_t* image_cr = cairo_create(image_surface);
-        
-        // Draw the image
-        cairo_set_source_surface(image_cr, win_data->current_image, 0, 0);
-        cairo_paint(image_cr);
-        
-        // Draw annotations on the image surface
-        GList* iter;
-        for (iter = win_data->annotations; iter != NULL; iter = iter->next) {
-            Annotation* annotation = (Annotation*)iter->data;
-            annotation_draw(annotation, image_cr);
+        // Paint the shared composite, re-rendered only when the document changed
+        cairo_surface_t* composite = get_composite(win_data);
+        if (composite) {
+            cairo_set_source_surface(cr, composite, 0, 0);
+            cairo_paint(cr);
         }
         
-        // Draw current annotation if drawing
+        // The annotation being drawn goes straight onto the widget
         if (win_data->drawing) {
             Annotation* current = annotation_create(win_data->current_tool.type, &win_data->current_tool);
             if (current) {
                 current->bounds = win_data->start_point;
-                annotation_draw(current, image_cr);
+                annotation_draw(current, cr);
                 annotation_free(current);
             }
         }
-        
-        // Draw the combined image and annotations to the widget
-        cairo_set_source_surface(cr, image_surface, 0, 0);
-        cairo_paint(cr);
-        
-        // Clean up
-        cairo_destroy(image_cr);
-        cairo_surface_destroy(image_surface);
     }
     
     cairo_restore(cr);
@@ -611,6 +639,7 @@ static void show_text_dialog(MainWindow* win, MainWindowData* win_data, double x
                 annotation->bounds.x1 = x;
                 annotation->bounds.y1 = y;
                 win_data->annotations = g_list_append(win_data->annotations, annotation);
+                annotations_changed(win_data);
                 gtk_widget_queue_draw(win->canvas);
             }
         }
@@ -640,6 +669,11 @@ static gboolean on_button_press(GtkWidget* widget, GdkEventButton* event, gpoint
     MainWindow* win = (MainWindow*)data;
     MainWindowData* win_data = safe_get_data(win->window, "window-data", "on_button_press");
     
+    // The placeholder of a history image still loading is not edited
+    if (document_loading(win_data)) {
+        return TRUE;
+    }
+    
     if (event->button == 1) {  // Left mouse button
         // First, check if we're clicking on an existing text annotation
         Annotation* text_annotation = find_text_at_coords(win_data, event->x, event->y);
@@ -686,6 +720,7 @@ static gboolean on_motion_notify(GtkWidget* widget, GdkEventMotion* event, gpoin
         win_data->selected_text->bounds.y1 = new_y;
         win_data->selected_text->bounds.x2 = new_x + width;
         win_data->selected_text->bounds.y2 = new_y + height;
+        document_changed(win_data);
         
         gtk_widget_queue_draw(win->canvas);
     } else if (win_data->drawing) {
@@ -706,6 +741,7 @@ static gboolean on_button_release(GtkWidget* widget, GdkEventButton* event, gpoi
         if (win_data->selected_text) {
             // Finish moving text
             win_data->selected_text = NULL;
+            annotations_changed(win_data);
             gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Text moved");
         } else if (win_data->drawing) {
             win_data->drawing = false;
@@ -715,6 +751,7 @@ static gboolean on_button_release(GtkWidget* widget, GdkEventButton* event, gpoi
             if (annotation) {
                 annotation->bounds = win_data->start_point;
                 win_data->annotations = g_list_append(win_data->annotations, annotation);
+                annotations_changed(win_data);
             }
             
             gtk_widget_queue_draw(win->canvas);
@@ -724,7 +761,138 @@ static gboolean on_button_release(GtkWidget* widget, GdkEventButton* event, gpoi
     return TRUE;
 }
 
+// Mark the document as modified so the composite is rendered again
+static void document_changed(MainWindowData* win_data) {
+    win_data->generation++;
+    if (win_data->composite) {
+        cairo_surface_destroy(win_data->composite);
+        win_data->composite = NULL;
+    }
+}
+
+// Return the current image with its annotations flattened, rendering it only
+// if the document changed since the last call. The surface is owned by
+// win_data; take a reference to keep it past the next change.
+static cairo_surface_t* get_composite(MainWindowData* win_data) {
+    if (!win_data->current_image) return NULL;
+    
+    if (win_data->composite && win_data->composite_generation == win_data->generation) {
+        return win_data->composite;
+    }
+    
+    if (win_data->composite) {
+        cairo_surface_destroy(win_data->composite);
+    }
+    if (win_data->annotations) {
+        win_data->composite = annotations_flatten(win_data->current_image, win_data->annotations);
+    } else {
+        win_data->composite = cairo_surface_reference(win_data->current_image);
+    }
+    win_data->composite_generation = win_data->generation;
+    return win_data->composite;
+}
+
+// Keep the annotations of the current image in its sidecar so they survive
+// reopening it from history without ever touching the image file itself
+static void store_annotations(MainWindowData* win_data) {
+    if (!win_data->current_path) return;
+    
+    // Annotations flattened by a save still count until the file holds them
+    GList* annotations = win_data->annotations;
+    if (win_data->baked) {
+        annotations = g_list_concat(g_list_copy(win_data->baked), g_list_copy(win_data->annotations));
+    }
+    
+    GError* error = NULL;
+    if (!annotation_sidecar_save(win_data->current_path, annotations, &error)) {
+        g_warning("Failed to save annotations: %s", error ? error->message : "unknown error");
+        g_clear_error(&error);
+    }
+    if (win_data->baked) {
+        g_list_free(annotations);
+    }
+}
+
+static void clear_baked(MainWindowData* win_data) {
+    g_list_free_full(win_data->baked, (GDestroyNotify)annotation_free);
+    win_data->baked = NULL;
+}
+
+// Drop the count oldest of a list of annotations
+static GList* drop_annotations(GList* annotations, guint count) {
+    for (; count > 0 && annotations; count--) {
+        annotation_free(annotations->data);
+        annotations = g_list_delete_link(annotations, annotations);
+    }
+    return annotations;
+}
+
+// A save flattened the baked oldest annotations of filename into it: take
+// them out of its sidecar so reopening does not draw them twice
+static void forget_baked(MainWindowData* win_data, const char* filename, guint baked) {
+    if (g_strcmp0(filename, win_data->current_path) == 0) {
+        win_data->baked = drop_annotations(win_data->baked, baked);
+        store_annotations(win_data);
+        return;
+    }
+    
+    // The document moved on while the file was written
+    GList* annotations = drop_annotations(annotation_sidecar_load(filename), baked);
+    GError* error = NULL;
+    if (!annotation_sidecar_save(filename, annotations, &error)) {
+        g_warning("Failed to save annotations: %s", error ? error->message : "unknown error");
+        g_clear_error(&error);
+    }
+    g_list_free_full(annotations, (GDestroyNotify)annotation_free);
+}
+
+static void annotations_changed(MainWindowData* win_data) {
+    document_changed(win_data);
+    store_annotations(win_data);
+}
+
+// Give the document sole ownership of current_image before its pixels are
+// written in place, copying it while the loader cache, an export or the
+// clipboard still holds a reference
+static void own_current_image(MainWindowData* win_data) {
+    cairo_surface_t* image = win_data->current_image;
+    if (cairo_surface_get_reference_count(image) <= 1) return;
+    
+    cairo_surface_t* copy = surface_pool_acquire(cairo_image_surface_get_width(image),
+                                                 cairo_image_surface_get_height(image));
+    cairo_t* cr = cairo_create(copy);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cr, image, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    
+    cairo_surface_destroy(image);
+    win_data->current_image = copy;
+}
+
+static void clear_raster_undo(MainWindowData* win_data) {
+    g_list_free_full(win_data->raster_undo_stack, (GDestroyNotify)raster_edit_free);
+    win_data->raster_undo_stack = NULL;
+}
+
 static void undo_last_annotation(MainWindowData* win_data) {
+    // A raster edit made after the last annotation is undone first
+    GList* last_edit = g_list_last(win_data->raster_undo_stack);
+    if (last_edit) {
+        RasterEdit* edit = last_edit->data;
+        if (edit->annotation_count >= g_list_length(win_data->annotations)) {
+            // Without annotations the composite is current_image itself, so
+            // drop it before checking who else holds the pixels
+            document_changed(win_data);
+            own_current_image(win_data);
+            raster_edit_undo(edit, win_data->current_image);
+            raster_edit_free(edit);
+            win_data->raster_undo_stack = g_list_delete_link(win_data->raster_undo_stack, last_edit);
+            gtk_widget_queue_draw(win_data->win.canvas);
+            return;
+        }
+    }
+    
     if (!win_data->annotations) {
         return;  // Nothing to undo
     }
@@ -738,6 +906,7 @@ static void undo_last_annotation(MainWindowData* win_data) {
     
     // Add it to the undo stack
     win_data->undo_stack = g_list_append(win_data->undo_stack, annotation);
+    annotations_changed(win_data);
     
     // Redraw canvas
     gtk_widget_queue_draw(win_data->win.canvas);
@@ -754,6 +923,20 @@ static gboolean on_key_press(GtkWidget* widget, GdkEventKey* event, gpointer dat
         return TRUE;  // Event handled
     }
     
+    // Page Up/Down flip to the newer/older screenshot in the history while
+    // the screenshot tab is showing
+    if ((event->keyval == GDK_KEY_Page_Up || event->keyval == GDK_KEY_Page_Down) &&
+        gtk_widget_get_mapped(win->canvas)) {
+        step_history(win, win_data, event->keyval == GDK_KEY_Page_Up ? -1 : 1);
+        return TRUE;
+    }
+    
+    // Escape cancels saves still running in the background
+    if (event->keyval == GDK_KEY_Escape && export_queue_get_pending() > 0) {
+        export_queue_cancel_all();
+        return TRUE;
+    }
+    
     return FALSE;  // Event not handled
 }
 
@@ -766,6 +949,10 @@ static void on_save_button_clicked(GtkWidget* widget, gpointer data) {
         gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "No image to save");
         return;
     }
+    if (document_loading(win_data)) {
+        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "The image is still loading");
+        return;
+    }
     
     // Generate default filename using the dedicated function
     char* default_filename = generate_screenshot_filename(win);
@@ -869,155 +1056,227 @@ static void on_save_button_clicked(GtkWidget* widget, gpointer data) {
     
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         char* filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-        save_image_with_annotations(win, win_data->current_image, win_data->annotations, filename);
+        if (g_strcmp0(filename, win_data->current_path) == 0) {
+            save_over_current(win, win_data);
+        } else {
+            save_image_with_annotations(win, get_composite(win_data), NULL, filename);
+        }
         g_free(filename);
     }
     
     gtk_widget_destroy(dialog);
 }
 
-static void save_image_with_annotations(MainWindow* win, cairo_surface_t* surface, GList* annotations, const char* filename) {
-    if (!surface || !filename) return;
-    
-    // Create a new surface with annotations
-    int width = cairo_image_surface_get_width(surface);
-    int height = cairo_image_surface_get_height(surface);
-    cairo_surface_t* combined_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-    
-    // Create Cairo context for the new surface
-    cairo_t* cr = cairo_create(combined_surface);
+// Write the open image over its own file with annotations and raster edits
+// flattened in, so other programs see what the user sees. Editing goes on
+// from the flattened pixels; the annotations stay in the sidecar, as
+// baked, until the file holds them.
+static void save_over_current(MainWindow* win, MainWindowData* win_data) {
+    cairo_surface_t* composite = get_composite(win_data);
+    ExportContext* export = save_image_with_annotations(win, composite, NULL, win_data->current_path);
+    if (!export) return;
+    
+    win_data->baked = g_list_concat(win_data->baked, win_data->annotations);
+    win_data->annotations = NULL;
+    export->baked = g_list_length(win_data->baked);
     
-    // Draw the original image
-    cairo_set_source_surface(cr, surface, 0, 0);
-    cairo_paint(cr);
+    cairo_surface_reference(composite);
+    cairo_surface_destroy(win_data->current_image);
+    win_data->current_image = composite;
+    clear_raster_undo(win_data);
+    document_changed(win_data);
+    gtk_widget_queue_draw(win->canvas);
+}
+
+static ExportContext* save_image_with_annotations(MainWindow* win, cairo_surface_t* surface, GList* annotations, const char* filename) {
+    if (!surface || !filename) return NULL;
     
-    // Draw all annotations
-    GList* iter;
-    for (iter = annotations; iter != NULL; iter = iter->next) {
-        Annotation* annotation = (Annotation*)iter->data;
-        annotation_draw(annotation, cr);
+    // Reject unsupported formats right away instead of after a background render
+    GError* error = NULL;
+    const ExportFormat* format = export_format_for_filename(filename, &error);
+    if (!format) {
+        char error_msg[256];
+        snprintf(error_msg, sizeof(error_msg), "Failed to save image: %s", error->message);
+        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, error_msg);
+        g_error_free(error);
+        return NULL;
     }
     
-    // Ensure all drawing operations are complete
-    cairo_surface_flush(combined_surface);
-    
-    // Get the file extension
-    const char* ext = strrchr(filename, '.');
-    if (!ext) {
-        cairo_destroy(cr);
-        cairo_surface_destroy(combined_surface);
-        return;
+    // Flattening and encoding run on the export worker
+    MainWindowData* win_data = safe_get_data(win->window, "window-data", "save_image_with_annotations");
+    ExportContext* export = win_data ? start_export(win, win_data, surface, annotations, filename, format) : NULL;
+    if (!export) {
+        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Failed to save image");
+    }
+    return export;
+}
+
+// Queue writing surface, with annotations flattened onto it, to filename.
+// Returns the save, kept in win_data until it is done, or NULL if it could
+// not be queued.
+static ExportContext* start_export(MainWindow* win, MainWindowData* win_data, cairo_surface_t* surface,
+                                   GList* annotations, const char* filename, const ExportFormat* format) {
+    ExportContext* export = g_new0(ExportContext, 1);
+    export->win = win;
+    export->filename = g_strdup(filename);
+    export->started = time(NULL);
+    if (!export_queue_submit(surface, annotations, filename, format,
+                             on_export_progress, on_export_done, export)) {
+        export_context_free(export);
+        return NULL;
     }
-    ext++; // Skip the dot
     
-    // Create a pixbuf from the surface
-    GdkPixbuf* pixbuf = gdk_pixbuf_get_from_surface(combined_surface, 0, 0, width, height);
-    if (!pixbuf) {
-        cairo_destroy(cr);
-        cairo_surface_destroy(combined_surface);
-        return;
+    // An already flattened surface holds exactly the saved pixels, so the
+    // history thumbnail can be built from memory once the save completes
+    if (!annotations) {
+        export->surface = cairo_surface_reference(surface);
+    }
+    win_data->exports = g_list_prepend(win_data->exports, export);
+    return export;
+}
+
+// Free a save; its requests must have been answered
+static void export_context_free(ExportContext* export) {
+    if (export->surface) cairo_surface_destroy(export->surface);
+    g_list_free(export->requests);
+    g_free(export->filename);
+    g_free(export);
+}
+
+static void on_export_progress(const char* filename, double fraction, gpointer data) {
+    MainWindow* win = ((ExportContext*)data)->win;
+    
+    char* basename = g_path_get_basename(filename);
+    char status[256];
+    snprintf(status, sizeof(status), "Saving %s (%d%%, Esc to cancel)", basename, (int)(fraction * 100));
+    gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, status);
+    g_free(basename);
+}
+
+// Export lookup, on the export worker: a listed screenshot that may hold
+// the bytes being saved
+static char* find_identical_screenshot(guint64 content_hash, gpointer data) {
+    MainWindow* win = data;
+    return screenshot_history_find_content(&win->screenshot_history, content_hash);
+}
+
+static void on_export_done(const char* filename, const GError* error, guint64 content_hash, gpointer data) {
+    ExportContext* export = data;
+    MainWindow* win = export->win;
+    MainWindowData* win_data = safe_get_data(win->window, "window-data", "on_export_done");
+    char status[256];
+    if (win_data) {
+        win_data->exports = g_list_remove(win_data->exports, export);
+        
+        // A written capture becomes the document's file, and annotations
+        // drawn meanwhile get their sidecar
+        if (win_data->capture_export == export) {
+            win_data->capture_export = NULL;
+            if (!error) {
+                win_data->current_path = g_strdup(filename);
+                store_annotations(win_data);
+            }
+        }
+        if (!error && export->baked) {
+            forget_baked(win_data, filename, export->baked);
+        }
     }
     
-    // Save based on file extension
-    GError* error = NULL;
-    if (g_ascii_strcasecmp(ext, "jpg") == 0 || g_ascii_strcasecmp(ext, "jpeg") == 0) {
-        gdk_pixbuf_save(pixbuf, filename, "jpeg", &error, "quality", "100", NULL);
-    } else if (g_ascii_strcasecmp(ext, "png") == 0) {
-        gdk_pixbuf_save(pixbuf, filename, "png", &error, "compression", "9", NULL);
-    } else if (g_ascii_strcasecmp(ext, "gif") == 0) {
-        gdk_pixbuf_save(pixbuf, filename, "gif", &error, NULL);
-    } else if (g_ascii_strcasecmp(ext, "svg") == 0) {
-        // Note: SVG requires special handling as it's a vector format
-        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "SVG format not supported for screenshots");
-        error = g_error_new(G_FILE_ERROR, G_FILE_ERROR_FAILED, "SVG format not supported for screenshots");
-    } else if (g_ascii_strcasecmp(ext, "tiff") == 0 || g_ascii_strcasecmp(ext, "tif") == 0) {
-        gdk_pixbuf_save(pixbuf, filename, "tiff", &error, NULL);
-    } else if (g_ascii_strcasecmp(ext, "webp") == 0) {
-        gdk_pixbuf_save(pixbuf, filename, "webp", &error, "quality", "100", NULL);
-    } else if (g_ascii_strcasecmp(ext, "bmp") == 0) {
-        gdk_pixbuf_save(pixbuf, filename, "bmp", &error, NULL);
-    } else if (g_ascii_strcasecmp(ext, "heic") == 0 || g_ascii_strcasecmp(ext, "heif") == 0) {
-        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "HEIC/HEIF format not supported");
-        error = g_error_new(G_FILE_ERROR, G_FILE_ERROR_FAILED, "HEIC/HEIF format not supported");
-    } else if (g_ascii_strcasecmp(ext, "raw") == 0) {
-        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "RAW format not supported");
-        error = g_error_new(G_FILE_ERROR, G_FILE_ERROR_FAILED, "RAW format not supported");
-    } else if (g_ascii_strcasecmp(ext, "ico") == 0) {
-        gdk_pixbuf_save(pixbuf, filename, "ico", &error, NULL);
-    } else if (g_ascii_strcasecmp(ext, "psd") == 0) {
-        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "PSD format not supported");
-        error = g_error_new(G_FILE_ERROR, G_FILE_ERROR_FAILED, "PSD format not supported");
-    } else if (g_ascii_strcasecmp(ext, "eps") == 0) {
-        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "EPS format not supported");
-        error = g_error_new(G_FILE_ERROR, G_FILE_ERROR_FAILED, "EPS format not supported");
-    } else if (g_ascii_strcasecmp(ext, "ai") == 0) {
-        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "AI format not supported");
-        error = g_error_new(G_FILE_ERROR, G_FILE_ERROR_FAILED, "AI format not supported");
-    } else if (g_ascii_strcasecmp(ext, "avif") == 0) {
-        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "AVIF format not supported");
-        error = g_error_new(G_FILE_ERROR, G_FILE_ERROR_FAILED, "AVIF format not supported");
-    } else if (g_ascii_strcasecmp(ext, "cr2") == 0 || g_ascii_strcasecmp(ext, "cr3") == 0) {
-        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "CR2/CR3 format not supported");
-        error = g_error_new(G_FILE_ERROR, G_FILE_ERROR_FAILED, "CR2/CR3 format not supported");
+    // Answer the scripts that asked for this capture
+    for (GList* iter = export->requests; iter != NULL; iter = iter->next) {
+        capture_server_reply(iter->data, !error, error ? error->message : filename);
     }
     
     if (error) {
-        char error_msg[256];
-        snprintf(error_msg, sizeof(error_msg), "Failed to save image: %s", error->message);
-        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, error_msg);
-        g_error_free(error);
-    } else {
-        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Image saved successfully");
-        
-        // Add to history
-        screenshot_history_add(&win->screenshot_history, filename);
-        
-        // Clear existing history items
-        GList* children = gtk_container_get_children(GTK_CONTAINER(win->history_flow_box));
-        for (GList* iter = children; iter != NULL; iter = iter->next) {
-            gtk_widget_destroy(GTK_WIDGET(iter->data));
-        }
-        g_list_free(children);
-        
-        // Add updated history items
-        GList* entries = screenshot_history_get_sorted(&win->screenshot_history);
-        for (GList* iter = entries; iter != NULL; iter = iter->next) {
-            ScreenshotEntry* entry = (ScreenshotEntry*)iter->data;
-            GtkWidget* item_widget = create_history_item_widget(entry, win);
-            gtk_flow_box_insert(GTK_FLOW_BOX(win->history_flow_box), item_widget, -1);
+        export_context_free(export);
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            snprintf(status, sizeof(status), "Save cancelled");
+        } else {
+            snprintf(status, sizeof(status), "Failed to save image: %s", error->message);
         }
-        
-        gtk_widget_show_all(win->history_flow_box);
+        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, status);
+        return;
     }
     
-    // Clean up
-    g_object_unref(pixbuf);
-    cairo_destroy(cr);
-    cairo_surface_destroy(combined_surface);
+    char* basename = g_path_get_basename(filename);
+    snprintf(status, sizeof(status), "Saved %s", basename);
+    gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, status);
+    g_free(basename);
+    
+    // Add to history; the view picks up the new item through its observer
+    screenshot_history_add_with_surface(&win->screenshot_history, filename, export->surface, content_hash,
+                                        export->started);
+    export_context_free(export);
 }
 
-static void on_history_item_clicked(GtkWidget* widget, GdkEventButton* event, gpointer data) {
-    (void)event;  // Unused parameter
+// Commands from the capture socket. Captures skip the overlay and are
+// answered with the file name once it has been written.
+static void on_remote_command(CaptureRequest* request, const char* command, gpointer data) {
     MainWindow* win = (MainWindow*)data;
-    MainWindowData* win_data = safe_get_data(win->window, "window-data", "on_history_item_clicked");
-    const char* filepath = safe_get_data(widget, "filepath", "on_history_item_clicked");
-    
-    // Load the image
-    cairo_surface_t* surface = cairo_image_surface_create_from_png(filepath);
-    if (!surface) {
-        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Failed to load image");
+    MainWindowData* win_data = safe_get_data(win->window, "window-data", "on_remote_command");
+    if (!win_data) {
+        capture_server_reply(request, false, "Not ready");
         return;
     }
     
+    char** words = g_strsplit_set(command, " \t", -1);
+    guint count = g_strv_length(words);
+    
+    if (count == 2 && strcmp(words[0], "capture") == 0 && strcmp(words[1], "fullscreen") == 0) {
+        ExportContext* export = finish_capture(win, win_data, CAPTURE_FULLSCREEN, NULL);
+        if (export) {
+            export->requests = g_list_append(export->requests, request);
+        } else {
+            capture_server_reply(request, false, "Capture failed");
+        }
+    } else if (count >= 2 && strcmp(words[0], "capture") == 0 && strcmp(words[1], "area") == 0) {
+        CaptureArea area;
+        ExportContext* export = NULL;
+        if (count != 3 || !capture_parse_area(words[2], &area)) {
+            capture_server_reply(request, false, "Usage: capture area x,y,width,height");
+        } else if ((export = finish_capture(win, win_data, CAPTURE_AREA, &area)) != NULL) {
+            export->requests = g_list_append(export->requests, request);
+        } else {
+            capture_server_reply(request, false, "Capture failed");
+        }
+    } else if (count == 1 && strcmp(words[0], "copy-last") == 0) {
+        if (document_loading(win_data)) {
+            capture_server_reply(request, false, "The image is still loading");
+        } else if (win_data->current_image) {
+            copy_to_clipboard(win, get_composite(win_data));
+            capture_server_reply(request, true, win_data->current_path ? win_data->current_path : "");
+        } else {
+            capture_server_reply(request, false, "No image to copy");
+        }
+    } else if (count == 1 && strcmp(words[0], "present") == 0) {
+        gtk_window_present(GTK_WINDOW(win->window));
+        capture_server_reply(request, true, "");
+    } else {
+        capture_server_reply(request, false,
+                             "Unknown command; try capture fullscreen, capture area x,y,width,height, "
+                             "copy-last or present");
+    }
+    g_strfreev(words);
+}
+
+// Make image (taken over) the document, with the annotations of filepath
+static void show_history_image(MainWindow* win, MainWindowData* win_data, const char* filepath,
+                               cairo_surface_t* image) {
     // Clean up existing image and annotations
     if (win_data->current_image) {
         cairo_surface_destroy(win_data->current_image);
     }
     g_list_free_full(win_data->annotations, (GDestroyNotify)annotation_free);
     
-    // Set the new image
-    win_data->current_image = surface;
-    win_data->annotations = NULL;
+    // Set the new image and bring back its annotations from the sidecar
+    win_data->current_image = image;
+    win_data->annotations = annotation_sidecar_load(filepath);
+    clear_baked(win_data);
+    g_free(win_data->current_path);
+    win_data->current_path = g_strdup(filepath);
+    win_data->capture_export = NULL;
+    clear_raster_undo(win_data);
+    document_changed(win_data);
     
     // Switch to screenshot tab (it's the first tab)
     GtkWidget* notebook = gtk_widget_get_ancestor(win->canvas, GTK_TYPE_NOTEBOOK);
@@ -1027,28 +1286,206 @@ static void on_history_item_clicked(GtkWidget* widget, GdkEventButton* event, gp
     
     // Redraw canvas
     gtk_widget_queue_draw(win->canvas);
+}
+
+// Leave no image open, e.g. when the one being loaded turns out unreadable
+static void close_document(MainWindow* win, MainWindowData* win_data) {
+    if (win_data->current_image) {
+        cairo_surface_destroy(win_data->current_image);
+        win_data->current_image = NULL;
+    }
+    g_list_free_full(win_data->annotations, (GDestroyNotify)annotation_free);
+    win_data->annotations = NULL;
+    clear_baked(win_data);
+    g_free(win_data->current_path);
+    win_data->current_path = NULL;
+    clear_raster_undo(win_data);
+    document_changed(win_data);
+    gtk_widget_queue_draw(win->canvas);
+}
+
+// Whether the current image is only the placeholder of a history image
+// still being decoded. Its pixels are a scaled-up thumbnail, so it is not
+// edited, copied or saved.
+static bool document_loading(MainWindowData* win_data) {
+    return win_data->loading_path && g_strcmp0(win_data->loading_path, win_data->current_path) == 0;
+}
+
+// Stand-in for a history image still being decoded: its thumbnail scaled
+// up to the size of the image, so annotations already line up. NULL if
+// either is not known yet.
+static cairo_surface_t* create_history_placeholder(ScreenshotEntry* entry) {
+    if (!entry->thumbnail || entry->width == 0 || entry->height == 0) return NULL;
+    
+    cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, (int)entry->width, (int)entry->height);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        return NULL;
+    }
+    
+    cairo_t* cr = cairo_create(surface);
+    cairo_scale(cr, (double)entry->width / gdk_pixbuf_get_width(entry->thumbnail),
+                (double)entry->height / gdk_pixbuf_get_height(entry->thumbnail));
+    gdk_cairo_set_source_pixbuf(cr, entry->thumbnail, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_BILINEAR);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    return surface;
+}
+
+static void on_history_image_loaded(const char* filepath, cairo_surface_t* image, const GError* error, gpointer data) {
+    MainWindow* win = (MainWindow*)data;
+    MainWindowData* win_data = safe_get_data(win->window, "window-data", "on_history_image_loaded");
+    if (!win_data || g_strcmp0(win_data->loading_path, filepath) != 0) return;
+    
+    bool placeholder = document_loading(win_data);
+    g_free(win_data->loading_path);
+    win_data->loading_path = NULL;
+    
+    if (!image) {
+        // The placeholder must not pass for the image from now on
+        if (placeholder) {
+            close_document(win, win_data);
+        }
+        char status[256];
+        snprintf(status, sizeof(status), "Failed to load image: %s", error ? error->message : "unknown error");
+        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, status);
+        return;
+    }
+    
+    if (g_strcmp0(win_data->current_path, filepath) == 0) {
+        // Swap the placeholder for the real pixels; annotations stay
+        cairo_surface_destroy(win_data->current_image);
+        win_data->current_image = cairo_surface_reference(image);
+        clear_raster_undo(win_data);
+        document_changed(win_data);
+        gtk_widget_queue_draw(win->canvas);
+    } else {
+        show_history_image(win, win_data, filepath, cairo_surface_reference(image));
+    }
     gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Loaded image from history");
 }
 
-static GtkWidget* create_history_item_widget(ScreenshotEntry* entry, MainWindow* win) {
-    // Create thumbnail
-    GtkWidget* image = gtk_image_new_from_pixbuf(entry->thumbnail);
-    gtk_widget_set_size_request(image, 200, 200);
+// Decode the entries around position ahead, nearest first
+static void prefetch_history_neighbours(MainWindow* win, MainWindowData* win_data, guint position) {
+    ScreenshotHistoryQuery query = {
+        .offset = position > HISTORY_PREFETCH_RADIUS ? position - HISTORY_PREFETCH_RADIUS : 0,
+        .limit = 2 * HISTORY_PREFETCH_RADIUS + 1,
+    };
+    guint count;
+    ScreenshotEntry* const* page = screenshot_history_get_sorted(&win->screenshot_history, &query, &count);
+    
+    for (guint distance = 1; distance <= HISTORY_PREFETCH_RADIUS; distance++) {
+        for (int direction = -1; direction <= 1; direction += 2) {
+            gint64 index = (gint64)position + direction * (gint64)distance - query.offset;
+            if (index >= 0 && index < count) {
+                image_loader_prefetch(win_data->image_loader, page[index]->filepath);
+            }
+        }
+    }
+}
+
+static void on_history_entry_activated(ScreenshotEntry* entry, gpointer data) {
+    MainWindow* win = (MainWindow*)data;
+    MainWindowData* win_data = safe_get_data(win->window, "window-data", "on_history_entry_activated");
+    if (!win_data) return;
+    const char* filepath = entry->filepath;
+    
+    g_free(win_data->loading_path);
+    win_data->loading_path = NULL;
+    
+    // Decoded images are shown right away; anything else is decoded on a
+    // worker while its thumbnail stands in for it
+    cairo_surface_t* image = image_loader_lookup(win_data->image_loader, filepath);
+    if (image) {
+        show_history_image(win, win_data, filepath, image);
+        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Loaded image from history");
+    } else {
+        win_data->loading_path = g_strdup(filepath);
+        image_loader_open(win_data->image_loader, filepath, on_history_image_loaded, win);
+        
+        cairo_surface_t* placeholder = create_history_placeholder(entry);
+        if (placeholder) {
+            show_history_image(win, win_data, filepath, placeholder);
+        }
+        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, "Loading image from history...");
+    }
     
-    // Make the image clickable
-    GtkWidget* event_box = gtk_event_box_new();
-    gtk_container_add(GTK_CONTAINER(event_box), image);
+    // Queued behind the open, so flipping on finds the neighbours decoded
+    guint position = screenshot_history_get_position(&win->screenshot_history, entry);
+    prefetch_history_neighbours(win, win_data, position);
+}
+
+// Open the history entry delta places from the current image (newer for
+// negative delta)
+static void step_history(MainWindow* win, MainWindowData* win_data, int delta) {
+    ScreenshotHistory* history = &win->screenshot_history;
+    ScreenshotEntry* current = win_data->current_path ? g_hash_table_lookup(history->index, win_data->current_path) : NULL;
+    if (!current) return;
+    
+    guint position = screenshot_history_get_position(history, current);
+    if ((delta < 0 && position < (guint)-delta) || position >= screenshot_history_get_count(history)) return;
+    
+    ScreenshotHistoryQuery query = { .offset = position + delta, .limit = 1 };
+    guint count;
+    ScreenshotEntry* const* page = screenshot_history_get_sorted(history, &query, &count);
+    if (count == 1) {
+        on_history_entry_activated(page[0], win);
+    }
+}
+
+static void on_compact_done(const char* filepath, CompactResult result, gint64 saved_bytes,
+                            guint64 content_hash, gpointer data) {
+    MainWindow* win = (MainWindow*)data;
     
-    // Store the filepath and window data
-    safe_set_data_full(event_box, "filepath", g_strdup(entry->filepath), g_free, "create_history_item_widget");
+    // Failures (e.g. a corrupt file) are tried again a day later, so they
+    // do not take up every batch meanwhile
+    if (result == COMPACT_FAILED) {
+        screenshot_history_compact_failed(&win->screenshot_history, filepath, time(NULL) + COMPACT_RETRY_INTERVAL_S);
+        return;
+    }
+    screenshot_history_compacted(&win->screenshot_history, filepath, result == COMPACT_REPLACED, content_hash);
     
-    // Connect click event
-    g_signal_connect(event_box, "button-press-event", G_CALLBACK(on_history_item_clicked), win);
+    if (result == COMPACT_REPLACED) {
+        char* basename = g_path_get_basename(filepath);
+        char* saved = g_format_size((guint64)saved_bytes);
+        char status[256];
+        snprintf(status, sizeof(status), "Compacted %s, %s saved", basename, saved);
+        gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, status);
+        g_free(saved);
+        g_free(basename);
+    }
+}
+
+// Hand the next batch of old, uncompacted PNG screenshots to the compactor
+// once it has finished the last one
+static gboolean check_compaction(gpointer data) {
+    MainWindow* win = (MainWindow*)data;
+    MainWindowData* win_data = safe_get_data(win->window, "window-data", "check_compaction");
+    Settings* settings = safe_get_data(win->window, "settings", "check_compaction");
+    if (!win_data || !settings) return G_SOURCE_CONTINUE;
+    if (settings->compact_after_days <= 0 || compactor_get_pending(win_data->compactor) > 0) {
+        return G_SOURCE_CONTINUE;
+    }
     
-    return event_box;
+    ScreenshotHistoryQuery query = { .before = time(NULL) - (time_t)settings->compact_after_days * 24 * 60 * 60 };
+    guint count;
+    ScreenshotEntry* const* page = screenshot_history_get_sorted(&win->screenshot_history, &query, &count);
+    
+    time_t now = time(NULL);
+    guint submitted = 0;
+    for (guint i = 0; i < count && submitted < COMPACT_BATCH; i++) {
+        ScreenshotEntry* entry = page[i];
+        if (entry->compacted || entry->compact_retry > now || !g_str_has_suffix(entry->filepath, ".png")) continue;
+        screenshot_history_compacting(&win->screenshot_history, entry);
+        compactor_submit(win_data->compactor, entry->filepath);
+        submitted++;
+    }
+    return G_SOURCE_CONTINUE;
 }
 
-static void create_settings_page(MainWindow* win, GtkWidget* notebook) {
+// Fill the settings tab page
+static void create_settings_page(MainWindow* win, GtkWidget* page) {
     Settings* settings = safe_get_data(win->window, "settings", "create_settings_page");
     
     GtkWidget* vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
@@ -1096,7 +1533,8 @@ static void create_settings_page(MainWindow* win, GtkWidget* notebook) {
         
         safe_set_data(radio, "settings", settings, "create_settings_page");
         safe_set_data(radio, "window", win, "create_settings_page");
-        safe_set_data(radio, "format", GINT_TO_POINTER(i), "create_settings_page");
+        // Stored off by one, so the first format is not a NULL pointer
+        safe_set_data(radio, "format", GINT_TO_POINTER(i + 1), "create_settings_page");
         
         if (settings->filename_format == (FilenameFormat)i) {
             gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radio), TRUE);
@@ -1129,25 +1567,18 @@ static void create_settings_page(MainWindow* win, GtkWidget* notebook) {
     GtkWidget* shortcut_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
     gtk_container_set_border_width(GTK_CONTAINER(shortcut_box), 10);
     
-    const char* shortcut_labels[] = {
-        "Print Screen",
-        "Ctrl + Print Screen",
-        "Alt + Print Screen",
-        "Shift + Print Screen",
-        "Ctrl + Shift + Print Screen"
-    };
-    
     GtkWidget* shortcut_radio = NULL;
-    for (int i = 0; i < 5; i++) {
+    for (gsize i = 0; i < G_N_ELEMENTS(SHORTCUTS); i++) {
         GtkWidget* radio = gtk_radio_button_new_with_label_from_widget(
-            GTK_RADIO_BUTTON(shortcut_radio), shortcut_labels[i]);
+            GTK_RADIO_BUTTON(shortcut_radio), SHORTCUTS[i].label);
         shortcut_radio = radio;
         
         safe_set_data(radio, "settings", settings, "create_settings_page");
         safe_set_data(radio, "window", win, "create_settings_page");
-        safe_set_data(radio, "shortcut", GINT_TO_POINTER(i), "create_settings_page");
+        // Off by one like the formats, as SHORTCUT_NONE is 0
+        safe_set_data(radio, "shortcut", GINT_TO_POINTER(SHORTCUTS[i].key + 1), "create_settings_page");
         
-        if (settings->shortcut_key == (ShortcutKey)i) {
+        if (settings->shortcut_key == SHORTCUTS[i].key) {
             gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radio), TRUE);
         }
         
@@ -1158,48 +1589,140 @@ static void create_settings_page(MainWindow* win, GtkWidget* notebook) {
     gtk_container_add(GTK_CONTAINER(shortcut_frame), shortcut_box);
     gtk_box_pack_start(GTK_BOX(vbox), shortcut_frame, FALSE, FALSE, 0);
 
-    // Add the vbox to the notebook
-    gtk_notebook_append_page(GTK_NOTEBOOK(notebook), vbox, gtk_label_new("Settings"));
+    // History Frame
+    GtkWidget* history_frame = gtk_frame_new("History");
+    GtkWidget* history_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+    gtk_container_set_border_width(GTK_CONTAINER(history_box), 10);
+    GtkWidget* memory_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    
+    GtkWidget* memory_label = gtk_label_new("Thumbnail memory (MB)");
+    GtkWidget* memory_spin = gtk_spin_button_new_with_range(THUMBNAIL_MEMORY_MIN_MB, THUMBNAIL_MEMORY_MAX_MB, 16);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(memory_spin), settings->thumbnail_memory_mb);
+    safe_set_data(memory_spin, "settings", settings, "create_settings_page");
+    safe_set_data(memory_spin, "window", win, "create_settings_page");
+    g_signal_connect(memory_spin, "value-changed", G_CALLBACK(on_settings_changed), NULL);
+    
+    GtkWidget* dedup_check = gtk_check_button_new_with_label("Link identical screenshots instead of storing copies");
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(dedup_check), settings->deduplicate);
+    safe_set_data(dedup_check, "settings", settings, "create_settings_page");
+    safe_set_data(dedup_check, "window", win, "create_settings_page");
+    safe_set_data(dedup_check, "deduplicate", GINT_TO_POINTER(TRUE), "create_settings_page");
+    g_signal_connect(dedup_check, "toggled", G_CALLBACK(on_settings_changed), NULL);
+    
+    GtkWidget* compact_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    GtkWidget* compact_label = gtk_label_new("Recompress screenshots older than (days, 0 = never)");
+    GtkWidget* compact_spin = gtk_spin_button_new_with_range(0, COMPACT_MAX_DAYS, 1);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(compact_spin), settings->compact_after_days);
+    safe_set_data(compact_spin, "settings", settings, "create_settings_page");
+    safe_set_data(compact_spin, "window", win, "create_settings_page");
+    safe_set_data(compact_spin, "compact-days", GINT_TO_POINTER(TRUE), "create_settings_page");
+    g_signal_connect(compact_spin, "value-changed", G_CALLBACK(on_settings_changed), NULL);
+    
+    gtk_box_pack_start(GTK_BOX(memory_box), memory_label, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(memory_box), memory_spin, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(history_box), memory_box, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(history_box), dedup_check, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(compact_box), compact_label, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(compact_box), compact_spin, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(history_box), compact_box, FALSE, FALSE, 0);
+    gtk_container_add(GTK_CONTAINER(history_frame), history_box);
+    gtk_box_pack_start(GTK_BOX(vbox), history_frame, FALSE, FALSE, 0);
+
+    // Add the vbox to the page
+    gtk_box_pack_start(GTK_BOX(page), vbox, TRUE, TRUE, 0);
+    gtk_widget_show_all(page);
+}
+
+// The settings tab is only built when it is first opened
+static void on_notebook_switch_page(GtkNotebook* notebook, GtkWidget* page, guint page_num, gpointer data) {
+    (void)notebook;
+    (void)page_num;
+    MainWindow* win = (MainWindow*)data;
+    if (g_object_steal_data(G_OBJECT(page), "settings-pending")) {
+        create_settings_page(win, page);
+    }
 }
 
+// Idle after the first frame: everything the window does not need to appear
+static gboolean finish_startup(gpointer data) {
+    MainWindow* win = (MainWindow*)data;
+    MainWindowData* win_data = safe_get_data(win->window, "window-data", "finish_startup");
+    Settings* settings = safe_get_data(win->window, "settings", "finish_startup");
+    if (!win_data || !settings) return G_SOURCE_REMOVE;
+    
+    // The history grid is already on screen and fills in through its observer
+    screenshot_history_set_path(&win->screenshot_history, settings->screenshot_path);
+    screenshot_history_load(&win->screenshot_history);
+    gint64 history_time = g_get_monotonic_time();
+    
+    win_data->compactor = compactor_new(on_compact_done, win);
+    // Look for old screenshots to compact now and then, never at startup
+    win_data->compact_source = g_timeout_add_seconds(COMPACT_CHECK_INTERVAL_S, check_compaction, win);
+    
+    if (win_data->startup_stats) {
+        fprintf(stderr, "startup: first frame %.1f ms, history ready %.1f ms (%u screenshots)\n",
+                (win_data->first_frame_time - win_data->startup_time) / 1000.0,
+                (history_time - win_data->startup_time) / 1000.0,
+                screenshot_history_get_count(&win->screenshot_history));
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Note the first frame and start the deferred work behind it
+static gboolean on_first_draw(GtkWidget* widget, cairo_t* cr, gpointer data) {
+    (void)cr;
+    MainWindow* win = (MainWindow*)data;
+    MainWindowData* win_data = safe_get_data(win->window, "window-data", "on_first_draw");
+    g_signal_handlers_disconnect_by_func(widget, G_CALLBACK(on_first_draw), data);
+    if (!win_data) return FALSE;
+    
+    win_data->first_frame_time = g_get_monotonic_time();
+    
+    // Low priority, so the frame is finished and shown before any of it
+    g_idle_add_full(G_PRIORITY_LOW, finish_startup, win, NULL);
+    return FALSE;
+}
+
+// Grab the key combination of key on the whole display, releasing the
+// previous one, and say so in the status bar if it cannot be had
 static void register_shortcut_key(MainWindow* win, ShortcutKey key) {
-    GdkDisplay* display = gdk_display_get_default();
-    GdkScreen* screen = gdk_display_get_default_screen(display);
-    GdkWindow* root = gdk_screen_get_root_window(screen);
-    
-    // First ungrab any existing shortcuts
-    GdkSeat* seat = gdk_display_get_default_seat(display);
-    gdk_seat_ungrab(seat);
-    
-    // Register the new shortcut
-    switch (key) {
-        case SHORTCUT_PRINTSCREEN:
-            gdk_window_add_filter(root, (GdkFilterFunc)key_filter_func, win);
-            break;
-        case SHORTCUT_CTRL_PRINTSCREEN:
-            gdk_window_add_filter(root, (GdkFilterFunc)key_filter_func, win);
-            break;
-        case SHORTCUT_SHIFT_PRINTSCREEN:
-            gdk_window_add_filter(root, (GdkFilterFunc)key_filter_func, win);
-            break;
-        case SHORTCUT_CTRL_SHIFT_S:
-            gdk_window_add_filter(root, (GdkFilterFunc)key_filter_func, win);
-            break;
-        case SHORTCUT_CTRL_ALT_S:
-            gdk_window_add_filter(root, (GdkFilterFunc)key_filter_func, win);
-            break;
-        default:
-            break;
-    }
-}
-
-static void destroy_widget(gpointer data, gpointer user_data) {
-    (void)user_data;
-    if (GTK_IS_WIDGET(data)) {
-        gtk_widget_destroy(GTK_WIDGET(data));
+    global_hotkey_ungrab();
+    
+    for (gsize i = 0; i < G_N_ELEMENTS(SHORTCUTS); i++) {
+        if (SHORTCUTS[i].key != key || SHORTCUTS[i].keysym == NoSymbol) continue;
+        
+        GError* error = NULL;
+        if (!global_hotkey_grab(SHORTCUTS[i].keysym, SHORTCUTS[i].modifiers, on_shortcut_pressed, win, &error)) {
+            char status[256];
+            snprintf(status, sizeof(status), "Cannot use %s as shortcut: %s", SHORTCUTS[i].label, error->message);
+            gtk_statusbar_push(GTK_STATUSBAR(win->statusbar), 0, status);
+            g_error_free(error);
+        }
+        return;
     }
 }
 
+static void remove_source(gpointer data) {
+    g_source_remove(GPOINTER_TO_UINT(data));
+}
+
+// Point the history at the directory typed into the path entry
+static gboolean reload_history_path(gpointer data) {
+    GtkWidget* entry = GTK_WIDGET(data);
+    Settings* settings = safe_get_data(entry, "settings", "reload_history_path");
+    MainWindow* win = safe_get_data(entry, "window", "reload_history_path");
+    
+    // The source is finishing on its own, so nothing must remove it
+    g_object_steal_data(G_OBJECT(entry), "reload-source");
+    
+    if (settings && win &&
+        g_strcmp0(win->screenshot_history.screenshot_path, settings->screenshot_path) != 0) {
+        screenshot_history_set_path(&win->screenshot_history, settings->screenshot_path);
+        screenshot_history_load(&win->screenshot_history);
+    }
+    return G_SOURCE_REMOVE;
+}
+
 static void on_settings_changed(GtkWidget* widget, gpointer data) {
     (void)data;  // Mark unused parameter as used
     Settings* settings = safe_get_data(widget, "settings", "on_settings_changed");
@@ -1210,52 +1733,59 @@ static void on_settings_changed(GtkWidget* widget, gpointer data) {
         return;
     }
 
+    // Handle the compaction age; spin buttons are entries too, so the spin
+    // buttons come first
+    if (safe_get_data(widget, "compact-days", "on_settings_changed")) {
+        settings->compact_after_days = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(widget));
+    }
+    // Handle thumbnail memory changes
+    else if (GTK_IS_SPIN_BUTTON(widget)) {
+        settings->thumbnail_memory_mb = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(widget));
+        screenshot_history_set_thumbnail_budget(&win->screenshot_history,
+                                                (gsize)settings->thumbnail_memory_mb * 1024 * 1024);
+    }
     // Handle path entry changes
-    if (GTK_IS_ENTRY(widget)) {
+    else if (GTK_IS_ENTRY(widget)) {
         const char* new_path = gtk_entry_get_text(GTK_ENTRY(widget));
         if (g_strcmp0(settings->screenshot_path, new_path) != 0) {
             g_free(settings->screenshot_path);
             settings->screenshot_path = g_strdup(new_path);
             
-            // Update screenshot history path and reload
-            screenshot_history_set_path(&win->screenshot_history, new_path);
-            screenshot_history_load(&win->screenshot_history);
-            
-            // Clear and update history items in the view
-            GtkFlowBox* history_box = GTK_FLOW_BOX(win->history_flow_box);
-            GList* children = gtk_container_get_children(GTK_CONTAINER(history_box));
-            g_list_foreach(children, destroy_widget, NULL);
-            g_list_free(children);
-            
-            GList* entries = screenshot_history_get_sorted(&win->screenshot_history);
-            for (GList* l = entries; l != NULL; l = l->next) {
-                ScreenshotEntry* entry = l->data;
-                GtkWidget* item_widget = create_history_item_widget(entry, win);
-                gtk_flow_box_insert(GTK_FLOW_BOX(history_box), item_widget, -1);
-            }
+            // Reload the history once typing pauses, not on every keystroke;
+            // replacing the data cancels the pending reload
+            guint source = g_timeout_add(PATH_RELOAD_DELAY_MS, reload_history_path, widget);
+            g_object_set_data_full(G_OBJECT(widget), "reload-source", GUINT_TO_POINTER(source), remove_source);
         }
     }
-    // Handle autostart checkbox changes
-    else if (GTK_IS_CHECK_BUTTON(widget)) {
-        settings->start_with_os = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
-        toggle_autostart(settings->start_with_os);
+    // Handle the deduplication checkbox
+    else if (safe_get_data(widget, "deduplicate", "on_settings_changed")) {
+        settings->deduplicate = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
+        export_queue_set_lookup(settings->deduplicate ? find_identical_screenshot : NULL, win);
     }
-    // Handle radio button changes (filename format and shortcut keys)
-    else if (GTK_IS_RADIO_BUTTON(widget) && gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget))) {
+    // Handle radio button changes (filename format and shortcut keys).
+    // Radio buttons are check buttons too, so this comes first; only the
+    // newly active one of a group counts.
+    else if (GTK_IS_RADIO_BUTTON(widget)) {
+        if (!gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget))) return;
         gpointer format_data = safe_get_data(widget, "format", "on_settings_changed");
         gpointer shortcut_data = safe_get_data(widget, "shortcut", "on_settings_changed");
         
         if (format_data) {
-            settings->filename_format = (FilenameFormat)GPOINTER_TO_INT(format_data);
+            settings->filename_format = (FilenameFormat)(GPOINTER_TO_INT(format_data) - 1);
         }
         else if (shortcut_data) {
-            int new_shortcut = GPOINTER_TO_INT(shortcut_data);
-            if (settings->shortcut_key != (ShortcutKey)new_shortcut) {
-                settings->shortcut_key = (ShortcutKey)new_shortcut;
+            ShortcutKey new_shortcut = (ShortcutKey)(GPOINTER_TO_INT(shortcut_data) - 1);
+            if (settings->shortcut_key != new_shortcut) {
+                settings->shortcut_key = new_shortcut;
                 register_shortcut_key(win, settings->shortcut_key);
             }
         }
     }
+    // Handle autostart checkbox changes
+    else if (GTK_IS_CHECK_BUTTON(widget)) {
+        settings->start_with_os = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
+        toggle_autostart(settings->start_with_os);
+    }
     
     save_settings(settings);
 }
@@ -1289,63 +1819,25 @@ static void toggle_autostart(bool enable) {
     g_free(autostart_dir);
 }
 
-static GdkFilterReturn key_filter_func(GdkXEvent* xevent, GdkEvent* event, gpointer data) {
-    (void)event;
-    MainWindow* win = (MainWindow*)data;
-    XEvent* xe = (XEvent*)xevent;
-    
-    if (xe->type == KeyPress) {
-        XKeyEvent* key_event = (XKeyEvent*)xe;
-        KeySym key_sym = XLookupKeysym(key_event, 0);
-        unsigned int modifiers = key_event->state;
-        Settings* settings = safe_get_data(win->window, "settings", "key_filter_func");
-        
-        // Check if the key combination matches the configured shortcut
-        switch (settings->shortcut_key) {
-            case SHORTCUT_PRINTSCREEN:
-                if (key_sym == XK_Print && modifiers == 0) {
-                    on_capture_button_clicked(NULL, win);
-                    return GDK_FILTER_REMOVE;
-                }
-                break;
-            case SHORTCUT_CTRL_PRINTSCREEN:
-                if (key_sym == XK_Print && (modifiers & ControlMask)) {
-                    on_capture_button_clicked(NULL, win);
-                    return GDK_FILTER_REMOVE;
-                }
-                break;
-            case SHORTCUT_SHIFT_PRINTSCREEN:
-                if (key_sym == XK_Print && (modifiers & ShiftMask)) {
-                    on_capture_button_clicked(NULL, win);
-                    return GDK_FILTER_REMOVE;
-                }
-                break;
-            case SHORTCUT_CTRL_SHIFT_S:
-                if (key_sym == XK_s && (modifiers & (ControlMask | ShiftMask))) {
-                    on_capture_button_clicked(NULL, win);
-                    return GDK_FILTER_REMOVE;
-                }
-                break;
-            case SHORTCUT_CTRL_ALT_S:
-                if (key_sym == XK_s && (modifiers & (ControlMask | Mod1Mask))) {
-                    on_capture_button_clicked(NULL, win);
-                    return GDK_FILTER_REMOVE;
-                }
-                break;
-            default:
-                break;
+bool main_window_init(MainWindow* win, int argc, char* argv[], gint64 startup_time) {
+    // Take out our own option before GTK sees the arguments
+    bool startup_stats = false;
+    int kept = 0;
+    for (int i = 0; i < argc; i++) {
+        if (i > 0 && strcmp(argv[i], "--startup-stats") == 0) {
+            startup_stats = true;
+        } else {
+            argv[kept++] = argv[i];
         }
     }
-    
-    return GDK_FILTER_CONTINUE;
-}
-
-bool main_window_init(MainWindow* win, int argc, char* argv[]) {
+    argc = kept;
     gtk_init(&argc, &argv);
     
-    // Initialize screenshot history
+    // Start the background save worker
+    export_queue_init();
+    
+    // Initialize screenshot history; it is loaded once the window is shown
     screenshot_history_init(&win->screenshot_history);
-    screenshot_history_load(&win->screenshot_history);
     
     // Create main window
     win->window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
@@ -1357,7 +1849,7 @@ bool main_window_init(MainWindow* win, int argc, char* argv[]) {
     win->toolbar = NULL;
     win->canvas = NULL;
     win->statusbar = NULL;
-    win->history_flow_box = NULL;
+    win->history_grid = NULL;
     
     gtk_window_set_title(GTK_WINDOW(win->window), "LinShot");
     gtk_window_set_default_size(GTK_WINDOW(win->window), 800, 600);
@@ -1371,13 +1863,31 @@ bool main_window_init(MainWindow* win, int argc, char* argv[]) {
         gtk_widget_destroy(win->window);
         return false;
     }
+    data->exports = NULL;
+    data->image_loader = image_loader_new(IMAGE_LOADER_DEFAULT_CAPACITY);
+    data->loading_path = NULL;
+    data->compactor = NULL;
+    data->startup_time = startup_time;
+    data->first_frame_time = 0;
+    data->startup_stats = startup_stats;
+    
+    // Serve scripts and later launches; if another instance won the race
+    // this one still works, just without the socket
+    GError* error = NULL;
+    data->capture_server = capture_server_new(on_remote_command, win, &error);
+    if (!data->capture_server) {
+        g_warning("Not accepting commands: %s", error->message);
+        g_error_free(error);
+    }
     
     // Initialize the window data structure
     data->win = *win;  // Now safe to copy since win is fully initialized
     data->current_image = NULL;
+    data->current_path = NULL;
     tool_settings_init(&data->current_tool);
     data->annotations = NULL;
     data->undo_stack = NULL;
+    data->raster_undo_stack = NULL;
     data->drawing = false;
     data->selected_text = NULL;
     data->drag_start_x = 0;
@@ -1394,6 +1904,9 @@ bool main_window_init(MainWindow* win, int argc, char* argv[]) {
     Settings* settings = g_new0(Settings, 1);
     load_settings(settings);
     safe_set_data_full(win->window, "settings", settings, g_free, "main_window_init");
+    screenshot_history_set_thumbnail_budget(&win->screenshot_history,
+                                            (gsize)settings->thumbnail_memory_mb * 1024 * 1024);
+    export_queue_set_lookup(settings->deduplicate ? find_identical_screenshot : NULL, win);
     
     // Create main horizontal box
     GtkWidget* main_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
@@ -1546,28 +2059,10 @@ bool main_window_init(MainWindow* win, int argc, char* argv[]) {
     GtkWidget* history_label = gtk_label_new("History");
     gtk_notebook_append_page(GTK_NOTEBOOK(notebook), history_page, history_label);
     
-    // Create scrolled window for history
-    GtkWidget* history_scroll = gtk_scrolled_window_new(NULL, NULL);
-    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(history_scroll),
-                                 GTK_POLICY_AUTOMATIC,
-                                 GTK_POLICY_AUTOMATIC);
-    gtk_widget_set_vexpand(history_scroll, TRUE);
-    gtk_widget_set_hexpand(history_scroll, TRUE);
-    gtk_container_add(GTK_CONTAINER(history_page), history_scroll);
-    
-    // Create flow box for history thumbnails
-    GtkWidget* flow_box = gtk_flow_box_new();
-    gtk_flow_box_set_selection_mode(GTK_FLOW_BOX(flow_box), GTK_SELECTION_NONE);
-    gtk_flow_box_set_homogeneous(GTK_FLOW_BOX(flow_box), TRUE);
-    gtk_flow_box_set_min_children_per_line(GTK_FLOW_BOX(flow_box), 2);
-    gtk_flow_box_set_max_children_per_line(GTK_FLOW_BOX(flow_box), 5);
-    gtk_flow_box_set_row_spacing(GTK_FLOW_BOX(flow_box), 5);
-    gtk_flow_box_set_column_spacing(GTK_FLOW_BOX(flow_box), 5);
-    gtk_widget_set_margin_start(flow_box, 5);
-    gtk_widget_set_margin_end(flow_box, 5);
-    gtk_widget_set_margin_top(flow_box, 5);
-    gtk_widget_set_margin_bottom(flow_box, 5);
-    gtk_container_add(GTK_CONTAINER(history_scroll), flow_box);
+    // Create the history grid; it lists the entries right away and asks
+    // for thumbnails as their rows scroll into view
+    win->history_grid = history_grid_new(&win->screenshot_history, on_history_entry_activated, win);
+    gtk_box_pack_start(GTK_BOX(history_page), win->history_grid, TRUE, TRUE, 0);
     
     // Create statusbar
     win->statusbar = gtk_statusbar_new();
@@ -1578,13 +2073,17 @@ bool main_window_init(MainWindow* win, int argc, char* argv[]) {
     data->win.canvas = win->canvas;
     data->win.statusbar = win->statusbar;
     
-    // Store flow box in window data for history updates
-    win->history_flow_box = flow_box;
+    // Grab the capture shortcut; failures end up in the status bar
+    register_shortcut_key(win, settings->shortcut_key);
     
-    // Create settings tab
-    create_settings_page(win, notebook);
+    // Create settings tab, filled in when first opened
+    GtkWidget* settings_page = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    g_object_set_data(G_OBJECT(settings_page), "settings-pending", GINT_TO_POINTER(TRUE));
+    gtk_notebook_append_page(GTK_NOTEBOOK(notebook), settings_page, gtk_label_new("Settings"));
+    g_signal_connect(notebook, "switch-page", G_CALLBACK(on_notebook_switch_page), win);
     
-    // Show all widgets
+    // Show all widgets; the history and background work follow the first frame
+    g_signal_connect_after(win->window, "draw", G_CALLBACK(on_first_draw), win);
     gtk_widget_show_all(win->window);
     
     return true;
@@ -1595,6 +2094,9 @@ void main_window_cleanup(MainWindow* win) {
         return;
     }
     
+    // Finish writing queued screenshots before tearing anything down
+    export_queue_shutdown();
+    
     // Clean up window data first
     if (win->window && GTK_IS_WIDGET(win->window)) {
         MainWindowData* data = safe_get_data(win->window, "window-data", "main_window_cleanup");
@@ -1603,12 +2105,47 @@ void main_window_cleanup(MainWindow* win) {
                 cairo_surface_destroy(data->current_image);
                 data->current_image = NULL;
             }
+            if (data->composite) {
+                cairo_surface_destroy(data->composite);
+                data->composite = NULL;
+            }
+            image_loader_free(data->image_loader);
+            data->image_loader = NULL;
+            g_free(data->loading_path);
+            data->loading_path = NULL;
+            if (data->compact_source) {
+                g_source_remove(data->compact_source);
+                data->compact_source = 0;
+            }
+            compactor_free(data->compactor);
+            data->compactor = NULL;
+            
+            global_hotkey_ungrab();
+            
+            // Saves not reported by now never will be, the main loop has stopped
+            capture_server_free(data->capture_server);
+            data->capture_server = NULL;
+            for (GList* iter = data->exports; iter != NULL; iter = iter->next) {
+                ExportContext* export = iter->data;
+                for (GList* request = export->requests; request != NULL; request = request->next) {
+                    capture_server_reply(request->data, false, "LinShot exited before the save was reported");
+                }
+                export_context_free(export);
+            }
+            g_list_free(data->exports);
+            data->exports = NULL;
+            data->capture_export = NULL;
+            capture_cleanup();
+            g_free(data->current_path);
+            data->current_path = NULL;
             
             // Free both annotations list and undo stack
             g_list_free_full(data->annotations, (GDestroyNotify)annotation_free);
             g_list_free_full(data->undo_stack, (GDestroyNotify)annotation_free);
             data->annotations = NULL;
             data->undo_stack = NULL;
+            clear_baked(data);
+            clear_raster_undo(data);
             
             // Remove the data from the window before freeing
             safe_set_data(win->window, "window-data", NULL, "main_window_cleanup");
@@ -1623,4 +2160,7 @@ void main_window_cleanup(MainWindow* win) {
         gtk_widget_destroy(win->window);
         win->window = NULL;
     }
+    
+    // Release recycled capture buffers
+    surface_pool_trim();
 } 
\ No newline at end of file
@@ -0,0 +1,439 @@
+#include "../include/png_writer.h"
+#include <zlib.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Rows per stripe never drop below this, so stripe overhead stays negligible
+#define MIN_STRIPE_ROWS 32
+// Stripes per thread, for load balancing between busy and flat regions
+#define STRIPES_PER_THREAD 4
+// Deflate window size; each stripe is primed with this much preceding data
+#define DEFLATE_WINDOW (32 * 1024)
+// Maximum payload of a single IDAT chunk
+#define IDAT_CHUNK_SIZE (256 * 1024)
+
+enum {
+    FILTER_NONE = 0,
+    FILTER_SUB,
+    FILTER_UP,
+    FILTER_AVERAGE,
+    FILTER_PAETH
+};
+
+typedef struct {
+    int first_row;
+    int row_count;
+    GByteArray* output;     // Raw deflate data, ends byte-aligned
+    uLong adler;            // Adler-32 of the filtered rows
+    uLong length;           // Number of filtered bytes
+    bool failed;
+} PngStripe;
+
+typedef struct {
+    const unsigned char* data;
+    int width, height, stride;
+    int channels;           // 3 for opaque images, 4 otherwise
+    int level;
+    PngStripe* stripes;
+    int stripe_count;
+    gint next_stripe;       // Atomic work counter
+    gint cancelled;         // Atomic flag
+    GMutex lock;
+    GCond cond;
+    int completed;          // Guarded by lock
+} PngEncoder;
+
+// Convert one ARGB32 row into PNG's RGB or straight-alpha RGBA layout
+static void convert_row(const PngEncoder* encoder, int y, guint8* out) {
+    const guint32* pixels = (const guint32*)(encoder->data + (gsize)y * encoder->stride);
+    
+    if (encoder->channels == 3) {
+        for (int x = 0; x < encoder->width; x++) {
+            guint32 p = pixels[x];
+            out[0] = (p >> 16) & 0xFF;
+            out[1] = (p >> 8) & 0xFF;
+            out[2] = p & 0xFF;
+            out += 3;
+        }
+        return;
+    }
+    
+    for (int x = 0; x < encoder->width; x++) {
+        guint32 p = pixels[x];
+        guint32 a = p >> 24;
+        if (a == 0xFF) {
+            out[0] = (p >> 16) & 0xFF;
+            out[1] = (p >> 8) & 0xFF;
+            out[2] = p & 0xFF;
+        } else if (a == 0) {
+            out[0] = out[1] = out[2] = 0;
+        } else {
+            // Undo cairo's premultiplication
+            out[0] = (((p >> 16) & 0xFF) * 255 + a / 2) / a;
+            out[1] = (((p >> 8) & 0xFF) * 255 + a / 2) / a;
+            out[2] = ((p & 0xFF) * 255 + a / 2) / a;
+        }
+        out[3] = a;
+        out += 4;
+    }
+}
+
+static inline guint8 paeth_predictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+static void apply_filter(int filter, const guint8* row, const guint8* prev, int bpp, gsize len, guint8* out) {
+    for (gsize i = 0; i < len; i++) {
+        int left = i >= (gsize)bpp ? row[i - bpp] : 0;
+        int up = prev ? prev[i] : 0;
+        int up_left = (prev && i >= (gsize)bpp) ? prev[i - bpp] : 0;
+        
+        switch (filter) {
+            case FILTER_SUB:     out[i] = row[i] - left; break;
+            case FILTER_UP:      out[i] = row[i] - up; break;
+            case FILTER_AVERAGE: out[i] = row[i] - ((left + up) >> 1); break;
+            case FILTER_PAETH:   out[i] = row[i] - paeth_predictor(left, up, up_left); break;
+            default:             out[i] = row[i]; break;
+        }
+    }
+}
+
+// Sum of absolute values of the filtered bytes read as signed deltas
+static guint64 filter_cost(const guint8* filtered, gsize len) {
+    guint64 cost = 0;
+    for (gsize i = 0; i < len; i++) {
+        cost += filtered[i] < 128 ? filtered[i] : 256 - filtered[i];
+    }
+    return cost;
+}
+
+/*
+ * Pick and apply the filter for a row. Screenshots are dominated by flat
+ * UI surfaces and repeated rows, so those cases are settled without trial
+ * encoding: a row equal to the one above is pure Up (all zeros), and a row
+ * without any change along it is Sub. Everything else goes through the
+ * usual minimum-sum-of-absolute-differences choice between Sub, Up and
+ * Paeth. The choice depends only on the row and the one above it, which
+ * lets stripes reproduce their neighbours' filtering deterministically.
+ * out receives the filter type byte followed by the filtered row.
+ */
+static void filter_row(const guint8* row, const guint8* prev, int bpp, gsize len,
+                       guint8* scratch, guint8* out) {
+    if (prev && memcmp(row, prev, len) == 0) {
+        out[0] = FILTER_UP;
+        memset(out + 1, 0, len);
+        return;
+    }
+    
+    if (len <= (gsize)bpp || memcmp(row, row + bpp, len - bpp) == 0) {
+        out[0] = FILTER_SUB;
+        apply_filter(FILTER_SUB, row, prev, bpp, len, out + 1);
+        return;
+    }
+    
+    if (!prev) {
+        out[0] = FILTER_SUB;
+        apply_filter(FILTER_SUB, row, prev, bpp, len, out + 1);
+        return;
+    }
+    
+    static const int candidates[] = { FILTER_SUB, FILTER_UP, FILTER_PAETH };
+    guint64 best_cost = G_MAXUINT64;
+    
+    for (gsize i = 0; i < G_N_ELEMENTS(candidates); i++) {
+        apply_filter(candidates[i], row, prev, bpp, len, scratch);
+        guint64 cost = filter_cost(scratch, len);
+        if (cost < best_cost) {
+            best_cost = cost;
+            out[0] = candidates[i];
+            memcpy(out + 1, scratch, len);
+        }
+    }
+}
+
+static bool deflate_into(z_stream* zs, const guint8* input, gsize len, int flush, GByteArray* output) {
+    guint8 buffer[64 * 1024];
+    
+    zs->next_in = (Bytef*)input;
+    zs->avail_in = len;
+    do {
+        zs->next_out = buffer;
+        zs->avail_out = sizeof(buffer);
+        int ret = deflate(zs, flush);
+        if (ret == Z_STREAM_ERROR) return false;
+        g_byte_array_append(output, buffer, sizeof(buffer) - zs->avail_out);
+    } while (zs->avail_out == 0 || zs->avail_in > 0);
+    
+    return true;
+}
+
+static void encode_stripe(PngEncoder* encoder, PngStripe* stripe, bool last) {
+    gsize row_bytes = (gsize)encoder->width * encoder->channels;
+    gsize filtered_bytes = row_bytes + 1;
+    int bpp = encoder->channels;
+    
+    guint8* row = g_malloc(row_bytes);
+    guint8* prev = g_malloc(row_bytes);
+    guint8* scratch = g_malloc(row_bytes);
+    guint8* filtered = g_malloc(filtered_bytes);
+    
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, encoder->level, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        stripe->failed = true;
+        goto out;
+    }
+    
+    // Prime the window with the filtered tail of the previous stripe, the
+    // same bytes a sequential encoder would have seen, so that matches can
+    // reach across the stripe boundary
+    if (stripe->first_row > 0) {
+        int dict_rows = MIN(stripe->first_row, (int)(DEFLATE_WINDOW / filtered_bytes) + 1);
+        int dict_start = stripe->first_row - dict_rows;
+        GByteArray* dictionary = g_byte_array_sized_new(dict_rows * filtered_bytes);
+        
+        if (dict_start > 0) convert_row(encoder, dict_start - 1, prev);
+        for (int y = dict_start; y < stripe->first_row; y++) {
+            convert_row(encoder, y, row);
+            filter_row(row, y > 0 ? prev : NULL, bpp, row_bytes, scratch, filtered);
+            g_byte_array_append(dictionary, filtered, filtered_bytes);
+            guint8* tmp = prev; prev = row; row = tmp;
+        }
+        
+        gsize dict_len = MIN(dictionary->len, DEFLATE_WINDOW);
+        deflateSetDictionary(&zs, dictionary->data + dictionary->len - dict_len, dict_len);
+        g_byte_array_free(dictionary, TRUE);
+    }
+    
+    stripe->adler = adler32(0L, Z_NULL, 0);
+    stripe->length = 0;
+    
+    for (int i = 0; i < stripe->row_count; i++) {
+        int y = stripe->first_row + i;
+        if (g_atomic_int_get(&encoder->cancelled)) {
+            stripe->failed = true;
+            break;
+        }
+        
+        convert_row(encoder, y, row);
+        filter_row(row, y > 0 ? prev : NULL, bpp, row_bytes, scratch, filtered);
+        guint8* tmp = prev; prev = row; row = tmp;
+        
+        stripe->adler = adler32(stripe->adler, filtered, filtered_bytes);
+        stripe->length += filtered_bytes;
+        
+        // Non-final stripes end with a sync flush: byte-aligned and without
+        // the final-block bit, so the stripes concatenate into one stream
+        bool last_row = i == stripe->row_count - 1;
+        int flush = last_row ? (last ? Z_FINISH : Z_SYNC_FLUSH) : Z_NO_FLUSH;
+        if (!deflate_into(&zs, filtered, filtered_bytes, flush, stripe->output)) {
+            stripe->failed = true;
+            break;
+        }
+    }
+    
+    deflateEnd(&zs);
+    
+out:
+    g_free(filtered);
+    g_free(scratch);
+    g_free(prev);
+    g_free(row);
+}
+
+static gpointer encoder_thread(gpointer data) {
+    PngEncoder* encoder = data;
+    
+    for (;;) {
+        int index = g_atomic_int_add(&encoder->next_stripe, 1);
+        if (index >= encoder->stripe_count || g_atomic_int_get(&encoder->cancelled)) break;
+        
+        encode_stripe(encoder, &encoder->stripes[index], index == encoder->stripe_count - 1);
+        
+        g_mutex_lock(&encoder->lock);
+        encoder->completed++;
+        g_cond_signal(&encoder->cond);
+        g_mutex_unlock(&encoder->lock);
+    }
+    
+    return NULL;
+}
+
+static void put_u32_be(guint8* out, guint32 value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static void append_chunk(GByteArray* png, const char* type, const guint8* data, gsize len) {
+    guint8 header[8];
+    put_u32_be(header, len);
+    memcpy(header + 4, type, 4);
+    g_byte_array_append(png, header, sizeof(header));
+    if (len > 0) g_byte_array_append(png, data, len);
+    
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef*)type, 4);
+    if (len > 0) crc = crc32(crc, data, len);
+    
+    guint8 trailer[4];
+    put_u32_be(trailer, crc);
+    g_byte_array_append(png, trailer, sizeof(trailer));
+}
+
+static bool image_is_opaque(const unsigned char* data, int width, int height, int stride) {
+    for (int y = 0; y < height; y++) {
+        const guint32* pixels = (const guint32*)(data + (gsize)y * stride);
+        for (int x = 0; x < width; x++) {
+            if ((pixels[x] >> 24) != 0xFF) return false;
+        }
+    }
+    return true;
+}
+
+GBytes* png_writer_encode_data(const unsigned char* data, int width, int height, int stride, int level,
+                               GCancellable* cancellable, PngWriterProgressFunc progress,
+                               gpointer user_data, GError** error) {
+    if (!data || width <= 0 || height <= 0) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Invalid image");
+        return NULL;
+    }
+    
+    PngEncoder encoder;
+    memset(&encoder, 0, sizeof(encoder));
+    encoder.data = data;
+    encoder.width = width;
+    encoder.height = height;
+    encoder.stride = stride;
+    encoder.channels = image_is_opaque(data, width, height, stride) ? 3 : 4;
+    encoder.level = CLAMP(level, 0, 9);
+    g_mutex_init(&encoder.lock);
+    g_cond_init(&encoder.cond);
+    
+    // Split the rows into stripes
+    int threads = MAX(1, (int)g_get_num_processors());
+    int rows_per_stripe = MAX(MIN_STRIPE_ROWS, (height + threads * STRIPES_PER_THREAD - 1) / (threads * STRIPES_PER_THREAD));
+    encoder.stripe_count = (height + rows_per_stripe - 1) / rows_per_stripe;
+    encoder.stripes = g_new0(PngStripe, encoder.stripe_count);
+    for (int i = 0; i < encoder.stripe_count; i++) {
+        encoder.stripes[i].first_row = i * rows_per_stripe;
+        encoder.stripes[i].row_count = MIN(rows_per_stripe, height - i * rows_per_stripe);
+        encoder.stripes[i].output = g_byte_array_new();
+    }
+    
+    threads = MIN(threads, encoder.stripe_count);
+    GThread** workers = g_new0(GThread*, threads);
+    for (int i = 0; i < threads; i++) {
+        workers[i] = g_thread_new("png-deflate", encoder_thread, &encoder);
+    }
+    
+    // Report progress and watch for cancellation while the workers run
+    g_mutex_lock(&encoder.lock);
+    while (encoder.completed < encoder.stripe_count && !g_atomic_int_get(&encoder.cancelled)) {
+        gint64 deadline = g_get_monotonic_time() + 50 * G_TIME_SPAN_MILLISECOND;
+        g_cond_wait_until(&encoder.cond, &encoder.lock, deadline);
+        
+        if (g_cancellable_is_cancelled(cancellable)) {
+            g_atomic_int_set(&encoder.cancelled, 1);
+        }
+        
+        if (progress) {
+            double fraction = (double)encoder.completed / encoder.stripe_count;
+            g_mutex_unlock(&encoder.lock);
+            progress(fraction, user_data);
+            g_mutex_lock(&encoder.lock);
+        }
+    }
+    g_mutex_unlock(&encoder.lock);
+    
+    for (int i = 0; i < threads; i++) {
+        g_thread_join(workers[i]);
+    }
+    g_free(workers);
+    
+    GBytes* result = NULL;
+    bool failed = false;
+    for (int i = 0; i < encoder.stripe_count; i++) {
+        failed |= encoder.stripes[i].failed;
+    }
+    
+    if (g_atomic_int_get(&encoder.cancelled)) {
+        g_cancellable_set_error_if_cancelled(cancellable, error);
+    } else if (failed) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_FAILED, "PNG compression failed");
+    } else {
+        // Join the stripes into one zlib stream: header, deflate data, Adler-32
+        gsize compressed_size = 2 + 4;
+        for (int i = 0; i < encoder.stripe_count; i++) {
+            compressed_size += encoder.stripes[i].output->len;
+        }
+        
+        GByteArray* zdata = g_byte_array_sized_new(compressed_size);
+        const guint8 zlib_header[2] = { 0x78, encoder.level >= 7 ? 0xDA : 0x9C };
+        g_byte_array_append(zdata, zlib_header, sizeof(zlib_header));
+        
+        uLong adler = adler32(0L, Z_NULL, 0);
+        for (int i = 0; i < encoder.stripe_count; i++) {
+            PngStripe* stripe = &encoder.stripes[i];
+            g_byte_array_append(zdata, stripe->output->data, stripe->output->len);
+            adler = adler32_combine(adler, stripe->adler, stripe->length);
+        }
+        guint8 adler_be[4];
+        put_u32_be(adler_be, adler);
+        g_byte_array_append(zdata, adler_be, sizeof(adler_be));
+        
+        // Assemble the PNG file
+        GByteArray* png = g_byte_array_sized_new(zdata->len + 1024);
+        static const guint8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+        g_byte_array_append(png, signature, sizeof(signature));
+        
+        guint8 ihdr[13];
+        put_u32_be(ihdr, width);
+        put_u32_be(ihdr + 4, height);
+        ihdr[8] = 8;                                  // Bit depth
+        ihdr[9] = encoder.channels == 3 ? 2 : 6;      // Truecolor, with alpha if needed
+        ihdr[10] = 0;                                 // Deflate
+        ihdr[11] = 0;                                 // Adaptive filtering
+        ihdr[12] = 0;                                 // No interlace
+        append_chunk(png, "IHDR", ihdr, sizeof(ihdr));
+        
+        for (gsize offset = 0; offset < zdata->len; offset += IDAT_CHUNK_SIZE) {
+            append_chunk(png, "IDAT", zdata->data + offset, MIN(IDAT_CHUNK_SIZE, zdata->len - offset));
+        }
+        append_chunk(png, "IEND", NULL, 0);
+        
+        g_byte_array_free(zdata, TRUE);
+        result = g_byte_array_free_to_bytes(png);
+    }
+    
+    for (int i = 0; i < encoder.stripe_count; i++) {
+        g_byte_array_free(encoder.stripes[i].output, TRUE);
+    }
+    g_free(encoder.stripes);
+    g_cond_clear(&encoder.cond);
+    g_mutex_clear(&encoder.lock);
+    
+    return result;
+}
+
+GBytes* png_writer_encode_surface(cairo_surface_t* surface, int level, GCancellable* cancellable,
+                                  PngWriterProgressFunc progress, gpointer user_data, GError** error) {
+    if (!surface || cairo_image_surface_get_format(surface) != CAIRO_FORMAT_ARGB32) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Only ARGB32 image surfaces can be encoded");
+        return NULL;
+    }
+    
+    cairo_surface_flush(surface);
+    return png_writer_encode_data(cairo_image_surface_get_data(surface),
+                                  cairo_image_surface_get_width(surface),
+                                  cairo_image_surface_get_height(surface),
+                                  cairo_image_surface_get_stride(surface),
+                                  level, cancellable, progress, user_data, error);
+}
@@ -0,0 +1,123 @@
+#include "../include/raster_undo.h"
+#include <string.h>
+
+static void raster_tile_free(RasterTile* tile) {
+    if (!tile) return;
+    g_free(tile->pixels);
+    g_free(tile);
+}
+
+RasterEdit* raster_edit_begin(cairo_surface_t* surface, guint annotation_count) {
+    if (!surface || cairo_image_surface_get_format(surface) != CAIRO_FORMAT_ARGB32) {
+        return NULL;
+    }
+    
+    RasterEdit* edit = g_new0(RasterEdit, 1);
+    edit->image_width = cairo_image_surface_get_width(surface);
+    edit->image_height = cairo_image_surface_get_height(surface);
+    edit->tiles_x = (edit->image_width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    edit->tiles_y = (edit->image_height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    edit->saved = g_malloc0((gsize)edit->tiles_x * edit->tiles_y);
+    edit->tiles = g_ptr_array_new_with_free_func((GDestroyNotify)raster_tile_free);
+    edit->annotation_count = annotation_count;
+    
+    return edit;
+}
+
+static RasterTile* snapshot_tile(cairo_surface_t* surface, int tile_x, int tile_y) {
+    int image_width = cairo_image_surface_get_width(surface);
+    int image_height = cairo_image_surface_get_height(surface);
+    unsigned char* data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    
+    RasterTile* tile = g_new0(RasterTile, 1);
+    tile->tile_x = tile_x;
+    tile->tile_y = tile_y;
+    tile->width = MIN(RASTER_TILE_SIZE, image_width - tile_x * RASTER_TILE_SIZE);
+    tile->height = MIN(RASTER_TILE_SIZE, image_height - tile_y * RASTER_TILE_SIZE);
+    tile->pixels = g_malloc((gsize)tile->width * tile->height * 4);
+    
+    // Copy the tile row by row out of the surface
+    unsigned char* src = data + (gsize)tile_y * RASTER_TILE_SIZE * stride + tile_x * RASTER_TILE_SIZE * 4;
+    for (int row = 0; row < tile->height; row++) {
+        memcpy(tile->pixels + (gsize)row * tile->width * 4, src + (gsize)row * stride, tile->width * 4);
+    }
+    
+    return tile;
+}
+
+void raster_edit_touch(RasterEdit* edit, cairo_surface_t* surface, int x, int y, int width, int height) {
+    if (!edit || !surface) return;
+    
+    // The edit only applies to the surface it was started on
+    if (cairo_image_surface_get_width(surface) != edit->image_width ||
+        cairo_image_surface_get_height(surface) != edit->image_height) {
+        return;
+    }
+    
+    // Clip the rectangle to the image
+    int x1 = MAX(x, 0);
+    int y1 = MAX(y, 0);
+    int x2 = MIN(x + width, edit->image_width);
+    int y2 = MIN(y + height, edit->image_height);
+    if (x1 >= x2 || y1 >= y2) return;
+    
+    // Make sure pending drawing has reached the pixel data before copying it
+    cairo_surface_flush(surface);
+    
+    for (int ty = y1 / RASTER_TILE_SIZE; ty <= (y2 - 1) / RASTER_TILE_SIZE; ty++) {
+        for (int tx = x1 / RASTER_TILE_SIZE; tx <= (x2 - 1) / RASTER_TILE_SIZE; tx++) {
+            guint8* saved = &edit->saved[ty * edit->tiles_x + tx];
+            if (*saved) continue;  // Already holds the pre-edit pixels
+            
+            g_ptr_array_add(edit->tiles, snapshot_tile(surface, tx, ty));
+            *saved = 1;
+        }
+    }
+}
+
+bool raster_edit_undo(RasterEdit* edit, cairo_surface_t* surface) {
+    if (!edit || !surface) return false;
+    
+    if (cairo_image_surface_get_width(surface) != edit->image_width ||
+        cairo_image_surface_get_height(surface) != edit->image_height) {
+        return false;
+    }
+    
+    cairo_surface_flush(surface);
+    unsigned char* data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    
+    for (guint i = 0; i < edit->tiles->len; i++) {
+        RasterTile* tile = g_ptr_array_index(edit->tiles, i);
+        int x = tile->tile_x * RASTER_TILE_SIZE;
+        int y = tile->tile_y * RASTER_TILE_SIZE;
+        
+        unsigned char* dst = data + (gsize)y * stride + x * 4;
+        for (int row = 0; row < tile->height; row++) {
+            memcpy(dst + (gsize)row * stride, tile->pixels + (gsize)row * tile->width * 4, tile->width * 4);
+        }
+        
+        cairo_surface_mark_dirty_rectangle(surface, x, y, tile->width, tile->height);
+    }
+    
+    return true;
+}
+
+gsize raster_edit_get_size(const RasterEdit* edit) {
+    if (!edit) return 0;
+    
+    gsize size = 0;
+    for (guint i = 0; i < edit->tiles->len; i++) {
+        RasterTile* tile = g_ptr_array_index(edit->tiles, i);
+        size += (gsize)tile->width * tile->height * 4;
+    }
+    return size;
+}
+
+void raster_edit_free(RasterEdit* edit) {
+    if (!edit) return;
+    g_ptr_array_free(edit->tiles, TRUE);
+    g_free(edit->saved);
+    g_free(edit);
+}
@@ -1,6 +1,8 @@
 #include "../include/screen_capture.h"
+#include "../include/surface_pool.h"
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/Xatom.h>
 #include <cairo/cairo-xlib.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -9,6 +11,9 @@ static Display* display = NULL;
 static Window root = 0;
 
 bool capture_init(void) {
+    // Keep the connection of an earlier call
+    if (display) return true;
+    
     display = XOpenDisplay(NULL);
     if (!display) {
         fprintf(stderr, "Unable to open X display\n");
@@ -19,42 +24,25 @@ bool capture_init(void) {
     return true;
 }
 
-cairo_surface_t* capture_screen(CaptureMode mode, CaptureArea* area) {
-    XWindowAttributes wattr;
-    int x = 0, y = 0;
-    int width, height;
-    
-    if (mode == CAPTURE_FULLSCREEN) {
-        XGetWindowAttributes(display, root, &wattr);
-        width = wattr.width;
-        height = wattr.height;
-    } else if (mode == CAPTURE_AREA && area != NULL) {
-        x = area->x;
-        y = area->y;
-        width = area->width;
-        height = area->height;
-    } else {
-        return NULL;
-    }
-    
-    XImage* img = XGetImage(display, root, x, y, width, height, AllPlanes, ZPixmap);
-    if (!img) {
-        fprintf(stderr, "Unable to get image from display\n");
-        return NULL;
+// Copy a 24/32-bit little-endian XImage with the usual RGB masks row by row;
+// only the alpha byte differs from Cairo's ARGB32
+static bool copy_rows_fast(XImage* img, unsigned char* dst, int dst_stride, int width, int height) {
+    if (img->bits_per_pixel != 32 || img->byte_order != LSBFirst ||
+        img->red_mask != 0xff0000 || img->green_mask != 0xff00 || img->blue_mask != 0xff) {
+        return false;
     }
     
-    // Create a Cairo surface from the X image
-    cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
-        fprintf(stderr, "Unable to create Cairo surface\n");
-        XDestroyImage(img);
-        return NULL;
+    for (int j = 0; j < height; j++) {
+        const uint32_t* src_row = (const uint32_t*)(img->data + (size_t)j * img->bytes_per_line);
+        uint32_t* dst_row = (uint32_t*)(dst + (size_t)j * dst_stride);
+        for (int i = 0; i < width; i++) {
+            dst_row[i] = src_row[i] | 0xff000000u;
+        }
     }
-    
-    // Copy the X image data to the Cairo surface
-    unsigned char* cairo_data = cairo_image_surface_get_data(surface);
-    int cairo_stride = cairo_image_surface_get_stride(surface);
-    
+    return true;
+}
+
+static void copy_rows_generic(XImage* img, unsigned char* dst, int dst_stride, int width, int height) {
     // Calculate bit shifts for each color component
     int red_shift = 0, green_shift = 0, blue_shift = 0;
     unsigned long mask;
@@ -83,7 +71,7 @@ cairo_surface_t* capture_screen(CaptureMode mode, CaptureArea* area) {
     for (int j = 0; j < height; j++) {
         for (int i = 0; i < width; i++) {
             unsigned long pixel = XGetPixel(img, i, j);
-            unsigned char* p = cairo_data + j * cairo_stride + i * 4;
+            unsigned char* p = dst + j * dst_stride + i * 4;
             
             // Extract color components using the correct masks and shifts
             p[0] = (pixel & img->blue_mask) >> blue_shift;     // Blue
@@ -92,6 +80,107 @@ cairo_surface_t* capture_screen(CaptureMode mode, CaptureArea* area) {
             p[3] = 0xFF;                                       // Alpha (fully opaque)
         }
     }
+}
+
+// The window manager's active window, or failing that the top-level window
+// under the pointer, as its frame (the child of the root holding it)
+static Window find_target_window(void) {
+    Window window = None;
+    
+    Atom active = XInternAtom(display, "_NET_ACTIVE_WINDOW", True);
+    if (active != None) {
+        Atom type;
+        int format;
+        unsigned long count, remaining;
+        unsigned char* value = NULL;
+        if (XGetWindowProperty(display, root, active, 0, 1, False, XA_WINDOW, &type, &format,
+                               &count, &remaining, &value) == Success && value) {
+            if (type == XA_WINDOW && format == 32 && count == 1) {
+                window = *(Window*)value;
+            }
+            XFree(value);
+        }
+    }
+    
+    if (window == None) {
+        Window root_return, child = None;
+        int root_x, root_y, win_x, win_y;
+        unsigned int mask;
+        XQueryPointer(display, root, &root_return, &child, &root_x, &root_y, &win_x, &win_y, &mask);
+        return child;
+    }
+    
+    // Climb to the frame the window manager put around it
+    for (;;) {
+        Window root_return, parent;
+        Window* children = NULL;
+        unsigned int count;
+        if (!XQueryTree(display, window, &root_return, &parent, &children, &count)) return None;
+        if (children) XFree(children);
+        if (parent == root || parent == None) return window;
+        window = parent;
+    }
+}
+
+cairo_surface_t* capture_screen(CaptureMode mode, CaptureArea* area) {
+    return capture_screen_with_margin(mode, area, 0);
+}
+
+cairo_surface_t* capture_screen_with_margin(CaptureMode mode, CaptureArea* area, int margin) {
+    XWindowAttributes wattr;
+    int x = 0, y = 0;
+    int width, height;
+    
+    if (margin < 0) return NULL;
+    
+    if (mode == CAPTURE_FULLSCREEN) {
+        XGetWindowAttributes(display, root, &wattr);
+        width = wattr.width;
+        height = wattr.height;
+    } else if ((mode == CAPTURE_AREA && area != NULL) || mode == CAPTURE_WINDOW) {
+        CaptureArea window_area;
+        if (mode == CAPTURE_WINDOW) {
+            Window target = find_target_window();
+            if (target == None || !XGetWindowAttributes(display, target, &wattr)) return NULL;
+            window_area = (CaptureArea){ wattr.x, wattr.y, wattr.width + 2 * wattr.border_width,
+                                         wattr.height + 2 * wattr.border_width };
+            area = &window_area;
+        }
+        
+        // XGetImage() fails with a fatal X error outside the root window
+        XGetWindowAttributes(display, root, &wattr);
+        int right = area->x + area->width, bottom = area->y + area->height;
+        x = area->x > 0 ? area->x : 0;
+        y = area->y > 0 ? area->y : 0;
+        width = (right < wattr.width ? right : wattr.width) - x;
+        height = (bottom < wattr.height ? bottom : wattr.height) - y;
+        if (width <= 0 || height <= 0) return NULL;
+    } else {
+        return NULL;
+    }
+    
+    XImage* img = XGetImage(display, root, x, y, width, height, AllPlanes, ZPixmap);
+    if (!img) {
+        fprintf(stderr, "Unable to get image from display\n");
+        return NULL;
+    }
+    
+    // Recycled buffer sized for the image plus its margin
+    cairo_surface_t* surface = surface_pool_acquire(width + 2 * margin, height + 2 * margin);
+    if (!surface) {
+        fprintf(stderr, "Unable to create Cairo surface\n");
+        XDestroyImage(img);
+        return NULL;
+    }
+    
+    // Copy the X image data into the inner rectangle of the surface
+    cairo_surface_flush(surface);
+    int cairo_stride = cairo_image_surface_get_stride(surface);
+    unsigned char* cairo_data = cairo_image_surface_get_data(surface) + (size_t)margin * cairo_stride + margin * 4;
+    
+    if (!copy_rows_fast(img, cairo_data, cairo_stride, width, height)) {
+        copy_rows_generic(img, cairo_data, cairo_stride, width, height);
+    }
     
     cairo_surface_mark_dirty(surface);
     XDestroyImage(img);
@@ -99,6 +188,12 @@ cairo_surface_t* capture_screen(CaptureMode mode, CaptureArea* area) {
     return surface;
 }
 
+bool capture_parse_area(const char* text, CaptureArea* area) {
+    char end;
+    return text && sscanf(text, "%d,%d,%d,%d%c", &area->x, &area->y, &area->width, &area->height, &end) == 4 &&
+           area->width > 0 && area->height > 0;
+}
+
 void capture_cleanup(void) {
     if (display) {
         XCloseDisplay(display);
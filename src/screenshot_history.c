@@ -1,67 +1,427 @@
 #include "../include/screenshot_history.h"
 #include "../include/main_window.h"
+#include "../include/thumbnail.h"
+#include "../include/thumbnail_cache.h"
+#include "../include/history_index.h"
+#include "../include/hash.h"
 #include <dirent.h>
+#include <stdio.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <unistd.h>
 
-#define THUMBNAIL_SIZE 200
+// Finished thumbnails are handed to the main loop at most this often
+#define THUMBNAIL_BATCH_MS 50
+
+// Thumbnails requested this recently count as on screen and are kept even
+// over budget, so a view never evicts what it is drawing
+#define THUMBNAIL_PIN_US G_USEC_PER_SEC
+
+// Queued thumbnails not asked for again within this long are for cells
+// scrolled out of view, and are skipped when their turn comes
+#define THUMBNAIL_STALE_US G_USEC_PER_SEC
+
+// Background jobs hashing entries that have never been shown, kept few so
+// that the view's requests find a free worker
+#define BACKFILL_MAX_JOBS 4
+
+// Directory changes are collected for this long, so a burst of events
+// (a file being written, a batch being copied) is applied in one go
+#define CHANGES_DEBOUNCE_MS 200
+
+typedef struct {
+    ScreenshotHistory* history;
+    char* filepath;
+    gint64 mtime;
+    gint64 size;
+    gint generation;
+    guint sequence;
+    gint64 requested_at;      // Monotonic time of the latest request, under jobs_lock
+    bool skipped;             // Dropped unprocessed as stale
+    bool background;          // Only for the perceptual hash; never stale, delivers no thumbnail
+    GdkPixbuf* thumbnail;
+    gint64 thumbnail_offset;  // Where the cache is expected to have it, updated by the job
+    bool need_metadata;       // Also read the dimensions and hash the file
+    guint32 width;
+    guint32 height;
+    guint64 content_hash;
+    bool need_perceptual_hash;  // Also hash what the thumbnail looks like
+    guint64 perceptual_hash;
+} ThumbnailJob;
+
+typedef struct {
+    guint distance;
+    guint position;
+    ScreenshotEntry* entry;
+} SimilarEntry;
+
+// Most recent first; ties are ordered by path so every entry has exactly
+// one place in the array
+static int compare_entries(const ScreenshotEntry* entry_a, const ScreenshotEntry* entry_b) {
+    if (entry_a->timestamp != entry_b->timestamp) {
+        return entry_a->timestamp > entry_b->timestamp ? -1 : 1;
+    }
+    return strcmp(entry_a->filepath, entry_b->filepath);
+}
 
 static int compare_entries_by_time(gconstpointer a, gconstpointer b) {
-    const ScreenshotEntry* entry_a = a;
-    const ScreenshotEntry* entry_b = b;
-    return (entry_b->timestamp - entry_a->timestamp);  // Most recent first
+    return compare_entries(*(ScreenshotEntry* const*)a, *(ScreenshotEntry* const*)b);
 }
 
-static GdkPixbuf* create_thumbnail(const char* filepath) {
-    GdkPixbuf* original = gdk_pixbuf_new_from_file(filepath, NULL);
-    if (!original) return NULL;
+// Thread pool order: most recent request first
+static int compare_jobs(gconstpointer a, gconstpointer b, gpointer user_data) {
+    (void)user_data;
+    const ThumbnailJob* job_a = a;
+    const ThumbnailJob* job_b = b;
+    if (job_a->sequence == job_b->sequence) return 0;
+    return job_a->sequence > job_b->sequence ? -1 : 1;
+}
+
+// Position of entry in the array, or where it would be inserted
+static guint find_position(ScreenshotHistory* history, const ScreenshotEntry* entry) {
+    guint low = 0, high = history->entries->len;
+    while (low < high) {
+        guint middle = low + (high - low) / 2;
+        if (compare_entries(g_ptr_array_index(history->entries, middle), entry) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Position of the first entry taken at or before timestamp
+static guint find_time(ScreenshotHistory* history, time_t timestamp) {
+    guint low = 0, high = history->entries->len;
+    while (low < high) {
+        guint middle = low + (high - low) / 2;
+        const ScreenshotEntry* entry = g_ptr_array_index(history->entries, middle);
+        if (entry->timestamp > timestamp) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static void insert_sorted(ScreenshotHistory* history, ScreenshotEntry* entry) {
+    g_ptr_array_insert(history->entries, (gint)find_position(history, entry), entry);
+}
+
+static void screenshot_entry_free(ScreenshotEntry* entry) {
+    if (!entry) return;
+    g_free(entry->filepath);
+    if (entry->thumbnail) g_object_unref(entry->thumbnail);
+    g_free(entry);
+}
+
+// List entry under its content hash, if known
+static void add_content(ScreenshotHistory* history, const ScreenshotEntry* entry) {
+    if (!entry->content_hash) return;
     
-    int width = gdk_pixbuf_get_width(original);
-    int height = gdk_pixbuf_get_height(original);
+    guint64* key = g_new(guint64, 1);
+    *key = entry->content_hash;
+    g_mutex_lock(&history->contents_lock);
+    g_hash_table_replace(history->contents, key, g_strdup(entry->filepath));
+    g_mutex_unlock(&history->contents_lock);
+}
+
+// Forget entry's content hash, before it changes or entry goes away
+static void remove_content(ScreenshotHistory* history, const ScreenshotEntry* entry) {
+    if (!entry->content_hash) return;
     
-    // Calculate thumbnail dimensions maintaining aspect ratio
-    double scale_w = (double)THUMBNAIL_SIZE / width;
-    double scale_h = (double)THUMBNAIL_SIZE / height;
-    double scale = MIN(scale_w, scale_h);  // Use the smaller scale to fit within bounds
+    g_mutex_lock(&history->contents_lock);
+    const char* filepath = g_hash_table_lookup(history->contents, &entry->content_hash);
+    if (filepath && strcmp(filepath, entry->filepath) == 0) {
+        g_hash_table_remove(history->contents, &entry->content_hash);
+    }
+    g_mutex_unlock(&history->contents_lock);
+}
+
+static void thumbnail_job_free(ThumbnailJob* job) {
+    g_free(job->filepath);
+    if (job->thumbnail) g_object_unref(job->thumbnail);
+    g_free(job);
+}
+
+// Cached thumbnail of an unchanged file, otherwise a fresh one that is
+// cached. *offset is the expected cache record and is updated.
+static GdkPixbuf* load_thumbnail(const char* filepath, gint64 mtime, gint64 size, gint64* offset) {
+    GdkPixbuf* thumbnail = thumbnail_cache_lookup_at(filepath, mtime, size, offset);
+    if (thumbnail) return thumbnail;
     
-    int thumb_width = width * scale;
-    int thumb_height = height * scale;
+    thumbnail = thumbnail_from_file(filepath);
+    if (thumbnail) {
+        *offset = thumbnail_cache_store(filepath, mtime, size, thumbnail);
+    }
+    return thumbnail;
+}
+
+// Dimensions from the image header and a hash of the whole file
+static void read_metadata(const char* filepath, guint32* width, guint32* height, guint64* content_hash) {
+    int image_width = 0, image_height = 0;
+    if (gdk_pixbuf_get_file_info(filepath, &image_width, &image_height)) {
+        *width = (guint32)image_width;
+        *height = (guint32)image_height;
+    }
+    if (!hash64_file(filepath, content_hash)) {
+        *content_hash = 0;
+    }
+}
+
+static void drop_thumbnail(ScreenshotHistory* history, ScreenshotEntry* entry) {
+    if (!entry->thumbnail) return;
     
-    // Create a new pixbuf with transparent background
-    GdkPixbuf* background = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, THUMBNAIL_SIZE, THUMBNAIL_SIZE);
-    gdk_pixbuf_fill(background, 0x00000000);  // Transparent background (alpha = 0)
+    history->thumbnail_bytes -= gdk_pixbuf_get_byte_length(entry->thumbnail);
+    g_queue_unlink(&history->thumbnail_lru, &entry->lru_link);
+    g_object_unref(entry->thumbnail);
+    entry->thumbnail = NULL;
+}
+
+// Give entry a thumbnail, taking ownership of it, as the most recently used
+static void set_thumbnail(ScreenshotHistory* history, ScreenshotEntry* entry, GdkPixbuf* thumbnail) {
+    drop_thumbnail(history, entry);
     
-    // Scale the original image
-    GdkPixbuf* scaled = gdk_pixbuf_scale_simple(original, 
-                                               thumb_width, 
-                                               thumb_height, 
-                                               GDK_INTERP_BILINEAR);
+    entry->thumbnail = thumbnail;
+    entry->last_used = g_get_monotonic_time();
+    entry->lru_link.data = entry;
+    g_queue_push_head_link(&history->thumbnail_lru, &entry->lru_link);
     
-    // Center the scaled image on the background
-    int x_offset = (THUMBNAIL_SIZE - thumb_width) / 2;
-    int y_offset = (THUMBNAIL_SIZE - thumb_height) / 2;
+    history->thumbnail_bytes += gdk_pixbuf_get_byte_length(thumbnail);
+    history->thumbnail_peak_bytes = MAX(history->thumbnail_peak_bytes, history->thumbnail_bytes);
+}
+
+// Drop least recently used thumbnails until the budget is met or only
+// pinned ones are left
+static void evict_thumbnails(ScreenshotHistory* history) {
+    gint64 pinned_since = g_get_monotonic_time() - THUMBNAIL_PIN_US;
     
-    // Copy the scaled image onto the background, preserving alpha
-    gdk_pixbuf_copy_area(scaled, 0, 0, thumb_width, thumb_height,
-                        background, x_offset, y_offset);
+    while (history->thumbnail_bytes > history->thumbnail_budget) {
+        GList* link = g_queue_peek_tail_link(&history->thumbnail_lru);
+        if (!link) break;
+        
+        // The tail is the oldest; if it is pinned, so is everything else
+        ScreenshotEntry* entry = link->data;
+        if (entry->last_used > pinned_since) break;
+        drop_thumbnail(history, entry);
+    }
+}
+
+// Free every entry along with its thumbnail
+static void clear_entries(ScreenshotHistory* history) {
+    g_hash_table_remove_all(history->index);
+    g_mutex_lock(&history->contents_lock);
+    g_hash_table_remove_all(history->contents);
+    g_mutex_unlock(&history->contents_lock);
+    g_queue_init(&history->thumbnail_lru);
+    history->thumbnail_bytes = 0;
+    for (guint i = 0; i < history->entries->len; i++) {
+        screenshot_entry_free(g_ptr_array_index(history->entries, i));
+    }
+    g_ptr_array_set_size(history->entries, 0);
+}
+
+// Notify the view, then drop entry from the list, the index and memory
+static void remove_entry(ScreenshotHistory* history, ScreenshotEntry* entry) {
+    const ScreenshotHistoryObserver* observer = history->observer;
+    guint position = find_position(history, entry);
+    if (observer && observer->removed) {
+        observer->removed(entry, position, history->observer_data);
+    }
     
-    // Clean up
-    g_object_unref(original);
-    g_object_unref(scaled);
+    drop_thumbnail(history, entry);
+    remove_content(history, entry);
+    g_hash_table_remove(history->index, entry->filepath);
+    g_ptr_array_remove_index(history->entries, position);
+    if (position < history->backfill_position) history->backfill_position--;
+    screenshot_entry_free(entry);
+    history->listing_dirty = true;
+}
+
+// A job loading the thumbnail of entry, and whatever else it lacks
+static ThumbnailJob* new_thumbnail_job(ScreenshotHistory* history, const ScreenshotEntry* entry) {
+    ThumbnailJob* job = g_new0(ThumbnailJob, 1);
+    job->history = history;
+    job->filepath = g_strdup(entry->filepath);
+    job->mtime = entry->mtime;
+    job->size = entry->size;
+    job->generation = g_atomic_int_get(&history->load_generation);
+    job->requested_at = g_get_monotonic_time();
+    job->thumbnail_offset = entry->thumbnail_offset;
+    job->need_metadata = entry->content_hash == 0;
+    job->need_perceptual_hash = !entry->has_perceptual_hash;
+    return job;
+}
+
+// Keep a few background jobs hashing entries that have no perceptual hash
+// yet. They come last in the pool's order (sequence 0), so they only run
+// on workers the view leaves idle.
+static void backfill_perceptual_hashes(ScreenshotHistory* history) {
+    if (!history->thumbnail_pool) return;
     
-    return background;
+    while (history->backfill_jobs < BACKFILL_MAX_JOBS && history->backfill_position < history->entries->len) {
+        ScreenshotEntry* entry = g_ptr_array_index(history->entries, history->backfill_position++);
+        if (entry->has_perceptual_hash) continue;
+        
+        ThumbnailJob* job = new_thumbnail_job(history, entry);
+        job->background = true;
+        history->backfill_jobs++;
+        g_thread_pool_push(history->thumbnail_pool, job, NULL);
+    }
 }
 
-static void screenshot_entry_free(ScreenshotEntry* entry) {
-    if (!entry) return;
-    g_free(entry->filepath);
-    if (entry->thumbnail) g_object_unref(entry->thumbnail);
-    g_free(entry);
+// Take over what job learned about entry's file besides the thumbnail
+static void learn_from_job(ScreenshotHistory* history, ScreenshotEntry* entry, const ThumbnailJob* job) {
+    if (entry->thumbnail_offset != job->thumbnail_offset) {
+        entry->thumbnail_offset = job->thumbnail_offset;
+        history->listing_dirty = true;
+    }
+    if (job->need_metadata && job->content_hash) {
+        remove_content(history, entry);
+        entry->width = job->width;
+        entry->height = job->height;
+        entry->content_hash = job->content_hash;
+        add_content(history, entry);
+        history->listing_dirty = true;
+    }
+    if (job->need_perceptual_hash) {
+        entry->perceptual_hash = job->perceptual_hash;
+        entry->has_perceptual_hash = true;
+        history->listing_dirty = true;
+    }
+}
+
+// Main thread: hand every finished thumbnail to the view
+static gboolean deliver_thumbnails(gpointer data) {
+    ScreenshotHistory* history = data;
+    
+    // Clear the flag first so results finishing meanwhile schedule a new batch
+    g_atomic_int_set(&history->flush_pending, 0);
+    
+    ThumbnailJob* job;
+    while ((job = g_async_queue_try_pop(history->thumbnail_results)) != NULL) {
+        if (g_hash_table_lookup(history->pending_jobs, job->filepath) == job) {
+            g_hash_table_remove(history->pending_jobs, job->filepath);
+        }
+        if (job->background) {
+            history->backfill_jobs--;
+        }
+        ScreenshotEntry* entry = g_hash_table_lookup(history->index, job->filepath);
+        if (job->generation != g_atomic_int_get(&history->load_generation) || !entry) {
+            thumbnail_job_free(job);
+            continue;
+        }
+        
+        // Background work only keeps the hashes, and only for the file as
+        // it was when queued; the thumbnail is left to the cache
+        if (job->background) {
+            if (job->thumbnail && !entry->has_perceptual_hash &&
+                entry->mtime == job->mtime && entry->size == job->size) {
+                learn_from_job(history, entry, job);
+            }
+            thumbnail_job_free(job);
+            continue;
+        }
+        
+        entry->thumbnail_pending = false;
+        if (job->skipped) {
+            // A view still showing it asks again when it redraws
+            const ScreenshotHistoryObserver* observer = history->observer;
+            if (observer && observer->thumbnail_changed) {
+                observer->thumbnail_changed(entry, find_position(history, entry), history->observer_data);
+            }
+        } else if (!entry->thumbnail) {
+            if (job->thumbnail) {
+                set_thumbnail(history, entry, job->thumbnail);
+                job->thumbnail = NULL;
+                
+                // Remember what was learned for the history index
+                learn_from_job(history, entry, job);
+                
+                const ScreenshotHistoryObserver* observer = history->observer;
+                if (observer && observer->thumbnail_changed) {
+                    guint position = find_position(history, entry);
+                    observer->thumbnail_changed(entry, position, history->observer_data);
+                }
+            } else {
+                // Files that are not decodable images do not belong in the history
+                remove_entry(history, entry);
+            }
+        }
+        thumbnail_job_free(job);
+    }
+    
+    evict_thumbnails(history);
+    backfill_perceptual_hashes(history);
+    return G_SOURCE_REMOVE;
+}
+
+// Worker thread: decode and scale one file
+static void run_thumbnail_job(gpointer data, gpointer user_data) {
+    (void)user_data;
+    ThumbnailJob* job = data;
+    ScreenshotHistory* history = job->history;
+    
+    // Skip work queued for a directory that has since been reloaded, or
+    // for cells that have left the screen since
+    g_mutex_lock(&history->jobs_lock);
+    job->skipped = !job->background && g_get_monotonic_time() - job->requested_at > THUMBNAIL_STALE_US;
+    g_mutex_unlock(&history->jobs_lock);
+    if (!job->skipped && job->generation == g_atomic_int_get(&history->load_generation)) {
+        job->thumbnail = load_thumbnail(job->filepath, job->mtime, job->size, &job->thumbnail_offset);
+        if (job->thumbnail && job->need_metadata) {
+            read_metadata(job->filepath, &job->width, &job->height, &job->content_hash);
+        }
+        if (job->thumbnail && job->need_perceptual_hash) {
+            job->perceptual_hash = thumbnail_perceptual_hash(job->thumbnail);
+        }
+    }
+    
+    g_async_queue_push(history->thumbnail_results, job);
+    if (g_atomic_int_compare_and_exchange(&history->flush_pending, 0, 1)) {
+        g_timeout_add(THUMBNAIL_BATCH_MS, deliver_thumbnails, history);
+    }
 }
 
 void screenshot_history_init(ScreenshotHistory* history) {
-    history->entries = NULL;
+    history->entries = g_ptr_array_new();
     history->screenshot_path = g_strdup(g_get_user_special_dir(G_USER_DIRECTORY_PICTURES));
+    history->index = g_hash_table_new(g_str_hash, g_str_equal);
+    history->thumbnail_results = g_async_queue_new();
+    history->load_generation = 0;
+    history->flush_pending = 0;
+    history->request_sequence = 0;
+    history->backfill_position = 0;
+    history->backfill_jobs = 0;
+    history->pending_jobs = g_hash_table_new(g_str_hash, g_str_equal);
+    g_mutex_init(&history->jobs_lock);
+    g_queue_init(&history->thumbnail_lru);
+    history->thumbnail_bytes = 0;
+    history->thumbnail_peak_bytes = 0;
+    history->thumbnail_budget = SCREENSHOT_HISTORY_DEFAULT_THUMBNAIL_BUDGET;
+    history->monitor = NULL;
+    history->pending_changes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    history->changes_source = 0;
+    history->loaded_path = NULL;
+    history->listing_dirty = false;
+    history->contents = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+    g_mutex_init(&history->contents_lock);
+    history->observer = NULL;
+    history->observer_data = NULL;
+    
+    // One decoder per core; what was requested last is likely still on screen
+    history->thumbnail_pool = g_thread_pool_new(run_thumbnail_job, NULL,
+                                                (int)g_get_num_processors(), FALSE, NULL);
+    g_thread_pool_set_sort_function(history->thumbnail_pool, compare_jobs, NULL);
+}
+
+void screenshot_history_set_observer(ScreenshotHistory* history,
+                                     const ScreenshotHistoryObserver* observer, gpointer user_data) {
+    if (!history) return;
+    history->observer = observer;
+    history->observer_data = user_data;
 }
 
 void screenshot_history_set_path(ScreenshotHistory* history, const char* path) {
@@ -70,7 +430,96 @@ void screenshot_history_set_path(ScreenshotHistory* history, const char* path) {
     history->screenshot_path = g_strdup(path);
 }
 
+// Have background hashing come back for entry, whose hash is gone
+static void rewind_backfill(ScreenshotHistory* history, const ScreenshotEntry* entry) {
+    history->backfill_position = MIN(history->backfill_position, find_position(history, entry));
+}
+
+// Add or refresh the entry of filepath from its stat data, as taken at
+// timestamp. thumbnail, if any, is taken over; without one a changed file
+// loses its old thumbnail and gets a new one when next requested.
+// Metadata of the old contents is forgotten.
+static ScreenshotEntry* update_entry(ScreenshotHistory* history, const char* filepath, const struct stat* st,
+                                     time_t timestamp, GdkPixbuf* thumbnail) {
+    const ScreenshotHistoryObserver* observer = history->observer;
+    history->listing_dirty = true;
+    
+    // A file written again (e.g. saved over) keeps its single entry
+    ScreenshotEntry* entry = g_hash_table_lookup(history->index, filepath);
+    if (entry) {
+        guint old_position = find_position(history, entry);
+        if (thumbnail) {
+            set_thumbnail(history, entry, thumbnail);
+        } else {
+            drop_thumbnail(history, entry);
+        }
+        remove_content(history, entry);
+        entry->mtime = st->st_mtime;
+        entry->size = st->st_size;
+        entry->width = entry->height = 0;
+        entry->content_hash = 0;
+        entry->thumbnail_offset = -1;
+        entry->has_perceptual_hash = false;
+        entry->compacted = false;
+        entry->compacting = false;
+        entry->compact_retry = 0;
+        
+        if (entry->timestamp != timestamp) {
+            g_ptr_array_remove_index(history->entries, old_position);
+            entry->timestamp = timestamp;
+            insert_sorted(history, entry);
+            guint new_position = find_position(history, entry);
+            if (new_position != old_position && observer && observer->moved) {
+                observer->moved(entry, old_position, new_position, history->observer_data);
+            }
+        }
+        
+        if (observer && observer->thumbnail_changed) {
+            observer->thumbnail_changed(entry, find_position(history, entry), history->observer_data);
+        }
+        rewind_backfill(history, entry);
+        evict_thumbnails(history);
+        return entry;
+    }
+    
+    // Create new entry
+    entry = g_new0(ScreenshotEntry, 1);
+    entry->filepath = g_strdup(filepath);
+    entry->timestamp = timestamp;
+    entry->mtime = st->st_mtime;
+    entry->size = st->st_size;
+    entry->thumbnail_offset = -1;
+    if (thumbnail) {
+        set_thumbnail(history, entry, thumbnail);
+    }
+    
+    // Insert in order; the position is found by binary search
+    insert_sorted(history, entry);
+    g_hash_table_replace(history->index, entry->filepath, entry);
+    
+    if (observer && observer->inserted) {
+        observer->inserted(entry, find_position(history, entry), history->observer_data);
+    }
+    rewind_backfill(history, entry);
+    evict_thumbnails(history);
+    return entry;
+}
+
+char* screenshot_history_find_content(ScreenshotHistory* history, guint64 content_hash) {
+    if (!history || !content_hash) return NULL;
+    
+    g_mutex_lock(&history->contents_lock);
+    char* filepath = history->contents ? g_strdup(g_hash_table_lookup(history->contents, &content_hash)) : NULL;
+    g_mutex_unlock(&history->contents_lock);
+    return filepath;
+}
+
 void screenshot_history_add(ScreenshotHistory* history, const char* filepath) {
+    screenshot_history_add_with_surface(history, filepath, NULL, 0, 0);
+}
+
+void screenshot_history_add_with_surface(ScreenshotHistory* history, const char* filepath, cairo_surface_t* surface,
+                                         guint64 content_hash, time_t taken) {
     if (!history || !filepath) return;
     
     // Check if file exists and is readable
@@ -80,67 +529,548 @@ void screenshot_history_add(ScreenshotHistory* history, const char* filepath) {
     struct stat st;
     if (stat(filepath, &st) != 0) return;
     
-    // Create new entry
-    ScreenshotEntry* entry = g_new0(ScreenshotEntry, 1);
-    entry->filepath = g_strdup(filepath);
-    entry->timestamp = st.st_mtime;
-    entry->thumbnail = create_thumbnail(filepath);
+    // Downscale the image we still hold in memory; other files come from
+    // the thumbnail cache and are only decoded when new or modified
+    GdkPixbuf* thumbnail;
+    gint64 offset = -1;
+    if (surface) {
+        thumbnail = thumbnail_from_surface(surface);
+        if (thumbnail) {
+            offset = thumbnail_cache_store(filepath, st.st_mtime, st.st_size, thumbnail);
+        }
+    } else {
+        thumbnail = load_thumbnail(filepath, st.st_mtime, st.st_size, &offset);
+    }
+    if (!thumbnail) return;
+    
+    // Without the surface or the hash, both are read along with the next
+    // thumbnail, on a worker
+    ScreenshotEntry* entry = update_entry(history, filepath, &st, MAX(taken, st.st_mtime), thumbnail);
+    entry->thumbnail_offset = offset;
+    if (surface && content_hash) {
+        entry->width = (guint32)cairo_image_surface_get_width(surface);
+        entry->height = (guint32)cairo_image_surface_get_height(surface);
+        entry->content_hash = content_hash;
+        add_content(history, entry);
+    }
+    entry->perceptual_hash = thumbnail_perceptual_hash(thumbnail);
+    entry->has_perceptual_hash = true;
+}
+
+// Whether a directory entry belongs in the history
+static bool is_screenshot_name(const char* name) {
+    // Skip . and .., sidecars and other hidden files
+    if (name[0] == '.') return false;
+    
+    // Partially written exports are renamed into place when complete
+    if (g_str_has_suffix(name, ".part")) return false;
+    
+    // Check if filename starts with "LinShot" or "Screenshot"
+    return strncmp(name, "LinShot", 7) == 0 || strncmp(name, "Screenshot", 9) == 0;
+}
+
+// When the screenshot called name was taken: its mtime, unless the time in its name is
+// later, as for a capture stored as a link to an older identical file
+static time_t taken_time(const char* name, time_t mtime) {
+    const char* stamp = strchr(name, '_');
+    struct tm tm = {0};
+    if (!stamp || sscanf(stamp + 1, "%4d%2d%2d_%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                         &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+        return mtime;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    time_t named = mktime(&tm);
+    return named != (time_t)-1 && named > mtime ? named : mtime;
+}
+
+// List the matching files of a directory, without decoding anything
+static void list_directory(ScreenshotHistory* history, const char* screenshot_dir) {
+    DIR* dir = opendir(screenshot_dir);
+    if (!dir) return;
     
-    if (!entry->thumbnail) {
-        screenshot_entry_free(entry);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (is_screenshot_name(entry->d_name)) {
+            char* filepath = g_build_filename(screenshot_dir, entry->d_name, NULL);
+            struct stat st;
+            if (stat(filepath, &st) != 0 || !S_ISREG(st.st_mode) || access(filepath, R_OK) != 0) {
+                g_free(filepath);
+                continue;
+            }
+            
+            ScreenshotEntry* screenshot = g_new0(ScreenshotEntry, 1);
+            screenshot->filepath = filepath;
+            screenshot->timestamp = taken_time(entry->d_name, st.st_mtime);
+            screenshot->mtime = st.st_mtime;
+            screenshot->size = st.st_size;
+            screenshot->thumbnail_offset = -1;
+            g_ptr_array_add(history->entries, screenshot);
+            g_hash_table_replace(history->index, screenshot->filepath, screenshot);
+        }
+    }
+    
+    closedir(dir);
+}
+
+// Main thread: bring the entries of every changed path in line with the disk
+static gboolean apply_changes(gpointer data) {
+    ScreenshotHistory* history = data;
+    history->changes_source = 0;
+    
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, history->pending_changes);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        const char* filepath = key;
+        ScreenshotEntry* entry = g_hash_table_lookup(history->index, filepath);
+        
+        struct stat st;
+        if (stat(filepath, &st) == 0 && S_ISREG(st.st_mode) && access(filepath, R_OK) == 0) {
+            // Our own saves are already listed by the time their events
+            // arrive, and compacted files are updated when the compactor
+            // reports back, which may be after their events
+            if (entry && entry->mtime == st.st_mtime &&
+                (entry->size == st.st_size || entry->compacting)) continue;
+            update_entry(history, filepath, &st, st.st_mtime, NULL);
+        } else if (entry) {
+            remove_entry(history, entry);
+        }
+    }
+    g_hash_table_remove_all(history->pending_changes);
+    
+    // Changed files have lost their hashes
+    backfill_perceptual_hashes(history);
+    return G_SOURCE_REMOVE;
+}
+
+static void queue_change(ScreenshotHistory* history, GFile* file) {
+    if (!file) return;
+    
+    char* name = g_file_get_basename(file);
+    bool wanted = name && is_screenshot_name(name);
+    g_free(name);
+    if (!wanted) return;
+    
+    char* filepath = g_file_get_path(file);
+    if (!filepath) return;
+    g_hash_table_add(history->pending_changes, filepath);
+    
+    if (!history->changes_source) {
+        history->changes_source = g_timeout_add(CHANGES_DEBOUNCE_MS, apply_changes, history);
+    }
+}
+
+static void on_directory_changed(GFileMonitor* monitor, GFile* file, GFile* other_file,
+                                 GFileMonitorEvent event, gpointer data) {
+    (void)monitor;
+    ScreenshotHistory* history = data;
+    
+    // Only the affected paths are recorded; what happened to them is read
+    // back from the disk when the batch is applied
+    switch (event) {
+        case G_FILE_MONITOR_EVENT_CREATED:
+        case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+        case G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED:
+        case G_FILE_MONITOR_EVENT_DELETED:
+        case G_FILE_MONITOR_EVENT_MOVED_IN:
+        case G_FILE_MONITOR_EVENT_MOVED_OUT:
+            queue_change(history, file);
+            break;
+        case G_FILE_MONITOR_EVENT_RENAMED:
+            queue_change(history, file);
+            queue_change(history, other_file);
+            break;
+        default:
+            // Plain CHANGED events are followed by CHANGES_DONE_HINT
+            break;
+    }
+}
+
+static void stop_monitor(ScreenshotHistory* history) {
+    if (history->monitor) {
+        g_signal_handlers_disconnect_by_data(history->monitor, history);
+        g_file_monitor_cancel(history->monitor);
+        g_object_unref(history->monitor);
+        history->monitor = NULL;
+    }
+    if (history->changes_source) {
+        g_source_remove(history->changes_source);
+        history->changes_source = 0;
+    }
+    if (history->pending_changes) {
+        g_hash_table_remove_all(history->pending_changes);
+    }
+}
+
+static void start_monitor(ScreenshotHistory* history, const char* screenshot_dir) {
+    GFile* dir = g_file_new_for_path(screenshot_dir);
+    GError* error = NULL;
+    history->monitor = g_file_monitor_directory(dir, G_FILE_MONITOR_WATCH_MOVES, NULL, &error);
+    g_object_unref(dir);
+    
+    if (!history->monitor) {
+        g_warning("Cannot watch %s: %s", screenshot_dir, error->message);
+        g_error_free(error);
         return;
     }
+    g_signal_connect(history->monitor, "changed", G_CALLBACK(on_directory_changed), history);
+}
+
+// Take the entries from the history index, which is already in order
+static void read_index(ScreenshotHistory* history, HistoryIndex* listing, const char* screenshot_dir) {
+    guint count = history_index_get_count(listing);
+    for (guint i = 0; i < count; i++) {
+        HistoryIndexRecord record;
+        if (!history_index_get_record(listing, i, &record)) continue;
+        
+        ScreenshotEntry* screenshot = g_new0(ScreenshotEntry, 1);
+        screenshot->filepath = g_build_filename(screenshot_dir, record.name, NULL);
+        screenshot->timestamp = record.timestamp;
+        screenshot->mtime = record.mtime;
+        screenshot->size = record.size;
+        screenshot->width = record.width;
+        screenshot->height = record.height;
+        screenshot->content_hash = record.content_hash;
+        screenshot->thumbnail_offset = record.thumbnail_offset;
+        screenshot->perceptual_hash = record.perceptual_hash;
+        screenshot->has_perceptual_hash = record.has_perceptual_hash;
+        screenshot->compacted = record.compacted;
+        g_ptr_array_add(history->entries, screenshot);
+        g_hash_table_replace(history->index, screenshot->filepath, screenshot);
+        add_content(history, screenshot);
+    }
+}
+
+// Store the entries as the history index of the loaded directory
+static void write_index(ScreenshotHistory* history) {
+    if (!history->listing_dirty || !history->loaded_path) return;
+    
+    // Take the directory time first, then catch up with changes reported
+    // before it; anything later makes the index stale, never wrong
+    gint64 directory_mtime;
+    if (!history_index_get_directory_mtime(history->loaded_path, &directory_mtime)) return;
+    if (history->changes_source) {
+        g_source_remove(history->changes_source);
+        apply_changes(history);
+    }
+    
+    guint count = history->entries->len;
+    HistoryIndexRecord* records = g_new(HistoryIndexRecord, count);
+    for (guint position = 0; position < count; position++) {
+        ScreenshotEntry* entry = g_ptr_array_index(history->entries, position);
+        const char* name = strrchr(entry->filepath, G_DIR_SEPARATOR);
+        records[position] = (HistoryIndexRecord) {
+            .name = name ? name + 1 : entry->filepath,
+            .mtime = entry->mtime,
+            .timestamp = entry->timestamp,
+            .size = entry->size,
+            .width = entry->width,
+            .height = entry->height,
+            .content_hash = entry->content_hash,
+            .thumbnail_offset = entry->thumbnail_offset,
+            .perceptual_hash = entry->perceptual_hash,
+            .has_perceptual_hash = entry->has_perceptual_hash,
+            .compacted = entry->compacted,
+        };
+    }
     
-    // Add to list
-    history->entries = g_list_insert_sorted(history->entries, 
-                                          entry, 
-                                          compare_entries_by_time);
+    GError* error = NULL;
+    if (history_index_write(history->loaded_path, directory_mtime, records, count, &error)) {
+        history->listing_dirty = false;
+    } else {
+        g_warning("Failed to write history index: %s", error ? error->message : "unknown error");
+        if (error) g_error_free(error);
+    }
+    g_free(records);
 }
 
 void screenshot_history_load(ScreenshotHistory* history) {
     if (!history) return;
     
-    // Clean up existing entries first
-    g_list_free_full(history->entries, (GDestroyNotify)screenshot_entry_free);
-    history->entries = NULL;
+    // Keep what was learned about the previous directory, then clean up
+    // existing entries; their queued jobs become stale
+    write_index(history);
+    stop_monitor(history);
+    g_atomic_int_inc(&history->load_generation);
+    clear_entries(history);
     
     // Get the screenshot directory from settings
     const char* screenshot_dir = history->screenshot_path;
     if (!screenshot_dir) {
         // Fallback to Downloads directory if no path is set
         screenshot_dir = g_get_user_special_dir(G_USER_DIRECTORY_DOWNLOAD);
-        if (!screenshot_dir) return;
     }
+    g_free(history->loaded_path);
+    history->loaded_path = g_strdup(screenshot_dir);
     
-    DIR* dir = opendir(screenshot_dir);
-    if (!dir) return;
+    if (screenshot_dir) {
+        // Watch before listing so nothing created in between is missed
+        start_monitor(history, screenshot_dir);
+        
+        // An index written since the directory last changed saves listing
+        // and stat'ing every file
+        HistoryIndex* listing = history_index_open(screenshot_dir);
+        if (listing) {
+            read_index(history, listing, screenshot_dir);
+            history_index_close(listing);
+            history->listing_dirty = false;
+        } else {
+            list_directory(history, screenshot_dir);
+            history->listing_dirty = true;
+        }
+        
+        // Sort once, O(n log n); the index is normally in order already, but
+        // the array must be for binary searches to hold. Thumbnails are only
+        // decoded once a view asks for them.
+        g_ptr_array_sort(history->entries, compare_entries_by_time);
+    }
     
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip . and ..
-        if (entry->d_name[0] == '.') continue;
+    // Hash what has never been shown in the background, so finding
+    // similar screenshots covers the whole directory
+    history->backfill_position = 0;
+    backfill_perceptual_hashes(history);
+    
+    if (history->observer && history->observer->reset) {
+        history->observer->reset(history->observer_data);
+    }
+}
+
+void screenshot_history_request_thumbnail(ScreenshotHistory* history, ScreenshotEntry* entry) {
+    if (!history || !entry) return;
+    
+    if (entry->thumbnail) {
+        entry->last_used = g_get_monotonic_time();
+        g_queue_unlink(&history->thumbnail_lru, &entry->lru_link);
+        g_queue_push_head_link(&history->thumbnail_lru, &entry->lru_link);
+        return;
+    }
+    if (!history->thumbnail_pool) return;
+    
+    // Still wanted: keep the queued job from being skipped as stale
+    if (entry->thumbnail_pending) {
+        ThumbnailJob* pending = g_hash_table_lookup(history->pending_jobs, entry->filepath);
+        if (pending) {
+            g_mutex_lock(&history->jobs_lock);
+            pending->requested_at = g_get_monotonic_time();
+            g_mutex_unlock(&history->jobs_lock);
+        }
+        return;
+    }
+    
+    ThumbnailJob* job = new_thumbnail_job(history, entry);
+    job->sequence = ++history->request_sequence;
+    entry->thumbnail_pending = true;
+    g_hash_table_replace(history->pending_jobs, job->filepath, job);
+    g_thread_pool_push(history->thumbnail_pool, job, NULL);
+}
+
+static guint hamming_distance(guint64 a, guint64 b) {
+#if defined(__GNUC__)
+    return (guint)__builtin_popcountll(a ^ b);
+#else
+    guint count = 0;
+    for (guint64 bits = a ^ b; bits; bits &= bits - 1) count++;
+    return count;
+#endif
+}
+
+// Nearest first, then in history order
+static int compare_similar(gconstpointer a, gconstpointer b) {
+    const SimilarEntry* similar_a = a;
+    const SimilarEntry* similar_b = b;
+    if (similar_a->distance != similar_b->distance) {
+        return similar_a->distance < similar_b->distance ? -1 : 1;
+    }
+    if (similar_a->position == similar_b->position) return 0;
+    return similar_a->position < similar_b->position ? -1 : 1;
+}
+
+GPtrArray* screenshot_history_find_similar(ScreenshotHistory* history, ScreenshotEntry* entry,
+                                           guint max_distance) {
+    if (!history || !entry || !entry->has_perceptual_hash) return NULL;
+    
+    // A linear scan is a popcount per entry, a few milliseconds for 100k
+    // entries, and needs no structure to keep in sync with the history
+    GArray* matches = g_array_new(FALSE, FALSE, sizeof(SimilarEntry));
+    for (guint i = 0; i < history->entries->len; i++) {
+        ScreenshotEntry* candidate = g_ptr_array_index(history->entries, i);
+        if (!candidate->has_perceptual_hash) continue;
         
-        // Check if filename starts with "LinShot" or "Screenshot"
-        if (strncmp(entry->d_name, "LinShot", 7) == 0 || 
-            strncmp(entry->d_name, "Screenshot", 9) == 0) {
-            char* filepath = g_build_filename(screenshot_dir, entry->d_name, NULL);
-            screenshot_history_add(history, filepath);
-            g_free(filepath);
+        guint distance = hamming_distance(candidate->perceptual_hash, entry->perceptual_hash);
+        if (distance <= max_distance) {
+            SimilarEntry match = { distance, i, candidate };
+            g_array_append_val(matches, match);
         }
     }
+    g_array_sort(matches, compare_similar);
     
-    closedir(dir);
+    GPtrArray* similar = g_ptr_array_sized_new(matches->len);
+    for (guint i = 0; i < matches->len; i++) {
+        g_ptr_array_add(similar, g_array_index(matches, SimilarEntry, i).entry);
+    }
+    g_array_free(matches, TRUE);
+    return similar;
+}
+
+// The compactor is done with entry: apply whatever change to the file
+// was held back meanwhile
+static void release_compacting(ScreenshotHistory* history, ScreenshotEntry* entry) {
+    entry->compacting = false;
+    
+    struct stat st;
+    if (stat(entry->filepath, &st) == 0 && (st.st_mtime != entry->mtime || st.st_size != entry->size)) {
+        update_entry(history, entry->filepath, &st, st.st_mtime, NULL);
+    }
+}
+
+void screenshot_history_compacting(ScreenshotHistory* history, ScreenshotEntry* entry) {
+    if (!history || !entry) return;
+    entry->compacting = true;
+}
+
+void screenshot_history_compact_failed(ScreenshotHistory* history, const char* filepath, time_t retry_after) {
+    if (!history || !filepath) return;
+    
+    ScreenshotEntry* entry = g_hash_table_lookup(history->index, filepath);
+    if (!entry) return;
+    
+    // A change held back meanwhile makes it worth trying again right away
+    entry->compact_retry = retry_after;
+    if (entry->compacting) {
+        release_compacting(history, entry);
+    }
+}
+
+void screenshot_history_compacted(ScreenshotHistory* history, const char* filepath, bool replaced,
+                                  guint64 content_hash) {
+    if (!history || !filepath) return;
+    
+    ScreenshotEntry* entry = g_hash_table_lookup(history->index, filepath);
+    if (!entry) return;
+    
+    // Only the size changed, with the entry left alone since the swap; a
+    // file changed some other way meanwhile is updated as usual
+    struct stat st;
+    if (!replaced || stat(filepath, &st) != 0 || st.st_mtime != entry->mtime) {
+        entry->compacted = true;
+        history->listing_dirty = true;
+        release_compacting(history, entry);
+        return;
+    }
+    entry->compacting = false;
+    entry->compacted = true;
+    history->listing_dirty = true;
+    
+    GdkPixbuf* thumbnail = entry->thumbnail ? g_object_ref(entry->thumbnail) :
+                           thumbnail_cache_lookup_at(filepath, entry->mtime, entry->size,
+                                                     &entry->thumbnail_offset);
+    remove_content(history, entry);
+    entry->size = st.st_size;
+    entry->content_hash = content_hash;
+    add_content(history, entry);
+    entry->thumbnail_offset = -1;
+    if (thumbnail) {
+        entry->thumbnail_offset = thumbnail_cache_store(filepath, entry->mtime, entry->size, thumbnail);
+        g_object_unref(thumbnail);
+    }
+}
+
+void screenshot_history_set_thumbnail_budget(ScreenshotHistory* history, gsize bytes) {
+    if (!history) return;
+    history->thumbnail_budget = bytes;
+    evict_thumbnails(history);
+}
+
+void screenshot_history_get_thumbnail_memory(ScreenshotHistory* history, gsize* current, gsize* peak) {
+    if (current) *current = history ? history->thumbnail_bytes : 0;
+    if (peak) *peak = history ? history->thumbnail_peak_bytes : 0;
 }
 
 void screenshot_history_cleanup(ScreenshotHistory* history) {
     if (!history) return;
-    g_list_free_full(history->entries, (GDestroyNotify)screenshot_entry_free);
-    history->entries = NULL;
+    
+    write_index(history);
+    stop_monitor(history);
+    if (history->pending_changes) {
+        g_hash_table_destroy(history->pending_changes);
+        history->pending_changes = NULL;
+    }
+    
+    // Queued thumbnail jobs are made stale, so the pool runs through them
+    // without decoding and hands them all back to be freed
+    g_atomic_int_inc(&history->load_generation);
+    if (history->thumbnail_pool) {
+        g_thread_pool_free(history->thumbnail_pool, FALSE, TRUE);
+        history->thumbnail_pool = NULL;
+    }
+    if (history->pending_jobs) {
+        g_hash_table_destroy(history->pending_jobs);
+        history->pending_jobs = NULL;
+        g_mutex_clear(&history->jobs_lock);
+    }
+    if (g_atomic_int_get(&history->flush_pending)) {
+        g_source_remove_by_user_data(history);
+        history->flush_pending = 0;
+    }
+    if (history->thumbnail_results) {
+        ThumbnailJob* job;
+        while ((job = g_async_queue_try_pop(history->thumbnail_results)) != NULL) {
+            thumbnail_job_free(job);
+        }
+        g_async_queue_unref(history->thumbnail_results);
+        history->thumbnail_results = NULL;
+    }
+    
+    if (history->index) {
+        clear_entries(history);
+        g_hash_table_destroy(history->index);
+        history->index = NULL;
+        g_ptr_array_free(history->entries, TRUE);
+        history->entries = NULL;
+    }
+    if (history->contents) {
+        g_hash_table_destroy(history->contents);
+        history->contents = NULL;
+        g_mutex_clear(&history->contents_lock);
+    }
     g_free(history->screenshot_path);
     history->screenshot_path = NULL;
+    g_free(history->loaded_path);
+    history->loaded_path = NULL;
+    
+    thumbnail_cache_close();
+}
+
+guint screenshot_history_get_count(ScreenshotHistory* history) {
+    return history && history->entries ? history->entries->len : 0;
+}
+
+guint screenshot_history_get_position(ScreenshotHistory* history, ScreenshotEntry* entry) {
+    if (!history || !history->entries || !entry) return 0;
+    
+    guint position = find_position(history, entry);
+    if (position < history->entries->len && g_ptr_array_index(history->entries, position) == entry) {
+        return position;
+    }
+    return history->entries->len;
 }
 
-GList* screenshot_history_get_sorted(ScreenshotHistory* history) {
-    if (!history) return NULL;
-    return history->entries;  // Already sorted when adding entries
+ScreenshotEntry* const* screenshot_history_get_sorted(ScreenshotHistory* history,
+                                                      const ScreenshotHistoryQuery* query, guint* count) {
+    *count = 0;
+    if (!history || !history->entries) return NULL;
+    
+    // Already sorted, so the matching entries are one contiguous run
+    guint start = 0, end = history->entries->len;
+    if (query) {
+        if (query->before) start = find_time(history, query->before - 1);
+        if (query->after) end = MAX(start, find_time(history, query->after));
+        start = query->offset < end - start ? start + query->offset : end;
+        if (query->limit && query->limit < end - start) end = start + query->limit;
+    }
+    
+    *count = end - start;
+    return (ScreenshotEntry* const*)history->entries->pdata + start;
 } 
\ No newline at end of file
@@ -0,0 +1,133 @@
+#include "../include/surface_pool.h"
+#include <glib.h>
+
+// Buffers are rounded up to size classes of 1/8 of their power of two, so
+// captures of slightly different sizes can share them
+#define POOL_CLASS_STEPS 8
+// Largest amount of idle memory the pool keeps
+#define POOL_MAX_BYTES ((size_t)192 * 1024 * 1024)
+// A parked buffer is only reused for requests at least this fraction of its size
+#define POOL_MIN_FILL 2
+
+typedef struct {
+    void* data;
+    size_t capacity;
+} PoolBuffer;
+
+static GMutex pool_lock;
+static GPtrArray* free_buffers = NULL;  // PoolBuffer*, most recently released last
+static size_t cached_bytes = 0;
+
+static const cairo_user_data_key_t pool_buffer_key;
+
+static size_t size_class(size_t size) {
+    size_t power = 1;
+    while (power < size) {
+        power <<= 1;
+    }
+    
+    size_t step = power / (2 * POOL_CLASS_STEPS);
+    if (step == 0) return power;
+    return (size + step - 1) / step * step;
+}
+
+static void pool_buffer_free(PoolBuffer* buffer) {
+    g_free(buffer->data);
+    g_free(buffer);
+}
+
+// Drop the oldest parked buffers until the pool fits in its budget
+static void evict_locked(size_t budget) {
+    while (cached_bytes > budget && free_buffers->len > 0) {
+        PoolBuffer* buffer = g_ptr_array_index(free_buffers, 0);
+        g_ptr_array_remove_index(free_buffers, 0);
+        cached_bytes -= buffer->capacity;
+        pool_buffer_free(buffer);
+    }
+}
+
+static void release_buffer(void* data) {
+    PoolBuffer* buffer = data;
+    
+    if (buffer->capacity > POOL_MAX_BYTES) {
+        pool_buffer_free(buffer);
+        return;
+    }
+    
+    g_mutex_lock(&pool_lock);
+    if (!free_buffers) {
+        free_buffers = g_ptr_array_new();
+    }
+    evict_locked(POOL_MAX_BYTES - buffer->capacity);
+    g_ptr_array_add(free_buffers, buffer);
+    cached_bytes += buffer->capacity;
+    g_mutex_unlock(&pool_lock);
+}
+
+// Best fit among parked buffers that are not much larger than needed
+static PoolBuffer* take_buffer(size_t size) {
+    PoolBuffer* best = NULL;
+    guint best_index = 0;
+    
+    g_mutex_lock(&pool_lock);
+    for (guint i = 0; free_buffers && i < free_buffers->len; i++) {
+        PoolBuffer* buffer = g_ptr_array_index(free_buffers, i);
+        if (buffer->capacity < size || buffer->capacity / POOL_MIN_FILL > size) continue;
+        if (!best || buffer->capacity < best->capacity) {
+            best = buffer;
+            best_index = i;
+        }
+    }
+    if (best) {
+        g_ptr_array_remove_index(free_buffers, best_index);
+        cached_bytes -= best->capacity;
+    }
+    g_mutex_unlock(&pool_lock);
+    
+    return best;
+}
+
+cairo_surface_t* surface_pool_acquire(int width, int height) {
+    if (width <= 0 || height <= 0) return NULL;
+    
+    int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+    if (stride < 0) return NULL;
+    size_t size = (size_t)stride * height;
+    
+    PoolBuffer* buffer = take_buffer(size);
+    if (!buffer) {
+        buffer = g_new(PoolBuffer, 1);
+        buffer->capacity = size_class(size);
+        buffer->data = g_try_malloc(buffer->capacity);
+        if (!buffer->data) {
+            g_free(buffer);
+            return NULL;
+        }
+    }
+    
+    cairo_surface_t* surface = cairo_image_surface_create_for_data(buffer->data, CAIRO_FORMAT_ARGB32,
+                                                                   width, height, stride);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ||
+        cairo_surface_set_user_data(surface, &pool_buffer_key, buffer, release_buffer) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        release_buffer(buffer);
+        return NULL;
+    }
+    
+    return surface;
+}
+
+size_t surface_pool_get_cached_bytes(void) {
+    g_mutex_lock(&pool_lock);
+    size_t bytes = cached_bytes;
+    g_mutex_unlock(&pool_lock);
+    return bytes;
+}
+
+void surface_pool_trim(void) {
+    g_mutex_lock(&pool_lock);
+    if (free_buffers) {
+        evict_locked(0);
+    }
+    g_mutex_unlock(&pool_lock);
+}
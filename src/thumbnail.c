@@ -0,0 +1,439 @@
+#include "../include/thumbnail.h"
+#include <png.h>
+#include <jpeglib.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Every thumbnail goes through a streaming box filter: source rows are
+ * pushed one at a time as 4-channel premultiplied pixels, summed into one
+ * row of accumulators, and written out whenever a band of source rows is
+ * complete. Decoders therefore never need more than one source row.
+ */
+typedef struct {
+    int src_width, src_height;
+    int dst_width, dst_height;
+    int red, green, blue;  // Source channel holding each colour; alpha is the fourth
+    int* x_bounds;         // dst_width + 1 source column boundaries
+    guint32* sums;         // Channel sums of the output row being accumulated
+    int src_y;             // Source rows pushed so far
+    int dst_y;             // Output rows written so far
+    GdkPixbuf* out;
+} BoxScaler;
+
+// Fit width x height inside THUMBNAIL_SIZE, keeping the aspect ratio; images
+// that already fit keep their size
+static void thumbnail_dimensions(int width, int height, int* thumb_width, int* thumb_height) {
+    double scale_w = (double)THUMBNAIL_SIZE / width;
+    double scale_h = (double)THUMBNAIL_SIZE / height;
+    double scale = MIN(1.0, MIN(scale_w, scale_h));  // Use the smaller scale to fit within bounds
+    
+    *thumb_width = MAX(1, (int)(width * scale));
+    *thumb_height = MAX(1, (int)(height * scale));
+}
+
+static bool box_scaler_init(BoxScaler* scaler, int src_width, int src_height,
+                            int dst_width, int dst_height, int red, int green, int blue) {
+    memset(scaler, 0, sizeof(*scaler));
+    if (src_width <= 0 || src_height <= 0) return false;
+    
+    scaler->src_width = src_width;
+    scaler->src_height = src_height;
+    scaler->dst_width = CLAMP(dst_width, 1, src_width);
+    scaler->dst_height = CLAMP(dst_height, 1, src_height);
+    scaler->red = red;
+    scaler->green = green;
+    scaler->blue = blue;
+    
+    scaler->out = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, scaler->dst_width, scaler->dst_height);
+    if (!scaler->out) return false;
+    
+    scaler->x_bounds = g_new(int, scaler->dst_width + 1);
+    for (int tx = 0; tx <= scaler->dst_width; tx++) {
+        scaler->x_bounds[tx] = (int)((gint64)tx * src_width / scaler->dst_width);
+    }
+    scaler->sums = g_new0(guint32, (gsize)scaler->dst_width * 4);
+    return true;
+}
+
+static void box_scaler_clear(BoxScaler* scaler) {
+    g_free(scaler->x_bounds);
+    g_free(scaler->sums);
+    if (scaler->out) g_object_unref(scaler->out);
+    memset(scaler, 0, sizeof(*scaler));
+}
+
+// Add the four channels of count pixels to sums
+static void sum_pixels(const guint8* src, int count, guint32 sums[4]) {
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_loadu_si128((const __m128i*)sums);
+    int i = 0;
+    
+    // Two pixels per step: widen to 16 bits, fold the pair, widen to 32 bits
+    for (; i + 2 <= count; i += 2) {
+        __m128i px = _mm_loadl_epi64((const __m128i*)(src + i * 4));
+        __m128i px16 = _mm_unpacklo_epi8(px, zero);
+        __m128i pair = _mm_add_epi16(px16, _mm_srli_si128(px16, 8));
+        acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(pair, zero));
+    }
+    for (; i < count; i++) {
+        guint32 pixel;
+        memcpy(&pixel, src + i * 4, sizeof(pixel));
+        __m128i px = _mm_cvtsi32_si128((int)pixel);
+        acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(_mm_unpacklo_epi8(px, zero), zero));
+    }
+    
+    _mm_storeu_si128((__m128i*)sums, acc);
+#else
+    for (int i = 0; i < count; i++) {
+        sums[0] += src[i * 4 + 0];
+        sums[1] += src[i * 4 + 1];
+        sums[2] += src[i * 4 + 2];
+        sums[3] += src[i * 4 + 3];
+    }
+#endif
+}
+
+// Average the accumulated band into one output row, unpremultiplying once
+static void box_scaler_emit_row(BoxScaler* scaler, int band_height) {
+    guint8* out_row = gdk_pixbuf_get_pixels(scaler->out) + (gsize)scaler->dst_y * gdk_pixbuf_get_rowstride(scaler->out);
+    
+    for (int tx = 0; tx < scaler->dst_width; tx++) {
+        guint32* sums = scaler->sums + tx * 4;
+        guint32 count = (guint32)(scaler->x_bounds[tx + 1] - scaler->x_bounds[tx]) * (guint32)band_height;
+        guint32 alpha = (sums[3] + count / 2) / count;
+        guint8* p = out_row + tx * 4;
+        
+        if (alpha == 0) {
+            memset(p, 0, 4);
+        } else {
+            guint64 divisor = (guint64)count * alpha;
+            p[0] = MIN(255, ((guint64)sums[scaler->red] * 255 + divisor / 2) / divisor);
+            p[1] = MIN(255, ((guint64)sums[scaler->green] * 255 + divisor / 2) / divisor);
+            p[2] = MIN(255, ((guint64)sums[scaler->blue] * 255 + divisor / 2) / divisor);
+            p[3] = alpha;
+        }
+        memset(sums, 0, 4 * sizeof(guint32));
+    }
+    
+    scaler->dst_y++;
+}
+
+static void box_scaler_push_row(BoxScaler* scaler, const guint8* row) {
+    if (scaler->src_y >= scaler->src_height) return;
+    
+    for (int tx = 0; tx < scaler->dst_width; tx++) {
+        int x0 = scaler->x_bounds[tx];
+        sum_pixels(row + (gsize)x0 * 4, scaler->x_bounds[tx + 1] - x0, scaler->sums + tx * 4);
+    }
+    scaler->src_y++;
+    
+    // Output rows cover consecutive bands of source rows
+    int band_start = (int)((gint64)scaler->dst_y * scaler->src_height / scaler->dst_height);
+    int band_end = (int)((gint64)(scaler->dst_y + 1) * scaler->src_height / scaler->dst_height);
+    if (scaler->src_y == band_end) {
+        box_scaler_emit_row(scaler, band_end - band_start);
+    }
+}
+
+// Hand over the finished thumbnail, or NULL if rows are missing
+static GdkPixbuf* box_scaler_finish(BoxScaler* scaler) {
+    GdkPixbuf* thumbnail = NULL;
+    if (scaler->dst_y == scaler->dst_height) {
+        thumbnail = scaler->out;
+        scaler->out = NULL;
+    }
+    box_scaler_clear(scaler);
+    return thumbnail;
+}
+
+GdkPixbuf* thumbnail_from_surface(cairo_surface_t* surface) {
+    if (!surface || cairo_image_surface_get_format(surface) != CAIRO_FORMAT_ARGB32) return NULL;
+    
+    cairo_surface_flush(surface);
+    const guint8* data = cairo_image_surface_get_data(surface);
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    if (!data) return NULL;
+    
+    int thumb_width, thumb_height;
+    thumbnail_dimensions(width, height, &thumb_width, &thumb_height);
+    
+    // Cairo keeps premultiplied B, G, R, A in memory on little-endian hosts
+    BoxScaler scaler;
+    if (!box_scaler_init(&scaler, width, height, thumb_width, thumb_height, 2, 1, 0)) {
+        box_scaler_clear(&scaler);
+        return NULL;
+    }
+    for (int y = 0; y < height; y++) {
+        box_scaler_push_row(&scaler, data + (gsize)y * stride);
+    }
+    return box_scaler_finish(&scaler);
+}
+
+// PNG: decode row by row, premultiplying each row before it is summed.
+// Interlaced files cannot be streamed and are left to gdk-pixbuf.
+typedef struct {
+    png_structp png;
+    png_infop info;
+    BoxScaler scaler;
+    guint8* row;
+    GdkPixbuf* thumbnail;
+} PngThumbnail;
+
+static GdkPixbuf* thumbnail_from_png(FILE* file) {
+    // Everything that changes after setjmp() lives on the heap
+    PngThumbnail* state = g_new0(PngThumbnail, 1);
+    
+    state->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (state->png) {
+        state->info = png_create_info_struct(state->png);
+    }
+    if (!state->info || setjmp(png_jmpbuf(state->png))) {
+        goto out;
+    }
+    
+    png_init_io(state->png, file);
+    png_read_info(state->png, state->info);
+    
+    png_uint_32 width = png_get_image_width(state->png, state->info);
+    png_uint_32 height = png_get_image_height(state->png, state->info);
+    if (png_get_interlace_type(state->png, state->info) != PNG_INTERLACE_NONE ||
+        width > G_MAXINT / 4 || height > G_MAXINT) {
+        goto out;
+    }
+    
+    // Everything becomes 8-bit RGBA
+    png_set_expand(state->png);
+    png_set_strip_16(state->png);
+    png_set_gray_to_rgb(state->png);
+    png_set_add_alpha(state->png, 0xff, PNG_FILLER_AFTER);
+    png_read_update_info(state->png, state->info);
+    if (png_get_rowbytes(state->png, state->info) != (gsize)width * 4) {
+        goto out;
+    }
+    
+    int thumb_width, thumb_height;
+    thumbnail_dimensions(width, height, &thumb_width, &thumb_height);
+    if (!box_scaler_init(&state->scaler, width, height, thumb_width, thumb_height, 0, 1, 2)) {
+        goto out;
+    }
+    state->row = g_malloc((gsize)width * 4);
+    
+    for (png_uint_32 y = 0; y < height; y++) {
+        png_read_row(state->png, state->row, NULL);
+        
+        guint8* p = state->row;
+        for (png_uint_32 x = 0; x < width; x++, p += 4) {
+            guint8 alpha = p[3];
+            if (alpha != 0xff) {
+                p[0] = (p[0] * alpha + 127) / 255;
+                p[1] = (p[1] * alpha + 127) / 255;
+                p[2] = (p[2] * alpha + 127) / 255;
+            }
+        }
+        box_scaler_push_row(&state->scaler, state->row);
+    }
+    state->thumbnail = box_scaler_finish(&state->scaler);
+    
+out:
+    box_scaler_clear(&state->scaler);
+    png_destroy_read_struct(&state->png, state->info ? &state->info : NULL, NULL);
+    g_free(state->row);
+    GdkPixbuf* thumbnail = state->thumbnail;
+    g_free(state);
+    return thumbnail;
+}
+
+// JPEG: let libjpeg decode at 1/2, 1/4 or 1/8 scale straight from the DCT
+// coefficients, then box-filter the rest of the way
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+} JpegErrorHandler;
+
+typedef struct {
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorHandler error;
+    BoxScaler scaler;
+    guint8* scanline;
+    guint8* row;
+    GdkPixbuf* thumbnail;
+} JpegThumbnail;
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    JpegErrorHandler* handler = (JpegErrorHandler*)cinfo->err;
+    longjmp(handler->jump, 1);
+}
+
+static void jpeg_output_message(j_common_ptr cinfo) {
+    (void)cinfo;  // Corrupt-data warnings are not worth a console line per thumbnail
+}
+
+static GdkPixbuf* thumbnail_from_jpeg(FILE* file) {
+    // Everything that changes after setjmp() lives on the heap
+    JpegThumbnail* state = g_new0(JpegThumbnail, 1);
+    
+    state->cinfo.err = jpeg_std_error(&state->error.pub);
+    state->error.pub.error_exit = jpeg_error_exit;
+    state->error.pub.output_message = jpeg_output_message;
+    if (setjmp(state->error.jump)) {
+        goto out;
+    }
+    
+    jpeg_create_decompress(&state->cinfo);
+    jpeg_stdio_src(&state->cinfo, file);
+    jpeg_read_header(&state->cinfo, TRUE);
+    
+    J_COLOR_SPACE color_space = state->cinfo.jpeg_color_space;
+    if (color_space == JCS_GRAYSCALE) {
+        state->cinfo.out_color_space = JCS_GRAYSCALE;
+    } else if (color_space == JCS_YCbCr || color_space == JCS_RGB) {
+        state->cinfo.out_color_space = JCS_RGB;
+    } else {
+        goto out;  // CMYK and friends go through gdk-pixbuf
+    }
+    
+    int thumb_width, thumb_height;
+    thumbnail_dimensions(state->cinfo.image_width, state->cinfo.image_height, &thumb_width, &thumb_height);
+    
+    // Largest reduction that still leaves at least the thumbnail size
+    unsigned int denom = 8;
+    while (denom > 1 &&
+           ((state->cinfo.image_width + denom - 1) / denom < (unsigned int)thumb_width ||
+            (state->cinfo.image_height + denom - 1) / denom < (unsigned int)thumb_height)) {
+        denom /= 2;
+    }
+    state->cinfo.scale_num = 1;
+    state->cinfo.scale_denom = denom;
+    state->cinfo.dct_method = JDCT_IFAST;
+    state->cinfo.do_fancy_upsampling = FALSE;
+    
+    jpeg_start_decompress(&state->cinfo);
+    
+    int width = state->cinfo.output_width;
+    int height = state->cinfo.output_height;
+    int components = state->cinfo.output_components;
+    if (!box_scaler_init(&state->scaler, width, height, thumb_width, thumb_height, 0, 1, 2)) {
+        goto out;
+    }
+    state->scanline = g_malloc((gsize)width * components);
+    state->row = g_malloc((gsize)width * 4);
+    
+    while (state->cinfo.output_scanline < state->cinfo.output_height) {
+        JSAMPROW scanline = state->scanline;
+        jpeg_read_scanlines(&state->cinfo, &scanline, 1);
+        
+        const guint8* src = state->scanline;
+        guint8* dst = state->row;
+        for (int x = 0; x < width; x++, src += components, dst += 4) {
+            dst[0] = src[0];
+            dst[1] = src[components > 1 ? 1 : 0];
+            dst[2] = src[components > 2 ? 2 : 0];
+            dst[3] = 0xff;
+        }
+        box_scaler_push_row(&state->scaler, state->row);
+    }
+    jpeg_finish_decompress(&state->cinfo);
+    state->thumbnail = box_scaler_finish(&state->scaler);
+    
+out:
+    box_scaler_clear(&state->scaler);
+    jpeg_destroy_decompress(&state->cinfo);
+    g_free(state->scanline);
+    g_free(state->row);
+    GdkPixbuf* thumbnail = state->thumbnail;
+    g_free(state);
+    return thumbnail;
+}
+
+// Formats without a streaming path: gdk-pixbuf scales while loading
+static GdkPixbuf* thumbnail_from_pixbuf_loader(const char* filepath) {
+    int width, height;
+    if (!gdk_pixbuf_get_file_info(filepath, &width, &height) || width <= 0 || height <= 0) return NULL;
+    
+    int thumb_width, thumb_height;
+    thumbnail_dimensions(width, height, &thumb_width, &thumb_height);
+    
+    GdkPixbuf* loaded = gdk_pixbuf_new_from_file_at_scale(filepath, thumb_width, thumb_height, FALSE, NULL);
+    if (!loaded) return NULL;
+    
+    // Keep every thumbnail 8-bit RGBA like the streamed ones
+    GdkPixbuf* thumbnail = gdk_pixbuf_add_alpha(loaded, FALSE, 0, 0, 0);
+    g_object_unref(loaded);
+    return thumbnail;
+}
+
+GdkPixbuf* thumbnail_from_file(const char* filepath) {
+    static const guint8 png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    static const guint8 jpeg_signature[3] = { 0xff, 0xd8, 0xff };
+    
+    FILE* file = fopen(filepath, "rb");
+    if (!file) return NULL;
+    
+    guint8 header[8] = {0};
+    size_t header_len = fread(header, 1, sizeof(header), file);
+    rewind(file);
+    
+    GdkPixbuf* thumbnail = NULL;
+    if (header_len == sizeof(png_signature) && memcmp(header, png_signature, sizeof(png_signature)) == 0) {
+        thumbnail = thumbnail_from_png(file);
+    } else if (header_len >= sizeof(jpeg_signature) && memcmp(header, jpeg_signature, sizeof(jpeg_signature)) == 0) {
+        thumbnail = thumbnail_from_jpeg(file);
+    }
+    fclose(file);
+    
+    if (!thumbnail) {
+        thumbnail = thumbnail_from_pixbuf_loader(filepath);
+    }
+    return thumbnail;
+}
+
+#define DHASH_COLUMNS 9
+#define DHASH_ROWS 8
+
+guint64 thumbnail_perceptual_hash(GdkPixbuf* thumbnail) {
+    if (!thumbnail || gdk_pixbuf_get_bits_per_sample(thumbnail) != 8) return 0;
+    
+    int width = gdk_pixbuf_get_width(thumbnail);
+    int height = gdk_pixbuf_get_height(thumbnail);
+    int stride = gdk_pixbuf_get_rowstride(thumbnail);
+    int channels = gdk_pixbuf_get_n_channels(thumbnail);
+    const guint8* pixels = gdk_pixbuf_read_pixels(thumbnail);
+    if (channels < 3) return 0;
+    
+    // Average the luma of every pixel into its cell
+    guint32 sums[DHASH_ROWS][DHASH_COLUMNS] = {{0}};
+    guint32 counts[DHASH_ROWS][DHASH_COLUMNS] = {{0}};
+    for (int y = 0; y < height; y++) {
+        const guint8* row = pixels + (gsize)y * stride;
+        int cell_y = y * DHASH_ROWS / height;
+        for (int x = 0; x < width; x++) {
+            const guint8* pixel = row + x * channels;
+            int cell_x = x * DHASH_COLUMNS / width;
+            sums[cell_y][cell_x] += (77 * pixel[0] + 150 * pixel[1] + 29 * pixel[2]) >> 8;
+            counts[cell_y][cell_x]++;
+        }
+    }
+    
+    guint64 hash = 0;
+    for (int y = 0; y < DHASH_ROWS; y++) {
+        for (int x = 0; x + 1 < DHASH_COLUMNS; x++) {
+            // Compare the averages without dividing: a/b > c/d <=> a*d > c*b
+            guint64 left = (guint64)sums[y][x] * counts[y][x + 1];
+            guint64 right = (guint64)sums[y][x + 1] * counts[y][x];
+            if (left > right) {
+                hash |= G_GUINT64_CONSTANT(1) << (y * (DHASH_COLUMNS - 1) + x);
+            }
+        }
+    }
+    return hash;
+}
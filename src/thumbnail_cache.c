@@ -0,0 +1,569 @@
+#include "../include/thumbnail_cache.h"
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/*
+ * Pack file layout (all integers little-endian):
+ *
+ *   CacheHeader
+ *   { CacheRecord, path bytes, zlib-compressed RGBA pixels }*
+ *
+ * Records are only ever appended; a later record for the same path
+ * supersedes earlier ones. A torn record at the end (crash while writing)
+ * is cut off the next time the file is opened.
+ *
+ * Several LinShot processes may share the file, so appending, cutting off
+ * a torn end and rewriting it all hold an exclusive flock() on it.
+ */
+
+static const char CACHE_MAGIC[4] = { 'L', 'S', 'T', 'C' };
+#define CACHE_VERSION 2  // 2: thumbnails are no longer padded to a square
+// Rewrite the pack once superseded or stale records take up more than this share
+#define CACHE_MAX_DEAD_RATIO 0.5
+
+typedef struct {
+    char magic[4];
+    guint32 version;
+} CacheHeader;
+
+typedef struct {
+    gint64 mtime;
+    gint64 size;
+    guint32 path_len;
+    guint16 width;
+    guint16 height;
+    guint32 data_len;
+    guint32 reserved;
+} CacheRecord;
+
+G_STATIC_ASSERT(sizeof(CacheHeader) == 8);
+G_STATIC_ASSERT(sizeof(CacheRecord) == 32);
+
+typedef struct {
+    gint64 mtime;
+    gint64 size;
+    gint64 offset;  // Of the record in the pack file, -1 if it was not written
+    int width;
+    int height;
+    gsize data_len;
+    GBytes* data;  // Compressed pixels as a slice of the mapping; NULL for
+                   // records appended since, which are read back by offset
+    bool stale;    // The file has been deleted or changed since
+} CacheEntry;
+
+static GMutex cache_lock;
+static bool cache_mapped = false;  // The pack file has been mapped (if it exists)
+static bool cache_opened = false;  // ... and every record has been indexed
+static GHashTable* entries = NULL;  // path -> CacheEntry*
+static GMappedFile* mapping = NULL;
+static FILE* pack = NULL;           // Opened for appending on first store
+static int reader = -1;             // Reads back records appended after mapping
+static gsize live_bytes = 0;
+static gsize dead_bytes = 0;
+
+static void cache_entry_free(CacheEntry* entry) {
+    if (!entry) return;
+    if (entry->data) g_bytes_unref(entry->data);
+    g_free(entry);
+}
+
+static char* get_cache_path(void) {
+    return g_build_filename(g_get_user_cache_dir(), "linshot", THUMBNAIL_CACHE_FILE, NULL);
+}
+
+static gsize record_bytes(gsize path_len, gsize data_len) {
+    return sizeof(CacheRecord) + path_len + data_len;
+}
+
+static void insert_entry(char* path, CacheEntry* entry) {
+    CacheEntry* old = g_hash_table_lookup(entries, path);
+    if (old) {
+        gsize old_bytes = record_bytes(strlen(path), old->data_len);
+        live_bytes -= old_bytes;
+        dead_bytes += old_bytes;
+    }
+    live_bytes += record_bytes(strlen(path), entry->data_len);
+    g_hash_table_replace(entries, path, entry);
+}
+
+static bool header_valid(const guint8* data, gsize length) {
+    CacheHeader header;
+    if (length < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    return memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+           GUINT32_FROM_LE(header.version) == CACHE_VERSION;
+}
+
+// Decode the record at offset into a CacheEntry (without data) and the
+// location of its path; false if it is torn or corrupt
+static bool parse_record(const guint8* data, gsize length, gsize offset, CacheEntry* entry,
+                         const char** path, gsize* path_len, gsize* data_len) {
+    if (offset < sizeof(CacheHeader) || offset > length || length - offset < sizeof(CacheRecord)) {
+        return false;
+    }
+    
+    CacheRecord record;
+    memcpy(&record, data + offset, sizeof(record));
+    *path_len = GUINT32_FROM_LE(record.path_len);
+    *data_len = GUINT32_FROM_LE(record.data_len);
+    entry->width = GUINT16_FROM_LE(record.width);
+    entry->height = GUINT16_FROM_LE(record.height);
+    
+    if (*path_len == 0 || entry->width == 0 || entry->height == 0 ||
+        *path_len > length - offset - sizeof(record) ||
+        *data_len > length - offset - sizeof(record) - *path_len) {
+        return false;
+    }
+    
+    entry->mtime = GINT64_FROM_LE(record.mtime);
+    entry->size = GINT64_FROM_LE(record.size);
+    entry->offset = (gint64)offset;
+    *path = (const char*)data + offset + sizeof(record);
+    return true;
+}
+
+// Index every complete record of the pack file; returns where the valid data ends
+static gsize scan_pack(GBytes* contents) {
+    gsize length;
+    const guint8* data = g_bytes_get_data(contents, &length);
+    if (!header_valid(data, length)) return 0;
+    
+    gsize offset = sizeof(CacheHeader);
+    CacheEntry parsed;
+    const char* path;
+    gsize path_len, data_len;
+    while (parse_record(data, length, offset, &parsed, &path, &path_len, &data_len)) {
+        CacheEntry* entry = g_new(CacheEntry, 1);
+        *entry = parsed;
+        entry->stale = false;
+        entry->data_len = data_len;
+        entry->data = g_bytes_new_from_bytes(contents, offset + sizeof(CacheRecord) + path_len, data_len);
+        insert_entry(g_strndup(path, path_len), entry);
+        
+        offset += record_bytes(path_len, data_len);
+    }
+    
+    // Anything left is a torn or corrupt tail
+    return offset;
+}
+
+static bool lock_fd(int fd) {
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) return false;
+    }
+    return true;
+}
+
+// Cut the pack file at path back to valid bytes, unless it has grown past
+// length meanwhile: then the tail was another process's append in progress
+static void repair_pack(const char* path, gsize length, gsize valid) {
+    int fd = g_open(path, O_WRONLY, 0);
+    if (fd < 0) return;
+    
+    struct stat st;
+    if (lock_fd(fd) && fstat(fd, &st) == 0 && (gsize)st.st_size == length && ftruncate(fd, (off_t)valid) != 0) {
+        g_warning("Failed to repair thumbnail cache %s", path);
+    }
+    close(fd);
+}
+
+// Map the pack file without indexing it, enough for direct record reads
+static void map_locked(void) {
+    if (cache_mapped) return;
+    cache_mapped = true;
+    
+    char* path = get_cache_path();
+    mapping = g_mapped_file_new(path, FALSE, NULL);
+    g_free(path);
+}
+
+static void open_locked(void) {
+    if (cache_opened) return;
+    cache_opened = true;
+    
+    entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)cache_entry_free);
+    
+    map_locked();
+    char* path = get_cache_path();
+    if (mapping) {
+        GBytes* contents = g_mapped_file_get_bytes(mapping);
+        gsize valid = scan_pack(contents);
+        gsize length = g_bytes_get_size(contents);
+        g_bytes_unref(contents);
+        
+        // Start over on a foreign file; drop a torn tail so appends line up
+        if (valid == 0) {
+            g_hash_table_remove_all(entries);
+            live_bytes = dead_bytes = 0;
+        }
+        if (valid < length) {
+            repair_pack(path, length, valid);
+        }
+    }
+    g_free(path);
+}
+
+static bool write_header(FILE* file) {
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = GUINT32_TO_LE(CACHE_VERSION);
+    return fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+static bool write_record(FILE* file, const char* path, const CacheEntry* entry, GBytes* pixels) {
+    gsize data_len;
+    const guint8* data = g_bytes_get_data(pixels, &data_len);
+    gsize path_len = strlen(path);
+    
+    CacheRecord record = {0};
+    record.mtime = GINT64_TO_LE(entry->mtime);
+    record.size = GINT64_TO_LE(entry->size);
+    record.path_len = GUINT32_TO_LE((guint32)path_len);
+    record.width = GUINT16_TO_LE((guint16)entry->width);
+    record.height = GUINT16_TO_LE((guint16)entry->height);
+    record.data_len = GUINT32_TO_LE((guint32)data_len);
+    
+    return fwrite(&record, sizeof(record), 1, file) == 1 &&
+           fwrite(path, 1, path_len, file) == path_len &&
+           fwrite(data, 1, data_len, file) == data_len;
+}
+
+static bool ensure_pack_locked(void) {
+    if (pack) return true;
+    
+    char* path = get_cache_path();
+    char* dir = g_path_get_dirname(path);
+    g_mkdir_with_parents(dir, 0700);
+    g_free(dir);
+    
+    pack = g_fopen(path, "ab");
+    if (!pack) {
+        g_warning("Failed to open thumbnail cache %s", path);
+    }
+    g_free(path);
+    return pack != NULL;
+}
+
+// Lock the pack file for appending, reopening it if another process has
+// rewritten it since it was opened
+static bool lock_pack_locked(void) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!ensure_pack_locked() || !lock_fd(fileno(pack))) return false;
+        
+        struct stat opened, current;
+        char* path = get_cache_path();
+        bool replaced = fstat(fileno(pack), &opened) != 0 || g_stat(path, &current) != 0 ||
+                        opened.st_dev != current.st_dev || opened.st_ino != current.st_ino;
+        g_free(path);
+        if (!replaced) return true;
+        
+        fclose(pack);
+        pack = NULL;
+        if (reader >= 0) {
+            close(reader);
+            reader = -1;
+        }
+    }
+    return false;
+}
+
+// Append a record for filepath at the end of the pack file, after other
+// processes' appends. Returns its offset, or -1.
+static gint64 append_record_locked(const char* filepath, const CacheEntry* entry, GBytes* pixels) {
+    if (!lock_pack_locked()) return -1;
+    
+    gint64 offset = -1;
+    long start = fseek(pack, 0, SEEK_END) == 0 ? ftell(pack) : -1;
+    if (start == 0 && (!write_header(pack) || fflush(pack) != 0)) {
+        start = -1;
+    } else if (start == 0) {
+        start = (long)sizeof(CacheHeader);
+    }
+    if (start > 0) {
+        if (write_record(pack, filepath, entry, pixels) && fflush(pack) == 0) {
+            offset = start;
+        } else if (ftruncate(fileno(pack), start) != 0) {
+            g_warning("Failed to undo partial thumbnail cache entry for %s", filepath);
+        }
+    }
+    flock(fileno(pack), LOCK_UN);
+    return offset;
+}
+
+static void free_pixels(guchar* pixels, gpointer data) {
+    (void)data;
+    g_free(pixels);
+}
+
+// Compressed pixels of the record at offset, read from the pack file
+// itself, if it is the thumbnail of filepath at this modification time
+// and size
+static GBytes* pread_record_locked(gint64 offset, const char* filepath, gint64 mtime, gint64 size,
+                                   int* width, int* height) {
+    if (reader < 0) {
+        char* path = get_cache_path();
+        reader = g_open(path, O_RDONLY, 0);
+        g_free(path);
+        if (reader < 0) return NULL;
+    }
+    
+    CacheRecord record;
+    if (pread(reader, &record, sizeof(record), (off_t)offset) != (ssize_t)sizeof(record)) return NULL;
+    
+    gsize path_len = strlen(filepath);
+    int record_width = GUINT16_FROM_LE(record.width);
+    int record_height = GUINT16_FROM_LE(record.height);
+    gsize data_len = GUINT32_FROM_LE(record.data_len);
+    if (GINT64_FROM_LE(record.mtime) != mtime || GINT64_FROM_LE(record.size) != size ||
+        GUINT32_FROM_LE(record.path_len) != path_len || record_width == 0 || record_height == 0 ||
+        data_len > compressBound((uLong)record_width * record_height * 4)) {
+        return NULL;
+    }
+    
+    guint8* buffer = g_malloc(path_len + data_len);
+    if (pread(reader, buffer, path_len + data_len, (off_t)(offset + sizeof(record))) != (ssize_t)(path_len + data_len) ||
+        memcmp(buffer, filepath, path_len) != 0) {
+        g_free(buffer);
+        return NULL;
+    }
+    
+    *width = record_width;
+    *height = record_height;
+    GBytes* contents = g_bytes_new_take(buffer, path_len + data_len);
+    GBytes* pixels = g_bytes_new_from_bytes(contents, path_len, data_len);
+    g_bytes_unref(contents);
+    return pixels;
+}
+
+// Compressed pixels of the record at offset, if it is the thumbnail of
+// filepath at this modification time and size. Records appended since
+// the pack file was mapped are read from the file.
+static GBytes* read_record_locked(gint64 offset, const char* filepath, gint64 mtime, gint64 size,
+                                  int* width, int* height) {
+    if (offset < 0) return NULL;
+    if (!mapping || (gsize)offset >= g_mapped_file_get_length(mapping)) {
+        return pread_record_locked(offset, filepath, mtime, size, width, height);
+    }
+    
+    GBytes* contents = g_mapped_file_get_bytes(mapping);
+    gsize length;
+    const guint8* data = g_bytes_get_data(contents, &length);
+    
+    CacheEntry parsed;
+    const char* path;
+    gsize path_len, data_len;
+    GBytes* pixels = NULL;
+    if (header_valid(data, length) &&
+        parse_record(data, length, (gsize)offset, &parsed, &path, &path_len, &data_len) &&
+        parsed.mtime == mtime && parsed.size == size &&
+        path_len == strlen(filepath) && memcmp(path, filepath, path_len) == 0) {
+        pixels = g_bytes_new_from_bytes(contents, (gsize)offset + sizeof(CacheRecord) + path_len, data_len);
+        *width = parsed.width;
+        *height = parsed.height;
+    }
+    
+    g_bytes_unref(contents);
+    return pixels;
+}
+
+GdkPixbuf* thumbnail_cache_lookup_at(const char* filepath, gint64 mtime, gint64 size, gint64* offset) {
+    if (!filepath) return NULL;
+    
+    g_mutex_lock(&cache_lock);
+    GBytes* data = NULL;
+    int width = 0, height = 0;
+    gint64 found = -1;
+    
+    // A remembered offset needs only the mapping, so the pack file is not
+    // indexed as long as every lookup comes with a valid one
+    if (offset && *offset >= 0) {
+        map_locked();
+        data = read_record_locked(*offset, filepath, mtime, size, &width, &height);
+        if (data) found = *offset;
+    }
+    
+    if (!data) {
+        open_locked();
+        CacheEntry* entry = g_hash_table_lookup(entries, filepath);
+        if (entry && entry->mtime == mtime && entry->size == size && entry->data) {
+            data = g_bytes_ref(entry->data);
+            width = entry->width;
+            height = entry->height;
+            found = entry->offset;
+        } else if (entry && entry->mtime == mtime && entry->size == size) {
+            data = read_record_locked(entry->offset, filepath, mtime, size, &width, &height);
+            if (data) found = entry->offset;
+        }
+    }
+    g_mutex_unlock(&cache_lock);
+    
+    if (offset) *offset = found;
+    if (!data) return NULL;
+    
+    // Inflate outside the lock so several workers can decode at once
+    gsize compressed_len;
+    const guint8* compressed = g_bytes_get_data(data, &compressed_len);
+    uLongf pixels_len = (uLongf)width * height * 4;
+    guint8* pixels = g_malloc(pixels_len);
+    int status = uncompress(pixels, &pixels_len, compressed, compressed_len);
+    g_bytes_unref(data);
+    
+    if (status != Z_OK || pixels_len != (uLongf)width * height * 4) {
+        g_free(pixels);
+        return NULL;
+    }
+    
+    return gdk_pixbuf_new_from_data(pixels, GDK_COLORSPACE_RGB, TRUE, 8, width, height, width * 4,
+                                    free_pixels, NULL);
+}
+
+gint64 thumbnail_cache_store(const char* filepath, gint64 mtime, gint64 size, GdkPixbuf* thumbnail) {
+    if (!filepath || !thumbnail) return -1;
+    if (gdk_pixbuf_get_n_channels(thumbnail) != 4 || gdk_pixbuf_get_bits_per_sample(thumbnail) != 8) return -1;
+    
+    int width = gdk_pixbuf_get_width(thumbnail);
+    int height = gdk_pixbuf_get_height(thumbnail);
+    int rowstride = gdk_pixbuf_get_rowstride(thumbnail);
+    if (width > G_MAXUINT16 || height > G_MAXUINT16) return -1;
+    
+    // Pack the rows tightly and compress before taking the lock
+    const guint8* src = gdk_pixbuf_read_pixels(thumbnail);
+    gsize packed_len = (gsize)width * height * 4;
+    guint8* packed = g_malloc(packed_len);
+    for (int y = 0; y < height; y++) {
+        memcpy(packed + (gsize)y * width * 4, src + (gsize)y * rowstride, (gsize)width * 4);
+    }
+    
+    uLongf compressed_len = compressBound(packed_len);
+    guint8* compressed = g_malloc(compressed_len);
+    int status = compress2(compressed, &compressed_len, packed, packed_len, Z_BEST_SPEED);
+    g_free(packed);
+    if (status != Z_OK) {
+        g_free(compressed);
+        return -1;
+    }
+    
+    CacheEntry* entry = g_new0(CacheEntry, 1);
+    entry->mtime = mtime;
+    entry->size = size;
+    entry->offset = -1;
+    entry->width = width;
+    entry->height = height;
+    entry->data_len = compressed_len;
+    GBytes* pixels = g_bytes_new_take(g_realloc(compressed, compressed_len), compressed_len);
+    
+    // Once written, the record is read back from the file when needed
+    // rather than kept on the heap for the rest of the session
+    g_mutex_lock(&cache_lock);
+    open_locked();
+    entry->offset = append_record_locked(filepath, entry, pixels);
+    if (entry->offset < 0) {
+        g_warning("Failed to write thumbnail cache entry for %s", filepath);
+        entry->data = pixels;
+    } else {
+        g_bytes_unref(pixels);
+    }
+    gint64 offset = entry->offset;
+    insert_entry(g_strdup(filepath), entry);
+    g_mutex_unlock(&cache_lock);
+    return offset;
+}
+
+// Count the records of files deleted or changed since they were cached as
+// dead, like superseded ones
+static void mark_stale_locked(void) {
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, entries);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        CacheEntry* entry = value;
+        struct stat st;
+        if (g_stat(key, &st) == 0 && (gint64)st.st_mtime == entry->mtime && (gint64)st.st_size == entry->size) {
+            continue;
+        }
+        
+        gsize bytes = record_bytes(strlen(key), entry->data_len);
+        live_bytes -= bytes;
+        dead_bytes += bytes;
+        entry->stale = true;
+    }
+}
+
+// Rewrite the pack with only the newest record of each file that has not
+// changed since. Other processes wait on the lock meanwhile, and then find
+// the file replaced; what they appended since it was indexed is lost.
+static void compact_locked(void) {
+    char* path = get_cache_path();
+    char* temp_path = g_strconcat(path, ".part", NULL);
+    
+    FILE* file = NULL;
+    int lock = g_open(path, O_RDONLY, 0);
+    if (lock >= 0 && lock_fd(lock)) {
+        file = g_fopen(temp_path, "wb");
+    }
+    bool ok = file && write_header(file);
+    
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, entries);
+    while (ok && g_hash_table_iter_next(&iter, &key, &value)) {
+        CacheEntry* entry = value;
+        if (entry->stale) continue;
+        
+        int width, height;
+        GBytes* pixels = entry->data ? g_bytes_ref(entry->data) :
+                         read_record_locked(entry->offset, key, entry->mtime, entry->size, &width, &height);
+        if (!pixels) continue;
+        ok = write_record(file, key, entry, pixels);
+        g_bytes_unref(pixels);
+    }
+    
+    if (file && fclose(file) != 0) ok = false;
+    if (file && (!ok || g_rename(temp_path, path) != 0)) {
+        g_unlink(temp_path);
+    }
+    if (lock >= 0) close(lock);
+    
+    g_free(temp_path);
+    g_free(path);
+}
+
+void thumbnail_cache_close(void) {
+    g_mutex_lock(&cache_lock);
+    if (pack) {
+        fclose(pack);
+        pack = NULL;
+    }
+    
+    if (entries) {
+        mark_stale_locked();
+        if (dead_bytes > (live_bytes + dead_bytes) * CACHE_MAX_DEAD_RATIO) {
+            compact_locked();
+        }
+    }
+    
+    // Entries may still reference the mapping, so drop them first
+    if (entries) {
+        g_hash_table_destroy(entries);
+        entries = NULL;
+    }
+    if (mapping) {
+        g_mapped_file_unref(mapping);
+        mapping = NULL;
+    }
+    if (reader >= 0) {
+        close(reader);
+        reader = -1;
+    }
+    live_bytes = dead_bytes = 0;
+    cache_opened = false;
+    cache_mapped = false;
+    g_mutex_unlock(&cache_lock);
+}